@@ -57,6 +57,9 @@ bool invert_led=false;	//invert if active low
  *
  * SmoothTimeLoop(2000,10);
  * creates a 2 second long time loop (values: 0 - 1999 repeating), and it will speed up or slow down 10% while transitioning to epoch.
+ *
+ * Once locked, esp1588.SetSmoothClock() does the same for the whole timeline: GetMillis() then slews across a new master or a servo
+ * step instead of jumping or stalling, and GetRawMillis() tells you where it's heading.
  */
 
 SmoothTimeLoop timeloop(1000*NUM_LEDS,20);
@@ -104,6 +107,7 @@ void setup()
 
 
   esp1588.SetDomain(0);	//the domain of your PTP clock, 0 - 31
+//esp1588.SetTaskMode(true);	//ESP32 only: run PTP in a task of its own, then Loop() isn't needed and delay() is fine.
   esp1588.Begin();
 }
 
@@ -0,0 +1,113 @@
+#if defined(ARDUINO_ARCH_ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+
+#include <ESP1588.h>
+
+
+/*
+ *
+ * This example shows how to use my ESP1588 library to synchronize to an IEEE 1588 PTP (Precision Time Protocol) master clock.
+ * It will flash a number of of LEDs in sequence, synchronized with all other units.
+ *
+ * Unlike Blink1588_ISR, nothing polls the time: ESP1588_Scheduler calls blink() every 500ms of PTP time, on the dot,
+ * from a one-shot timer (an os_timer on ESP8266, esp_timer on ESP32) that it keeps adjusted along with the clock.
+ * On ESP8266 that leaves timer1 to analogWrite(), tone() and Servo, so this sketch could just as well dim its LEDs.
+ * In between, the CPU is free. The LEDs jump into step when PTP locks.
+ *
+ */
+
+
+
+#ifndef STASSID
+#define STASSID "your-ssid"
+#define STAPSK  "your-password"
+#endif
+
+const char* ssid     = STASSID;
+const char* password = STAPSK;
+
+
+uint8_t led_pin[]={2};  //just the on-board LED
+
+//uint8_t led_pin[]={4,5,12,13,14};  //which pins to use for LEDs. (D2,D1,D6,D7,D5)
+
+
+bool invert_led=false;	//invert if active low
+
+
+#define NUM_LEDS ((int) (sizeof(led_pin)/sizeof(led_pin[0])))
+
+
+ESP1588_Scheduler scheduler(esp1588);
+
+
+//Runs between loop() passes on ESP8266 and in the esp_timer task on ESP32, so keep it quick. ulDue is the PTP time it was
+//meant for.
+
+void blink(void * ctx, uint64_t ulDue)
+{
+	int cur_interval=(ulDue/500) % (2*NUM_LEDS);
+	int cur_led=cur_interval>>1;
+	int halfcycle=cur_interval & 1;
+
+	for(int i=0;i<NUM_LEDS;i++)
+	{
+		digitalWrite(led_pin[i],(i==cur_led && halfcycle)^invert_led);
+	}
+}
+
+void setup()
+{
+ Serial.begin(115200);
+
+  Serial.println();
+  Serial.println();
+  Serial.print("Connecting to ");
+  Serial.println(ssid);
+
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(ssid, password);
+
+  while (WiFi.status() != WL_CONNECTED) {
+	delay(500);
+	Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println("WiFi connected");
+  Serial.println("IP address: ");
+  Serial.println(WiFi.localIP());
+
+
+  for(int i=0;i<NUM_LEDS;i++)
+  {
+	pinMode(led_pin[i],OUTPUT); //set all LED pins as output
+  }
+
+
+  esp1588.SetDomain(0);	//the domain of your PTP clock, 0 - 31
+  esp1588.Begin();
+
+  scheduler.Begin();
+  scheduler.Every(500,0,blink);	//every 500ms, on the half second
+}
+
+void loop()
+{
+
+  esp1588.Loop();	//still needs to be called often, for PTP itself. the scheduler doesn't depend on it for timing, only to hear about clock adjustments.
+
+
+  static uint32_t last_millis=0;
+
+  if(millis()-last_millis>=4000)	//print a status message every four seconds
+  {
+	last_millis=millis();
+
+	Serial.printf("PTP status: %s   %u cues so far\n",esp1588.GetLockStatus()?"LOCKED":"UNLOCKED",scheduler.GetFired());
+  }
+
+}
@@ -0,0 +1,456 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/*
+ * A simulated PTP network for the benchmarks: grandmasters sending syncs and announces, a WiFi (or wired) link that
+ * delays, bunches up, drops and reorders them, and a client crystal that runs off. Drives an unmodified ESP1588 on a
+ * simulated clock through BeginOffline()/FeedPacket()/Loop(), with no sockets and no real time involved, so a run is
+ * the same every time for the same seed.
+ *
+ * Times are milliseconds of true time since the start of the run. No delay requests are answered, so clients should
+ * use ESP1588_DELAY_NONE, and sit the link's minimum delay behind the master.
+ */
+
+#include <time.h>
+#include <math.h>
+#include <vector>
+#include <queue>
+#include <ESP1588.h>
+
+struct NetSimMaster
+{
+	uint8_t id=1;				//the last octet of its clock identity
+	uint8_t priority1=128;
+	double offset=0;			//ms, its time minus the true time
+	int8_t logSyncInterval=-3;
+	int8_t logAnnounceInterval=0;
+	bool bTwoStep=false;
+
+	double start=0;				//sends from here..
+	double stop=1e18;			//..until here
+	double restart=1e18;		//then again from here, after a reboot: sequence ids start over
+	double restartStep=0;		//ms its time is off by after the reboot
+
+	//set up by NetSim
+
+	double phase=0;
+	double nextSync=0;
+	double nextAnnounce=0;
+	uint16_t seqSync=0;
+	uint16_t seqAnnounce=0;
+	bool bRebooted=false;
+
+	PTP_PORTID PortId() const
+	{
+		PTP_PORTID p;
+		memset(&p,0,sizeof(p));
+		for(int i=0;i<7;i++) p.clockId[i]=0x10+i;
+		p.clockId[7]=id;
+		p.portNumber=htons(1);
+		return p;
+	}
+
+	bool Up(double t) const { return t>=start && (t<stop || t>=restart); }
+
+	double Time(double t) const { return offset+(t>=restart?restartStep:0); }		//offset at true time t
+};
+
+struct NetSimLink
+{
+	int dtim=0;					//beacons per multicast delivery, 0 for a link that doesn't buffer
+	double pathDelay=0.5;		//ms, the least it takes
+	double jitter=1;			//ms, uniform on top
+	int loss=0;					//percent dropped
+	int reorder=0;				//percent held back until after the next one
+	int spikes=0;				//percent held up further (one way, so a delay measurement wouldn't see it either)..
+	double spikeMax=30;			//..by up to this many ms
+};
+
+struct NetSimClock
+{
+	double drift=0;				//ppm the client's crystal is fast
+	double wander=0;			//ppm of slow, temperature like variation on top..
+	double wanderPeriod=600000;	//..over this many ms
+};
+
+class NetSim
+{
+public:
+
+	std::vector<NetSimMaster> masters;
+	NetSimLink link;
+	NetSimClock clock;
+
+	ESP1588 * ptp=nullptr;
+
+	uint32_t packets=0;			//delivered to the client
+	uint64_t ulCpuNanos=0;		//spent in FeedPacket() and the Loop() after it
+
+	NetSim(uint32_t seed)
+	{
+		srand(seed);
+
+		localBase=rand();
+		beaconPhase=(rand()%1024)*0.1;
+		masterBase=1700000000000.0+rand()%1000;
+
+		Current()=this;
+		ESP1588_SetClockSource(Clock);
+	}
+
+	~NetSim()
+	{
+		delete ptp;
+		ESP1588_SetClockSource(nullptr);
+		Current()=nullptr;
+	}
+
+	//Call once the masters, the link and the clock are set up. mechanism and domain as for the real thing.
+
+	void Begin(ESP1588_DelayMechanism mechanism=ESP1588_DELAY_NONE)
+	{
+		for(size_t i=0;i<masters.size();i++)
+		{
+			NetSimMaster & m=masters[i];
+			m.phase=rand()%Interval(m.logSyncInterval);
+			m.nextSync=m.start+m.phase;
+			m.nextAnnounce=m.start;
+		}
+
+		Step(0);
+
+		ptp=new ESP1588;
+		ptp->SetDelayMechanism(mechanism);
+		ptp->BeginOffline();
+	}
+
+	//Runs until true time until, calling observe() after every Loop(): on every delivery, and every 100ms in between.
+
+	template<class F> void Run(double until, F observe)
+	{
+		while(now<until)
+		{
+			double next=now+100;
+			if(next>until) next=until;
+
+			Generate(next);
+
+			bool bDeliver=!queue.empty() && queue.top().arrival<=next;
+			if(bDeliver) next=queue.top().arrival;
+
+			Step(next);
+
+			if(bDeliver)
+			{
+				Delivery d=queue.top();
+				queue.pop();
+
+				struct timespec t0, t1;
+				clock_gettime(CLOCK_MONOTONIC,&t0);
+
+				ptp->FeedPacket(d.port,d.data,d.len,ulLocal,usLocal);
+				ptp->Loop();
+
+				clock_gettime(CLOCK_MONOTONIC,&t1);
+				ulCpuNanos+=(t1.tv_sec-t0.tv_sec)*1000000000LL+(t1.tv_nsec-t0.tv_nsec);
+				packets++;
+			}
+			else
+			{
+				ptp->Loop();
+			}
+
+			observe();
+		}
+	}
+
+	double Now() { return now; }
+
+	//the master the client is following, nullptr if none of ours
+
+	const NetSimMaster * Following()
+	{
+		PTP_PORTID id=ptp->GetMaster().GetPortIdentifier();
+
+		for(size_t i=0;i<masters.size();i++)
+		{
+			if(masters[i].PortId()==id) return &masters[i];
+		}
+		return nullptr;
+	}
+
+	//ms our time is off from that of the master we're following (or the first one, if none)
+
+	int32_t Error()
+	{
+		const NetSimMaster * m=Following();
+		if(!m) m=&masters[0];
+
+		ESP1588_ClockSnapshot snap;
+		ptp->GetClockSnapshot(snap);
+
+		return (int32_t) (snap.Millis(ulLocal)-(uint32_t) (uint64_t) (masterBase+now+m->Time(now)));
+	}
+
+	//the same in microseconds, at the microsecond (the clock source only has the milliseconds)
+
+	int32_t ErrorMicros()
+	{
+		const NetSimMaster * m=Following();
+		if(!m) m=&masters[0];
+
+		ESP1588_ClockSnapshot snap;
+		ptp->GetClockSnapshot(snap);
+
+		uint64_t q=snap.MillisQ32Micros(ulLocal,usLocal);
+		double master=masterBase+now+m->Time(now);
+
+		int32_t ms=(int32_t) ((uint32_t) (q>>32)-(uint32_t) (uint64_t) master);
+
+		return (int32_t) floor((ms+(q & 0xFFFFFFFF)/4294967296.0-(master-floor(master)))*1000+0.5);
+	}
+
+private:
+
+	struct Delivery
+	{
+		double arrival;
+		uint32_t order;			//sent, to keep a burst in order
+		int port;
+		int len;
+		uint8_t data[sizeof(PTP_ANNOUNCE_PACKET)];
+
+		bool operator<(const Delivery & other) const	//backwards, for a min-heap
+		{
+			return arrival>other.arrival || (arrival==other.arrival && order>other.order);
+		}
+	};
+
+	std::priority_queue<Delivery> queue;
+	uint32_t order=0;
+	double lastArrival=0;
+
+	double now=0;
+	uint32_t ulLocal=0;
+	uint16_t usLocal=0;		//microseconds into that millisecond
+
+	uint32_t localBase;
+	double beaconPhase;
+	double masterBase;
+
+	static NetSim *& Current()		//the one driving ESP1588_SetClockSource()
+	{
+		static NetSim * sim=nullptr;
+		return sim;
+	}
+
+	static uint32_t Clock()
+	{
+		return Current()->ulLocal;
+	}
+
+	static uint32_t Interval(int8_t log)
+	{
+		uint32_t ulInterval=log<0?1000>>-log:1000<<log;
+		return ulInterval?ulInterval:1;
+	}
+
+	void Step(double t)
+	{
+		now=t;
+
+		double local=t*(1+clock.drift*1e-6);
+		if(clock.wander!=0) local+=clock.wander*1e-6*clock.wanderPeriod/(2*M_PI)*(1-cos(2*M_PI*t/clock.wanderPeriod));
+
+		ulLocal=localBase+(uint32_t) (int64_t) floor(local);
+		usLocal=(uint16_t) ((local-floor(local))*1000);
+	}
+
+	//everything sent up to true time t, in the order it was sent, on its way through the link
+
+	void Generate(double t)
+	{
+		while(true)
+		{
+			NetSimMaster * m=nullptr;
+			double sent=t;
+
+			for(size_t i=0;i<masters.size();i++)
+			{
+				double next=masters[i].nextSync<masters[i].nextAnnounce?masters[i].nextSync:masters[i].nextAnnounce;
+				if(next<=sent)
+				{
+					m=&masters[i];
+					sent=next;
+				}
+			}
+
+			if(!m) break;
+
+			bool bSync=m->nextSync<=m->nextAnnounce;
+
+			if(bSync) m->nextSync+=Interval(m->logSyncInterval);
+			else m->nextAnnounce+=Interval(m->logAnnounceInterval);
+
+			if(!m->Up(sent))
+			{
+				//skip over the silence. after a reboot the sequence starts over
+
+				if(sent<m->restart && m->restart<1e18)
+				{
+					m->nextSync=m->restart+m->phase;
+					m->nextAnnounce=m->restart;
+				}
+				else
+				{
+					m->nextSync=m->nextAnnounce=1e18;
+				}
+				continue;
+			}
+
+			if(sent>=m->restart && !m->bRebooted)
+			{
+				m->bRebooted=true;
+				m->seqSync=0;
+				m->seqAnnounce=0;
+			}
+
+			if(bSync) SendSync(*m,sent);
+			else SendAnnounce(*m,sent);
+		}
+	}
+
+	void Header(const NetSimMaster & m, PTP_HEADER & h, uint8_t type, int len, uint16_t seq, int8_t logInterval)
+	{
+		h.txSpecificMsgType=type;
+		h.versionPTP=2;
+		h.msgLen=htons(len);
+		h.sourcePortId=m.PortId();
+		h.sequenceId=htons(seq);
+		h.logMessageInterval=logInterval;
+	}
+
+	void Timestamp(PTP_SYNC_MESSAGE & ts, double ms)
+	{
+		uint64_t secs=(uint64_t) (ms/1000);
+		ts.timestamp_secs_ESB=htons((uint16_t) (secs>>32));
+		ts.timestamp_secs=htonl((uint32_t) secs);
+		ts.timestamp_nanos=htonl((uint32_t) ((ms-secs*1000.0)*1000000));
+	}
+
+	void SendSync(NetSimMaster & m, double sent)
+	{
+		uint16_t seq=m.seqSync++;
+		double ms=masterBase+sent+m.Time(sent);
+
+		PTP_PACKET pkt;
+		memset(&pkt,0,sizeof(pkt));
+		Header(m,pkt.header,PTP_MSGTYPE_SYNC,sizeof(pkt),seq,m.logSyncInterval);
+
+		if(m.bTwoStep)
+		{
+			pkt.header.flagField[0]=2;
+
+			//the follow-up with the precise time goes out right behind it
+
+			PTP_PACKET fup;
+			memset(&fup,0,sizeof(fup));
+			Header(m,fup.header,PTP_MSGTYPE_FOLLOW_UP,sizeof(fup),seq,m.logSyncInterval);
+			Timestamp(fup.msg.sync,ms);		//same layout as the follow-up's
+
+			double a=Transmit(sent);
+			if(a>=0)
+			{
+				Queue(a,PTP_EVENT_PORT,&pkt,sizeof(pkt));
+				double b=Transmit(sent+0.1);
+				if(b>=0) Queue(b<a?a:b,PTP_GENERAL_PORT,&fup,sizeof(fup));
+			}
+			return;
+		}
+
+		Timestamp(pkt.msg.sync,ms);
+
+		double a=Transmit(sent);
+		if(a>=0) Queue(a,PTP_EVENT_PORT,&pkt,sizeof(pkt));
+	}
+
+	void SendAnnounce(NetSimMaster & m, double sent)
+	{
+		PTP_ANNOUNCE_PACKET pkt;
+		memset(&pkt,0,sizeof(pkt));
+		Header(m,pkt.header,PTP_MSGTYPE_ANNOUNCE,sizeof(pkt),m.seqAnnounce++,m.logAnnounceInterval);
+		pkt.header.controlField=5;
+		Timestamp(pkt.announce.originTimestamp,masterBase+sent+m.Time(sent));
+		pkt.announce.grandmasterPriority1=m.priority1;
+		pkt.announce.grandmasterClockQuality.clockClass=248;
+		pkt.announce.grandmasterClockQuality.clockAccuracy=0xFE;
+		pkt.announce.grandmasterClockQuality.offsetScaledLogVariance=0xFFFF;
+		pkt.announce.grandmasterPriority2=128;
+		memcpy(pkt.announce.grandmasterIdentity,m.PortId().clockId,sizeof(pkt.announce.grandmasterIdentity));
+		pkt.announce.timeSource=0xA0;
+
+		double a=Transmit(sent);
+		if(a>=0) Queue(a,PTP_GENERAL_PORT,&pkt,sizeof(pkt));
+	}
+
+	//when something sent at true time sent gets to the client, or -1 if it doesn't
+
+	double Transmit(double sent)
+	{
+		if(link.loss && rand()%100<link.loss) return -1;
+
+		double arrival=sent+link.pathDelay+(rand()%1000)*0.001*link.jitter;
+
+		if(link.spikes && rand()%100<link.spikes) arrival+=(rand()%1000)*0.001*link.spikeMax;
+
+		//the link is first in, first out (a packet held up holds up the ones behind it), except for the ones it reorders
+
+		bool bReorder=link.reorder && rand()%100<link.reorder;
+		if(bReorder) arrival+=Interval(masters[0].logSyncInterval)*1.5;
+
+		if(link.dtim)
+		{
+			//held back until the next DTIM beacon, then out in a burst
+
+			double period=102.4*link.dtim;
+			arrival=beaconPhase+ceil((arrival-beaconPhase)/period)*period;
+			if(arrival>lastArrival) arrival+=rand()%3;
+		}
+
+		if(!bReorder && arrival<lastArrival) arrival=lastArrival;
+
+		if(!bReorder) lastArrival=arrival;
+
+		return arrival;
+	}
+
+	void Queue(double arrival, int port, const void * buf, int len)
+	{
+		Delivery d;
+		d.arrival=arrival;
+		d.order=order++;
+		d.port=port;
+		d.len=len;
+		memcpy(d.data,buf,len);
+		queue.push(d);
+	}
+};
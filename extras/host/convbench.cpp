@@ -0,0 +1,272 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * The sync timestamp conversion in FeedSync(): the division-based version it used to have (the 32-bit and the 64-bit value
+ * each worked out separately, and the correction divided) against PTP_SYNC_MESSAGE::GetMillis64() and
+ * PTP_HEADER::GetCorrectionMillis(), in TSC cycles per packet (nanoseconds where there's no TSC). First it checks
+ * PTP_NanosToMillis() against the division for every 32-bit input, and PTP_NanosToMicros() for every one it takes.
+ *
+ * A PC compiler turns a division by a constant into a multiplication by itself, and a recent PC divides quickly in
+ * hardware anyway, so expect the first two rows to be about even with the reciprocal here. The second row divides for
+ * real. The third divides one bit per step as libgcc's __udivsi3/__udivdi3 do on ESP8266, which has no divider, where
+ * the reciprocal is a 32x32 multiply: on this host that row was 450-500 cycles, the reciprocal 16-25. The fourth is the
+ * reciprocal with the correction's sign taken by a branch rather than GetCorrectionMillis()'s masks: 31-35 cycles, as
+ * corrections of either sign mispredict.
+ *
+ * usage: convbench [million packets]
+ */
+
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <ESP1588.h>
+
+static uint64_t Ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000000000+ts.tv_nsec;
+#endif
+}
+
+static volatile uint64_t sink;
+
+__attribute__((noinline)) static uint64_t Old(const PTP_PACKET & pkt)
+{
+	int32_t correction=(int32_t) (pkt.header.GetCorrectionNanos()/1000000);
+
+	uint32_t ptpmillis=
+			(ntohl(pkt.msg.sync.timestamp_secs)*1000) + (ntohl(pkt.msg.sync.timestamp_nanos)/1000000);
+
+	uint64_t ptpmillis64=
+			((((uint64_t) ntohs(pkt.msg.sync.timestamp_secs_ESB)<<32) + ntohl(pkt.msg.sync.timestamp_secs))*1000)
+			+ (ntohl(pkt.msg.sync.timestamp_nanos)/1000000);
+
+	ptpmillis+=correction;
+	ptpmillis64+=correction;
+
+	return ptpmillis64+ptpmillis;
+}
+
+//the same, with a divisor the compiler can't turn into a multiplication: what a CPU without a divider (ESP8266) ends up
+//doing, in software, every time.
+
+static volatile uint32_t divisor=1000000;
+
+__attribute__((noinline)) static uint64_t OldUnknown(const PTP_PACKET & pkt)
+{
+	uint32_t d=divisor;
+
+	int32_t correction=(int32_t) (pkt.header.GetCorrectionNanos()/(int64_t) d);
+
+	uint32_t ptpmillis=
+			(ntohl(pkt.msg.sync.timestamp_secs)*1000) + (ntohl(pkt.msg.sync.timestamp_nanos)/d);
+
+	uint64_t ptpmillis64=
+			((((uint64_t) ntohs(pkt.msg.sync.timestamp_secs_ESB)<<32) + ntohl(pkt.msg.sync.timestamp_secs))*1000)
+			+ ((uint64_t) ntohl(pkt.msg.sync.timestamp_nanos)/d);
+
+	ptpmillis+=correction;
+	ptpmillis64+=correction;
+
+	return ptpmillis64+ptpmillis;
+}
+
+//and with the division done the way libgcc does it on a CPU without a divider, one bit per step: a stand-in for ESP8266's
+//__udivdi3/__udivsi3, so their cost shows up here rather than the host divider's.
+
+__attribute__((noinline)) static uint64_t SoftUDiv64(uint64_t n, uint64_t d)
+{
+	uint64_t q=0;
+	uint64_t r=0;
+
+	for(int i=63;i>=0;i--)
+	{
+		r=(r<<1) | ((n>>i) & 1);
+		if(r>=d)
+		{
+			r-=d;
+			q|=1ULL<<i;
+		}
+	}
+	return q;
+}
+
+__attribute__((noinline)) static uint32_t SoftUDiv32(uint32_t n, uint32_t d)
+{
+	uint32_t q=0;
+	uint32_t r=0;
+
+	for(int i=31;i>=0;i--)
+	{
+		r=(r<<1) | ((n>>i) & 1);
+		if(r>=d)
+		{
+			r-=d;
+			q|=1U<<i;
+		}
+	}
+	return q;
+}
+
+static int64_t SoftDiv64(int64_t n, int64_t d)		//__divdi3: the signs around the unsigned one
+{
+	uint64_t q=SoftUDiv64(n<0?-(uint64_t) n:n,d<0?-(uint64_t) d:d);
+	return (n<0)!=(d<0)?-(int64_t) q:(int64_t) q;
+}
+
+__attribute__((noinline)) static uint64_t OldSoft(const PTP_PACKET & pkt)
+{
+	int32_t correction=(int32_t) SoftDiv64(pkt.header.GetCorrectionNanos(),1000000);
+
+	uint32_t ptpmillis=
+			(ntohl(pkt.msg.sync.timestamp_secs)*1000) + SoftUDiv32(ntohl(pkt.msg.sync.timestamp_nanos),1000000);
+
+	uint64_t ptpmillis64=
+			((((uint64_t) ntohs(pkt.msg.sync.timestamp_secs_ESB)<<32) + ntohl(pkt.msg.sync.timestamp_secs))*1000)
+			+ SoftUDiv64(ntohl(pkt.msg.sync.timestamp_nanos),1000000);
+
+	ptpmillis+=correction;
+	ptpmillis64+=correction;
+
+	return ptpmillis64+ptpmillis;
+}
+
+//the reciprocal with the correction's sign handled by a branch instead, to see what the branchless sign buys
+
+static int32_t CorrectionMillisBranch(const PTP_HEADER & header)
+{
+	int64_t nanos=header.GetCorrectionNanos();
+
+	if(nanos<-0xFFFFFFFFLL || nanos>0xFFFFFFFFLL) return (int32_t) (nanos/1000000);
+	if(nanos<0) return -(int32_t) PTP_NanosToMillis((uint32_t) -nanos);
+	return (int32_t) PTP_NanosToMillis((uint32_t) nanos);
+}
+
+__attribute__((noinline)) static uint64_t NewBranch(const PTP_PACKET & pkt)
+{
+	uint64_t ptpmillis64=pkt.msg.sync.GetMillis64()+CorrectionMillisBranch(pkt.header);
+
+	uint32_t ptpmillis=(uint32_t) ptpmillis64;
+
+	return ptpmillis64+ptpmillis;
+}
+
+__attribute__((noinline)) static uint64_t New(const PTP_PACKET & pkt)
+{
+	uint64_t ptpmillis64=pkt.msg.sync.GetMillis64()+pkt.header.GetCorrectionMillis();
+
+	uint32_t ptpmillis=(uint32_t) ptpmillis64;
+
+	return ptpmillis64+ptpmillis;
+}
+
+static double Measure(const std::vector<PTP_PACKET> & pkts, uint32_t rounds, uint64_t (*fn)(const PTP_PACKET &))
+{
+	uint64_t sum=0;
+
+	uint64_t t0=Ticks();
+	for(uint32_t r=0;r<rounds;r++)
+	{
+		for(size_t i=0;i<pkts.size();i++) sum+=fn(pkts[i]);
+	}
+	uint64_t t1=Ticks();
+
+	sink=sum;
+	return (double) (t1-t0)/((double) rounds*pkts.size());
+}
+
+int main(int argc, char * argv[])
+{
+	uint32_t packets=(argc>1?atoi(argv[1]):10)*1000000;
+
+	uint32_t bad=0;
+	uint32_t n=0;
+	do
+	{
+		if(PTP_NanosToMillis(n)!=n/1000000) bad++;
+	} while(++n);
+
+	printf("PTP_NanosToMillis(): %u of 2^32 inputs differ from dividing\n",bad);
+
+	bad=0;
+	for(n=0;n<6000000;n++)
+	{
+		if(PTP_NanosToMicros(n)!=n/1000) bad++;
+	}
+
+	printf("PTP_NanosToMicros(): %u of 6000000 inputs differ from dividing\n",bad);
+
+	//syncs as they come: a sequence of timestamps, small positive and negative corrections, now and then a huge one
+
+	std::vector<PTP_PACKET> pkts(4096);
+	srand(1588);
+
+	uint64_t ulNanos=1700000000ULL*1000000000+rand();
+
+	for(size_t i=0;i<pkts.size();i++)
+	{
+		PTP_PACKET & pkt=pkts[i];
+		memset(&pkt,0,sizeof(pkt));
+
+		ulNanos+=125000000+rand()%1000;
+		pkt.msg.sync.timestamp_secs_ESB=htons((uint16_t) ((ulNanos/1000000000)>>32));
+		pkt.msg.sync.timestamp_secs=htonl((uint32_t) (ulNanos/1000000000));
+		pkt.msg.sync.timestamp_nanos=htonl((uint32_t) (ulNanos%1000000000));
+
+		int64_t correction=(rand()%4000000)-2000000;
+		if(i%512==0) correction*=100000;
+		pkt.header.SetCorrectionNanos(correction);
+	}
+
+	for(size_t i=0;i<pkts.size();i++)
+	{
+		int64_t c=pkts[i].header.GetCorrectionNanos();
+		if(pkts[i].header.GetCorrectionMillis()!=(int32_t) (c/1000000)) bad++;
+		if(pkts[i].header.GetCorrectionMicros()!=(int32_t) (c%1000000/1000)) bad++;
+		if(pkts[i].msg.sync.GetMicros()!=ntohl(pkts[i].msg.sync.timestamp_nanos)%1000000/1000) bad++;
+		if(Old(pkts[i])!=New(pkts[i]) || OldUnknown(pkts[i])!=New(pkts[i]) || OldSoft(pkts[i])!=New(pkts[i]) || NewBranch(pkts[i])!=New(pkts[i])) bad++;
+	}
+
+	printf("%u of %u packets convert differently\n",bad,(uint32_t) pkts.size());
+
+	uint32_t rounds=packets/pkts.size()+1;
+
+	Measure(pkts,rounds/8+1,Old);		//warm up
+
+#if defined(__x86_64__) || defined(__i386__)
+	printf("cost per packet, TSC cycles\n");
+#else
+	printf("cost per packet, ns\n");
+#endif
+	printf("  dividing, as the compiler sees fit   %6.1f\n",Measure(pkts,rounds,Old));
+	printf("  dividing for real                    %6.1f\n",Measure(pkts,rounds,OldUnknown));
+	printf("  dividing in software, as ESP8266     %6.1f\n",Measure(pkts,rounds,OldSoft));
+	printf("  reciprocal, sign by branch           %6.1f\n",Measure(pkts,rounds,NewBranch));
+	printf("  reciprocal                           %6.1f\n",Measure(pkts,rounds,New));
+
+	return 0;
+}
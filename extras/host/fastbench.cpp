@@ -0,0 +1,127 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * What a time read costs: ESP1588::GetMillis() and GetRawMillis() against ESP1588_FastClock, with the bare local clock
+ * for reference, in TSC cycles per call (nanoseconds where there's no TSC). Then both readers side by side on a simulated
+ * network with a drifting crystal, to show they agree across every clock update.
+ *
+ * The host's "cycle counter" is clock_gettime(), so here the fast reader only saves the snapshot copy and the clamp.
+ * On an ESP the counter is one register read, and it saves millis() as well.
+ *
+ * usage: fastbench [million calls]
+ */
+
+#include <functional>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "NetSim.h"
+
+static uint64_t Ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000000000+ts.tv_nsec;
+#endif
+}
+
+static volatile uint32_t sink;
+
+static void Measure(const char * name, uint32_t calls, std::function<uint32_t()> read)
+{
+	uint32_t sum=0;
+
+	for(uint32_t i=0;i<calls/16;i++) sum+=read();		//warm up
+
+	uint64_t t0=Ticks();
+	for(uint32_t i=0;i<calls;i++) sum+=read();
+	uint64_t t1=Ticks();
+
+	sink=sum;
+	printf("%-32s %8.1f\n",name,(double) (t1-t0)/calls);
+}
+
+int main(int argc, char * argv[])
+{
+	uint32_t calls=(argc>1?atoi(argv[1]):10)*1000000;
+
+#if defined(__x86_64__) || defined(__i386__)
+	printf("cost per call, TSC cycles\n");
+#else
+	printf("cost per call, ns\n");
+#endif
+
+	{
+		ESP1588 ptp;
+		ptp.BeginOffline();
+		ESP1588_FastClock fast(ptp);
+
+		Measure("ESP1588_Millis()",calls,[&]() { return ESP1588_Millis(); });
+		Measure("ESP1588::GetMillis()",calls,[&]() { return ptp.GetMillis(); });
+		Measure("ESP1588::GetRawMillis()",calls,[&]() { return ptp.GetRawMillis(); });
+		Measure("ESP1588_FastClock::GetMillis()",calls,[&]() { return fast.GetMillis(); });
+
+		ptp.SetSmoothClock(100000);
+		ptp.BeginOffline();			//publishes with the smooth clock on
+		Measure("  smooth clock, GetMillis()",calls,[&]() { return ptp.GetMillis(); });
+	}
+
+	//agreement: every 100ms and on every packet, over 10 minutes of a drifting crystal locked to a master
+
+	for(int smooth=0;smooth<2;smooth++)
+	{
+		NetSim sim(1588);
+		NetSimMaster m;
+		m.logSyncInterval=-3;
+		sim.masters.push_back(m);
+		sim.clock.drift=40;
+		sim.clock.wander=5;
+		sim.clock.wanderPeriod=120000;
+		sim.masters[0].stop=300000;			//a reboot: a step back after it
+		sim.masters[0].restart=310000;
+		sim.masters[0].restartStep=-15;
+		sim.Begin();
+
+		if(smooth) sim.ptp->SetSmoothClock(100000,60000);
+
+		ESP1588_FastClock fast(*sim.ptp);
+
+		uint32_t reads=0;
+		uint32_t differ=0;
+
+		sim.Run(600000,[&]()
+		{
+			uint32_t a=fast.GetMillis();
+			uint32_t b=sim.ptp->GetMillis();
+
+			reads++;
+			if(a!=b) differ++;
+		});
+
+		printf("%s: %u reads on a simulated clock, %u where FastClock and GetMillis() differ\n",smooth?"smooth clock":"plain clock ",reads,differ);
+	}
+
+	return 0;
+}
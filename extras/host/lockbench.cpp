@@ -0,0 +1,159 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Time to lock from a cold start, on a simulated clock and a simulated master (see NetSim.h).
+ * Every trial starts at a random sync phase, beacon phase and crystal error, and runs on for a while after lock to check
+ * that it was a lock worth declaring. A lock on the DTIM bounds further from the master than half the distance between them
+ * (plus the path delay, which nothing here measures) means one of them was wrong, and fails the run.
+ *
+ * usage: lockbench [trials] [logSyncInterval]
+ */
+
+#include <vector>
+#include <algorithm>
+#include "NetSim.h"
+
+#define SIM_TIMEOUT		60000		//ms. no lock by then counts as a failure
+#define SIM_AFTER		10000		//ms to keep going after lock
+#define SIM_PATH_DELAY	1			//ms, the master to us minimum
+
+struct Scenario
+{
+	const char * name;
+	int dtim;			//beacons per multicast delivery, 0 for none
+	int spikes;			//percent of packets that get held up by a further 0..30 ms (a busy network)
+};
+
+static const Scenario scenarios[]=
+{
+	{"wired",	0,	0},
+	{"busy",	0,	10},
+	{"dtim1",	1,	0},
+	{"dtim3",	3,	0},
+};
+
+struct Result
+{
+	bool bLocked;
+	uint32_t ulTimeToLock;		//ms from the first sync
+	int32_t errAtLock;			//ms, our time minus the master's
+	int16_t boundsAtLock;		//ms between the DTIM bounds it locked on, -1 for none
+	int32_t errAfter;			//worst in SIM_AFTER after lock
+	bool bHeld;					//still locked SIM_AFTER later
+};
+
+static Result Trial(const Scenario & sc, int logInterval, uint32_t seed)
+{
+	NetSim sim(seed);
+
+	NetSimMaster m;
+	m.logSyncInterval=logInterval;
+	sim.masters.push_back(m);
+
+	sim.link.dtim=sc.dtim;
+	sim.link.pathDelay=SIM_PATH_DELAY;
+	sim.link.jitter=sc.dtim?0:1;
+	sim.link.spikes=sc.spikes;
+	sim.clock.drift=((rand()%1001)-500)*0.1;		//+-50ppm
+
+	sim.Begin();
+
+	Result r;
+	memset(&r,0,sizeof(r));
+
+	double lockTime=0;
+	double firstSync=sim.masters[0].phase;
+
+	sim.Run(SIM_TIMEOUT+SIM_AFTER,[&]()
+	{
+		if(!r.bLocked)
+		{
+			if(!sim.ptp->GetLockStatus()) return;
+
+			r.bLocked=true;
+			lockTime=sim.Now();
+			r.ulTimeToLock=(uint32_t) (sim.Now()-firstSync);
+			r.errAtLock=sim.Error();
+
+			ESP1588_Stats st;
+			sim.ptp->GetStats(st);
+			r.boundsAtLock=st.dtimBoundsMs;
+			r.errAfter=r.errAtLock;
+		}
+		else if(sim.Now()<=lockTime+SIM_AFTER)
+		{
+			int32_t err=sim.Error();
+			if(abs(err)>abs(r.errAfter)) r.errAfter=err;
+
+			r.bHeld=sim.ptp->GetLockStatus();
+		}
+	});
+
+	return r;
+}
+
+static uint32_t Percentile(std::vector<uint32_t> & v, int p)
+{
+	if(v.empty()) return 0;
+	return v[(v.size()-1)*p/100];
+}
+
+int main(int argc, char * argv[])
+{
+	int trials=argc>1?atoi(argv[1]):200;
+	int logInterval=argc>2?atoi(argv[2]):-3;
+
+	printf("logSyncInterval %d, %d trials per scenario. time to lock in ms from the first sync, errors in ms\n",logInterval,trials);
+	printf("%-8s %6s %6s %6s %6s   %9s %9s   %8s %8s\n","","locked","p50","p90","max","err@lock","err+10s","held","outside");
+
+	int failures=0;
+
+	for(int s=0;s<(int) (sizeof(scenarios)/sizeof(scenarios[0]));s++)
+	{
+		std::vector<uint32_t> times;
+		int32_t worstAtLock=0;
+		int32_t worstAfter=0;
+		int held=0;
+		int outside=0;
+
+		for(int i=0;i<trials;i++)
+		{
+			Result r=Trial(scenarios[s],logInterval,1588+i);
+
+			if(!r.bLocked) continue;
+
+			times.push_back(r.ulTimeToLock);
+			if(abs(r.errAtLock)>abs(worstAtLock)) worstAtLock=r.errAtLock;
+			if(abs(r.errAfter)>abs(worstAfter)) worstAfter=r.errAfter;
+			if(r.bHeld) held++;
+			if(r.boundsAtLock>=0 && abs(r.errAtLock)>r.boundsAtLock/2+SIM_PATH_DELAY) outside++;
+		}
+
+		std::sort(times.begin(),times.end());
+
+		printf("%-8s %6d %6u %6u %6u   %9d %9d   %8d %8d\n",scenarios[s].name,(int) times.size(),
+				Percentile(times,50),Percentile(times,90),Percentile(times,100),worstAtLock,worstAfter,held,outside);
+
+		failures+=outside;
+	}
+
+	return failures?1:0;
+}
@@ -0,0 +1,186 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compares SmoothTimeLoop with the whole-millisecond version it replaced, on a simulated clock: a crystal 50ppm off,
+ * GetMillis() running on local time until lock and then jumping to PTP time, and the loop read every tick ms.
+ * Reports how long it took to get into step after lock, how far off it was after that, the biggest step its output
+ * took in one tick beyond the tick itself, and the time per call.
+ *
+ * usage: loopbench [tick] [cycle] [percent]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <SmoothTimeLoop.h>
+
+#define SIM_LOCK		10000		//ms of true time
+#define SIM_DURATION	120000
+#define SIM_DRIFT		50e-6
+
+static uint64_t Nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+//the old way: whole milliseconds of offset, two modulos per call
+
+class OldTimeLoop
+{
+public:
+	OldTimeLoop(int cycle_millis, int max_percent_adjustment) : cycle_millis(cycle_millis), max_percent_adjustment(max_percent_adjustment) {}
+
+	uint32_t GetCycleMillis(uint32_t esp1588_millis, uint32_t system_millis)
+	{
+		int32_t millis_since_last=system_millis-last_system_millis;
+
+		uint32_t s=(system_millis+offset_millis) % cycle_millis;
+		uint32_t t=esp1588_millis % cycle_millis;
+
+		int32_t diff=WrapAround(t-s,(cycle_millis>>1));
+
+		if(abs(diff)>1)
+		{
+			int needed_correction=diff;
+			int max_corr=(millis_since_last * max_percent_adjustment)/100;
+			if(needed_correction>max_corr) needed_correction=max_corr;
+			else if(needed_correction<-max_corr) needed_correction=-max_corr;
+
+			offset_millis += needed_correction;
+		}
+
+		last_system_millis=system_millis;
+
+		return s;
+	}
+
+private:
+	int cycle_millis;
+	int max_percent_adjustment;
+	uint32_t last_system_millis=0;
+	int offset_millis=0;
+
+	static int32_t WrapAround(int32_t input, int32_t wrap)
+	{
+		if(input>=wrap) input=-(wrap<<1)+input;
+		else if(input<-wrap) input+=(wrap<<1);
+		return input;
+	}
+};
+
+struct Result
+{
+	int32_t settle;		//ms after lock until within a millisecond, -1 if never
+	int32_t worst;		//ms, after that
+	int32_t step;		//ms, the biggest jump of the output beyond the tick
+	double ns;			//per call
+};
+
+template<class LOOP> static Result Run(LOOP & loop, int tick, int cycle)
+{
+	Result r;
+	r.settle=-1;
+	r.worst=0;
+	r.step=0;
+
+	uint32_t localBase=123456;
+	uint64_t ptpBase=1700000000000ULL+777;
+
+	int32_t last=-1;
+
+	for(int t=0;t<SIM_DURATION;t+=tick)
+	{
+		uint32_t local=localBase+(uint32_t) floor(t*(1+SIM_DRIFT));
+		uint32_t ptp=t<SIM_LOCK?local:(uint32_t) (ptpBase+t);
+
+		int32_t out=loop.GetCycleMillis(ptp,local);
+
+		if(last>=0)
+		{
+			int32_t step=out-last-tick;
+			if(step<-cycle/2) step+=cycle;
+			if(abs(step)>abs(r.step)) r.step=step;
+		}
+		last=out;
+
+		if(t<SIM_LOCK) continue;
+
+		int32_t err=out-(int32_t) (ptp%cycle);
+		if(err>=cycle/2) err-=cycle;
+		else if(err<-cycle/2) err+=cycle;
+
+		if(r.settle<0)
+		{
+			if(abs(err)<=1) r.settle=t-SIM_LOCK;
+		}
+		else if(abs(err)>abs(r.worst))
+		{
+			r.worst=err;
+		}
+	}
+
+	//and the cost of a call, on its own
+
+	const int calls=10000000;
+	volatile uint32_t sink=0;
+
+	uint64_t t0=Nanos();
+	for(int i=0;i<calls;i++)
+	{
+		sink+=loop.GetCycleMillis(1000000+i+(i>>8),i);
+	}
+	r.ns=(double) (Nanos()-t0)/calls;
+
+	return r;
+}
+
+static void Print(const char * name, const Result & r)
+{
+	if(r.settle<0) printf("%-8s %8s %8s %8d %8.2f\n",name,"never","-",r.step,r.ns);
+	else printf("%-8s %8d %8d %8d %8.2f\n",name,r.settle,r.worst,r.step,r.ns);
+}
+
+int main(int argc, char * argv[])
+{
+	int tick=argc>1?atoi(argv[1]):1;
+	int cycle=argc>2?atoi(argv[2]):2000;
+	int percent=argc>3?atoi(argv[3]):20;
+
+	if(tick<1 || cycle<2)
+	{
+		fprintf(stderr,"usage: %s [tick] [cycle] [percent]\n",argv[0]);
+		return 1;
+	}
+
+	printf("read every %d ms, %d ms cycle, %d%% adjustment, lock at %d s. times in ms\n",tick,cycle,percent,SIM_LOCK/1000);
+	printf("%-8s %8s %8s %8s %8s\n","","settle","worst","step","ns/call");
+
+	OldTimeLoop old(cycle,percent);
+	Print("old",Run(old,tick,cycle));
+
+	SmoothTimeLoop loop(cycle,percent);
+	Print("new",Run(loop,tick,cycle));
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compares the sync manager's peak filter (ESP1588_PeakFilter, monotonic deque over a time window)
+ * with the rescan of the last N diffs it replaced, on simulated DTIM-bursty sync arrivals.
+ *
+ * usage: peakbench [logSyncInterval] [packets]
+ */
+
+#include <time.h>
+#include <PeakFilter.h>
+
+static uint64_t Nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+//the old way: a ring of the last 64 diffs, rescanning numpackets of them for every packet
+
+struct RescanFilter
+{
+	int16_t diffHistory[64];
+	uint16_t diffHistoryIdx=0;
+
+	RescanFilter()
+	{
+		for(int i=0;i<64;i++) diffHistory[i]=-32768;
+	}
+
+	int16_t Insert(int16_t diff, int numpackets)
+	{
+		diffHistory[diffHistoryIdx]=diff;
+		diffHistoryIdx=(diffHistoryIdx+1)%64;
+
+		int idx=(diffHistoryIdx+64-1)%64;
+		int16_t peak_diff=-32768;
+
+		for(int i=0;i<numpackets;i++)
+		{
+			if(peak_diff<diffHistory[idx]) peak_diff=diffHistory[idx];
+			idx--;
+			if(idx<0) idx=63;
+		}
+
+		return peak_diff;
+	}
+};
+
+int main(int argc, char * argv[])
+{
+	int logInterval=argc>1?atoi(argv[1]):-4;
+	int packets=argc>2?atoi(argv[2]):10000000;
+
+	uint32_t interval=logInterval<0?1000>>-logInterval:1000<<logInterval;
+	if(!interval) interval=1;
+
+	int numpackets=logInterval<=-2?4<<-logInterval:8;
+	if(numpackets>64) numpackets=64;
+
+	//arrival times and diffs. packets are held back until the next DTIM 3 beacon (307 ms), plus a little air time jitter.
+
+	uint32_t * arrival=new uint32_t[packets];
+	int16_t * diff=new int16_t[packets];
+
+	srand(1588);
+
+	for(int i=0;i<packets;i++)
+	{
+		uint32_t sent=i*interval;
+		uint32_t beacon=((sent/307)+1)*307;
+		arrival[i]=beacon+rand()%3;
+		diff[i]=-(int16_t) (arrival[i]-sent);
+	}
+
+	//same window as the count based filter, so both should pick the same peaks
+
+	ESP1588_PeakFilter filter;
+	filter.SetWindow((numpackets-1)*interval);
+
+	RescanFilter rescan;
+
+	int64_t sumRescan=0;
+	int64_t sumDeque=0;
+
+	uint64_t t0=Nanos();
+	for(int i=0;i<packets;i++)
+	{
+		sumRescan+=rescan.Insert(diff[i],numpackets);
+	}
+	uint64_t t1=Nanos();
+	for(int i=0;i<packets;i++)
+	{
+		filter.Insert(i*interval,diff[i]);
+		sumDeque+=filter.GetPeak();
+	}
+	uint64_t t2=Nanos();
+
+	printf("logSyncInterval %d: %d packets, window %d packets / %u ms\n",logInterval,packets,numpackets,filter.GetWindow());
+	printf("  rescan: %6.2f ns/packet\n",(double) (t1-t0)/packets);
+	printf("  deque:  %6.2f ns/packet\n",(double) (t2-t1)/packets);
+	printf("  results %s\n",sumRescan==sumDeque?"agree":"DIFFER");
+
+	delete [] arrival;
+	delete [] diff;
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Host equivalent of the Blink1588 example: joins the PTP multicast group on all interfaces
+ * and prints lock status once per second, and the statistics (ESP1588::GetStats()) every ESP1588_STATS_SHORT_WINDOW.
+ *
+ * usage: ptpclient [-t] [-s statefile] [-r trace] [-c capture] [domain]
+ *
+ *   -t  run the PTP engine in its own thread (ESP1588::SetTaskMode()) instead of polling Loop() from main()
+ *   -s  keep the learned state in statefile (ESP1588::SetStatePersistence()), so the next run starts warm
+ *   -r  record every PTP packet received and sent to trace (pcapng), for Wireshark or replay
+ *   -c  keep the last ESP1588_CAPTURE_PACKETS in RAM (ESP1588_CaptureRing), written to capture on SIGUSR1 and on exit
+ *
+ * Ports 319/320 are privileged, so run it as root or grant CAP_NET_BIND_SERVICE.
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <ESP1588.h>
+
+static ESP1588_PcapWriter recorder;
+static FILE * trace=nullptr;
+
+static ESP1588_CaptureRing ring;
+static const char * capture=nullptr;
+
+static volatile sig_atomic_t signalled=0;
+
+static bool WriteFile(void * ctx, const void * buf, size_t len)
+{
+	return fwrite(buf,1,len,(FILE *) ctx)==len;
+}
+
+static void Record(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len)
+{
+	if(trace) recorder.Packet(ulTimestamp,port,bSent,buf,len);
+	if(capture) ring.Insert(ulTimestamp,port,bSent,buf,len);
+}
+
+static void OnSignal(int sig)
+{
+	signalled=sig;
+}
+
+static void WriteCapture()
+{
+	FILE * f=fopen(capture,"wb");
+	int n=f?ring.Export(WriteFile,f):-1;
+	if(f) fclose(f);
+
+	if(n<0) fprintf(stderr,"can't write %s\n",capture);
+	else printf("Wrote the last %d of %u packets to %s\n",n,ring.GetCount(),capture);
+}
+
+static void PrintPTPInfo(ESP1588_Tracker & t)
+{
+	const PTP_ANNOUNCE_MESSAGE & msg=t.GetAnnounceMessage();
+	const PTP_PORTID & pid=t.GetPortIdentifier();
+
+	printf("    %s: ID ",t.IsMaster()?"Master   ":"Candidate");
+	for(int i=0;i<(int) (sizeof(pid.clockId)/sizeof(pid.clockId[0]));i++)
+	{
+		printf("%02x ",pid.clockId[i]);
+	}
+
+	printf(" Prio %3d ",msg.grandmasterPriority1);
+
+	printf(" %i-step",t.IsTwoStep()?2:1);
+
+	printf("\n");
+}
+
+int main(int argc, char * argv[])
+{
+	int arg=1;
+
+	while(arg<argc && argv[arg][0]=='-')
+	{
+		if(!strcmp(argv[arg],"-t"))
+		{
+			esp1588.SetTaskMode(true);
+		}
+		else if(!strcmp(argv[arg],"-s") && arg+1<argc)
+		{
+			ESP1588_SetStateFile(argv[++arg]);
+			esp1588.SetStatePersistence(true);
+		}
+		else if(!strcmp(argv[arg],"-r") && arg+1<argc)
+		{
+			trace=fopen(argv[++arg],"wb");
+			if(!trace || !recorder.Begin(WriteFile,trace))
+			{
+				fprintf(stderr,"can't write %s\n",argv[arg]);
+				return 1;
+			}
+			esp1588.SetPacketHook(Record);
+		}
+		else if(!strcmp(argv[arg],"-c") && arg+1<argc)
+		{
+			capture=argv[++arg];
+			esp1588.SetPacketHook(Record);
+
+			signal(SIGUSR1,OnSignal);
+			signal(SIGINT,OnSignal);
+			signal(SIGTERM,OnSignal);
+		}
+		else
+		{
+			fprintf(stderr,"usage: %s [-t] [-s statefile] [-r trace] [-c capture] [domain]\n",argv[0]);
+			return 1;
+		}
+		arg++;
+	}
+
+	esp1588.SetDomain(arg<argc?atoi(argv[arg]):0);
+
+	if(!esp1588.Begin())
+	{
+		fprintf(stderr,"multicast join failed (are ports 319/320 available?)\n");
+		return 1;
+	}
+
+	uint32_t last_print=ESP1588_Millis();
+	int prints=0;
+
+	while(true)
+	{
+		esp1588.Loop();		//returns immediately in task mode
+
+		if(signalled)
+		{
+			int sig=signalled;
+			signalled=0;
+
+			WriteCapture();
+			if(sig!=SIGUSR1) break;
+		}
+
+		if(ESP1588_Millis()-last_print>=1000)
+		{
+			last_print=ESP1588_Millis();
+
+			ESP1588_Tracker & m=esp1588.GetMaster();
+			ESP1588_Tracker & c=esp1588.GetCandidate();
+
+			if(esp1588.GetHoldover())
+			{
+				printf("PTP holdover: %u s, error up to %u ms\n",esp1588.GetHoldoverAgeMs()/1000,esp1588.GetHoldoverErrorMs());
+			}
+
+			printf("PTP status: %s  diff %d ms  delay %d ms  DTIM %u  %u pps   Master %s, Candidate %s\n",esp1588.GetLockStatus()?"LOCKED":"UNLOCKED",
+					esp1588.GetLastDiffMs(),esp1588.GetMeanPathDelayMs(),esp1588.GetDtim(),esp1588.GetRawPPS(),m.Healthy()?"OK":"no",c.Healthy()?"OK":"no");
+
+			PrintPTPInfo(m);
+			PrintPTPInfo(c);
+
+			if(++prints%ESP1588_STATS_SHORT_WINDOW==0)
+			{
+				ESP1588_Stats st;
+				esp1588.GetStats(st);
+
+				printf("    Stats: rx %u/%u (%u ignored)  syncs %u (%u rejected)  locked %u time(s), last after %u ms  master changes %u\n",
+						st.rxEvent,st.rxGeneral,st.rxIgnored,st.syncAccepted,st.syncRejected,st.locks,st.timeToLock,st.masterChanges);
+
+				if(st.offsetShort.samples)
+				{
+					printf("    Offset over %u s: %d..%d ms  mean %.3f ms  stddev %.3f ms  (%u syncs, master sent %u)\n",ESP1588_STATS_SHORT_WINDOW,
+							st.offsetShort.min,st.offsetShort.max,st.offsetShort.meanUs/1000.0,st.offsetShort.stddevUs/1000.0,
+							st.offsetShort.samples,st.master.syncs);
+				}
+			}
+
+			fflush(stdout);
+			if(trace) fflush(trace);
+		}
+
+		usleep(1000);
+	}
+
+	esp1588.Quit();
+	if(trace) fclose(trace);
+
+	return 0;
+}
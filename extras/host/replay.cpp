@@ -0,0 +1,475 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Re-runs the PTP engine on a recorded packet trace, on a clock that follows the trace's timestamps, so a problem seen
+ * in the field can be run again (and again, against a changed servo) on the host.
+ *
+ * usage: replay [-v] [-d domain] [-m none|e2e|p2p] trace
+ *
+ *   -v  a line for every sync the servo accepted, besides the lock transitions and the statistics every ESP1588_STATS_SHORT_WINDOW
+ *   -d  PTP domain. default: that of our first delay request in the trace, or else of the first announce
+ *   -m  delay mechanism. default: what our requests in the trace say, or none if there are none
+ *
+ * The trace is pcapng as written by ESP1588_PcapWriter (ESP1588::SetPacketHook(), ptpclient -r), whose timestamps are the
+ * recording device's own. Captures of PTP traffic by other tools (pcap or pcapng, Ethernet or raw IP) work too, as if
+ * received by a client with no delay measurement whose clock was the capturing machine's.
+ */
+
+#include <math.h>
+#include <vector>
+#include <ESP1588.h>
+
+struct Record
+{
+	uint32_t ulTimestamp;		//ms
+	int port;
+	bool bSent;
+	std::vector<uint8_t> data;	//the PTP message
+};
+
+static uint32_t ulSimNow=0;
+
+static uint32_t SimClock()
+{
+	return ulSimNow;
+}
+
+//the PTP message in an IPv4 datagram, UDP port 319 or 320. returns false if it isn't one
+
+static bool ParseIp(const uint8_t * p, int len, Record & rec)
+{
+	if(len<20 || (p[0]>>4)!=4 || p[9]!=17) return false;
+
+	int ihl=(p[0] & 0xF)*4;
+	if(len<ihl+8) return false;
+
+	const uint8_t * udp=p+ihl;
+	int port=(udp[2]<<8) | udp[3];
+	int udpLen=(udp[4]<<8) | udp[5];
+
+	if(port!=PTP_EVENT_PORT && port!=PTP_GENERAL_PORT) return false;
+
+	int payload=udpLen-8;
+	if(payload>len-ihl-8) payload=len-ihl-8;
+	if(payload<(int) sizeof(PTP_HEADER)) return false;
+
+	rec.port=port;
+	rec.data.assign(udp+8,udp+8+payload);
+	return true;
+}
+
+static bool ParseFrame(int linktype, const uint8_t * p, int len, Record & rec)
+{
+	switch(linktype)
+	{
+	case 1:		//Ethernet, maybe with a VLAN tag
+	{
+		int off=12;
+		if(len>=off+2 && p[off]==0x81 && p[off+1]==0x00) off+=4;
+		if(len<off+2 || p[off]!=0x08 || p[off+1]!=0x00) return false;
+		return ParseIp(p+off+2,len-off-2,rec);
+	}
+	case 101:	//raw IP
+	case 228:	//IPv4
+		return ParseIp(p,len,rec);
+	default:
+		return false;
+	}
+}
+
+static uint32_t Get32(const uint8_t * p, bool bSwap)
+{
+	uint32_t v;
+	memcpy(&v,p,4);
+	return bSwap?__builtin_bswap32(v):v;
+}
+
+static uint16_t Get16(const uint8_t * p, bool bSwap)
+{
+	uint16_t v;
+	memcpy(&v,p,2);
+	return bSwap?__builtin_bswap16(v):v;
+}
+
+static bool LoadPcapng(const std::vector<uint8_t> & f, std::vector<Record> & out)
+{
+	bool bSwap=false;
+	std::vector<int> linktypes;
+	std::vector<uint64_t> divisors;		//timestamp units per ms
+
+	size_t pos=0;
+	while(pos+12<=f.size())
+	{
+		const uint8_t * b=&f[pos];
+
+		if(Get32(b,false)==0x0A0D0D0A)		//section header, the byte order may change
+		{
+			bSwap=Get32(b+8,false)!=0x1A2B3C4D;
+			linktypes.clear();
+			divisors.clear();
+		}
+
+		uint32_t type=Get32(b,bSwap);
+		uint32_t len=Get32(b+4,bSwap);
+
+		if(len<12 || pos+len>f.size()) return false;
+
+		if(type==1 && len>=20)
+		{
+			linktypes.push_back(Get16(b+8,bSwap));
+
+			uint64_t units=1000000;			//microseconds unless an if_tsresol option says otherwise
+
+			for(uint32_t o=16;o+4<=len-4;)
+			{
+				uint16_t code=Get16(b+o,bSwap);
+				uint16_t olen=Get16(b+o+2,bSwap);
+				if(code==0) break;
+				if(code==9 && olen>=1)
+				{
+					uint8_t r=b[o+4];
+					units=1;
+					for(int i=0;i<(r & 0x7F);i++) units*=(r & 0x80)?2:10;
+				}
+				o+=4+((olen+3) & ~3);
+			}
+
+			divisors.push_back(units>=1000?units/1000:1);
+		}
+		else if(type==6 && len>=32)
+		{
+			uint32_t iface=Get32(b+8,bSwap);
+			uint64_t ts=((uint64_t) Get32(b+12,bSwap)<<32) | Get32(b+16,bSwap);
+			uint32_t caplen=Get32(b+20,bSwap);
+
+			if(iface<linktypes.size() && 28+caplen<=len)
+			{
+				Record rec;
+				rec.ulTimestamp=(uint32_t) (ts/divisors[iface]);
+				rec.bSent=false;
+
+				//epb_flags: the direction is in the low two bits, 2 is outbound
+
+				uint32_t o=28+((caplen+3) & ~3);
+				while(o+4<=len-4)
+				{
+					uint16_t code=Get16(b+o,bSwap);
+					uint16_t olen=Get16(b+o+2,bSwap);
+					if(code==0) break;
+					if(code==2 && olen==4) rec.bSent=(Get32(b+o+4,bSwap) & 3)==2;
+					o+=4+((olen+3) & ~3);
+				}
+
+				if(ParseFrame(linktypes[iface],b+28,caplen,rec)) out.push_back(rec);
+			}
+		}
+
+		pos+=len;
+	}
+
+	return true;
+}
+
+static bool LoadPcap(const std::vector<uint8_t> & f, std::vector<Record> & out)
+{
+	uint32_t magic=Get32(&f[0],false);
+
+	bool bSwap=magic==0xD4C3B2A1 || magic==0x4D3CB2A1;
+	bool bNanos=magic==0xA1B23C4D || magic==0x4D3CB2A1;
+
+	int linktype=(int) Get32(&f[20],bSwap);
+
+	size_t pos=24;
+	while(pos+16<=f.size())
+	{
+		uint32_t secs=Get32(&f[pos],bSwap);
+		uint32_t frac=Get32(&f[pos+4],bSwap);
+		uint32_t caplen=Get32(&f[pos+8],bSwap);
+
+		if(pos+16+caplen>f.size()) break;
+
+		Record rec;
+		rec.ulTimestamp=(uint32_t) ((uint64_t) secs*1000+frac/(bNanos?1000000:1000));
+		rec.bSent=false;
+
+		if(ParseFrame(linktype,&f[pos+16],caplen,rec)) out.push_back(rec);
+
+		pos+=16+caplen;
+	}
+
+	return true;
+}
+
+static bool Load(const char * path, std::vector<Record> & out)
+{
+	FILE * fp=fopen(path,"rb");
+	if(!fp) return false;
+
+	std::vector<uint8_t> f;
+	uint8_t chunk[65536];
+	size_t n;
+	while((n=fread(chunk,1,sizeof(chunk),fp))>0) f.insert(f.end(),chunk,chunk+n);
+	fclose(fp);
+
+	if(f.size()<24) return false;
+
+	uint32_t magic=Get32(&f[0],false);
+
+	if(magic==0x0A0D0D0A) return LoadPcapng(f,out);
+	if(magic==0xA1B2C3D4 || magic==0xD4C3B2A1 || magic==0xA1B23C4D || magic==0x4D3CB2A1) return LoadPcap(f,out);
+
+	return false;
+}
+
+static uint8_t MessageType(const Record & rec)
+{
+	return ((const PTP_HEADER *) &rec.data[0])->txSpecificMsgType & 0xF;
+}
+
+int main(int argc, char * argv[])
+{
+	bool bVerbose=false;
+	int domain=-1;
+	int mechanism=-1;
+
+	int arg=1;
+
+	while(arg<argc && argv[arg][0]=='-')
+	{
+		if(!strcmp(argv[arg],"-v"))
+		{
+			bVerbose=true;
+		}
+		else if(!strcmp(argv[arg],"-d") && arg+1<argc)
+		{
+			domain=atoi(argv[++arg]);
+		}
+		else if(!strcmp(argv[arg],"-m") && arg+1<argc)
+		{
+			arg++;
+			if(!strcmp(argv[arg],"none")) mechanism=ESP1588_DELAY_NONE;
+			else if(!strcmp(argv[arg],"e2e")) mechanism=ESP1588_DELAY_E2E;
+			else if(!strcmp(argv[arg],"p2p")) mechanism=ESP1588_DELAY_P2P;
+		}
+		else
+		{
+			arg=argc;	//usage
+			break;
+		}
+		arg++;
+	}
+
+	if(arg!=argc-1)
+	{
+		fprintf(stderr,"usage: %s [-v] [-d domain] [-m none|e2e|p2p] trace\n",argv[0]);
+		return 1;
+	}
+
+	std::vector<Record> trace;
+
+	if(!Load(argv[arg],trace))
+	{
+		fprintf(stderr,"can't read %s as pcap or pcapng\n",argv[arg]);
+		return 1;
+	}
+
+	if(trace.empty())
+	{
+		fprintf(stderr,"no PTP packets in %s\n",argv[arg]);
+		return 1;
+	}
+
+	//what the recording device was set up with, unless told otherwise
+
+	for(size_t i=0;i<trace.size() && (domain<0 || mechanism<0);i++)
+	{
+		const Record & rec=trace[i];
+		const PTP_HEADER & header=*((const PTP_HEADER *) &rec.data[0]);
+
+		if(rec.bSent && (MessageType(rec)==PTP_MSGTYPE_DELAY_REQ || MessageType(rec)==PTP_MSGTYPE_PDELAY_REQ))
+		{
+			if(domain<0) domain=header.domainNumber;
+			if(mechanism<0) mechanism=MessageType(rec)==PTP_MSGTYPE_DELAY_REQ?ESP1588_DELAY_E2E:ESP1588_DELAY_P2P;
+		}
+	}
+
+	for(size_t i=0;i<trace.size() && domain<0;i++)
+	{
+		if(!trace[i].bSent && MessageType(trace[i])==PTP_MSGTYPE_ANNOUNCE) domain=((const PTP_HEADER *) &trace[i].data[0])->domainNumber;
+	}
+
+	if(domain<0) domain=0;
+	if(mechanism<0) mechanism=ESP1588_DELAY_NONE;
+
+	static const char * mechanisms[]={"none","e2e","p2p"};
+
+	uint32_t ulStart=trace[0].ulTimestamp;
+	uint32_t ulDuration=trace.back().ulTimestamp-ulStart;
+
+	printf("%u packets over %.1f s, domain %d, delay mechanism %s\n",(unsigned int) trace.size(),ulDuration/1000.0,domain,mechanisms[mechanism]);
+
+	ESP1588_SetClockSource(SimClock);
+	ulSimNow=ulStart;
+
+	ESP1588 * ptp=new ESP1588;
+	ptp->SetDomain(domain);
+	ptp->SetDelayMechanism((ESP1588_DelayMechanism) mechanism);
+	ptp->BeginOffline();
+
+	//offset while locked, the whole trace
+
+	uint32_t samples=0;
+	double sum=0;
+	double sumSquares=0;
+	int16_t lo=0;
+	int16_t hi=0;
+
+	uint32_t ulLocked=0;				//ms spent locked
+
+	bool bLocked=false;
+	bool bHoldover=false;
+	uint16_t masterChanges=0;
+	uint32_t syncAccepted=0;
+	uint32_t ulFirstLock=0;
+	uint32_t ulFirstSync=0;
+	bool bAnySync=false;
+
+	ESP1588_Stats st;
+	ESP1588_OffsetStats window;
+	memset(&window,0,sizeof(window));
+
+	//between packets the clock moves on in steps, with Loop() called at each like it would be on the device
+
+	for(size_t i=0;i<=trace.size();i++)
+	{
+		uint32_t ulNext=i<trace.size()?trace[i].ulTimestamp:trace.back().ulTimestamp+1;
+
+		while(true)
+		{
+			ptp->Loop();
+			ptp->GetStats(st);
+
+			double t=(ulSimNow-ulStart)/1000.0;
+
+			if(st.masterChanges!=masterChanges)
+			{
+				masterChanges=st.masterChanges;
+				const PTP_PORTID & id=st.master.id;
+				printf("%9.3f  master ",t);
+				for(int k=0;k<8;k++) printf("%02x",id.clockId[k]);
+				printf(" prio %u\n",st.master.priority1);
+			}
+
+			if(st.bLocked!=bLocked)
+			{
+				bLocked=st.bLocked;
+				printf("%9.3f  %s  diff %d ms\n",t,bLocked?"LOCKED":"UNLOCKED",st.lastDiffMs);
+
+				if(bLocked && !ulFirstLock && bAnySync) ulFirstLock=ulSimNow-ulFirstSync+1;	//+1 so that 0 means never
+			}
+
+			if(st.bHoldover!=bHoldover)
+			{
+				bHoldover=st.bHoldover;
+				if(bHoldover) printf("%9.3f  HOLDOVER\n",t);
+			}
+
+			if(st.syncAccepted!=syncAccepted)
+			{
+				syncAccepted=st.syncAccepted;
+
+				if(!bAnySync)
+				{
+					bAnySync=true;
+					ulFirstSync=ulSimNow;
+				}
+
+				if(bLocked)
+				{
+					if(!samples || st.lastDiffMs<lo) lo=st.lastDiffMs;
+					if(!samples || st.lastDiffMs>hi) hi=st.lastDiffMs;
+					samples++;
+					sum+=st.lastDiffMs;
+					sumSquares+=(double) st.lastDiffMs*st.lastDiffMs;
+				}
+
+				if(bVerbose)
+				{
+					printf("%9.3f  sync  diff %4d ms  delay %3d ms  freq %7d ppb  DTIM %u%s\n",t,st.lastDiffMs,st.meanPathDelayMs,
+							st.frequencyPpb,st.dtim,bLocked?"":"  (unlocked)");
+				}
+			}
+
+			//offset over time, as the engine's own statistics window completes
+
+			if(memcmp(&st.offsetShort,&window,sizeof(window)))
+			{
+				window=st.offsetShort;
+
+				if(window.samples)
+				{
+					printf("%9.3f  offset %4d..%-4d ms  mean %7.3f ms  stddev %6.3f ms  (%u syncs)\n",t,window.min,window.max,
+							window.meanUs/1000.0,window.stddevUs/1000.0,window.samples);
+				}
+			}
+
+			if((int32_t) (ulNext-ulSimNow)<=0) break;
+
+			uint32_t ulStep=ulNext-ulSimNow;
+			if(ulStep>10) ulStep=10;
+
+			ulSimNow+=ulStep;
+
+			if(bLocked) ulLocked+=ulStep;
+		}
+
+		if(i==trace.size()) break;
+
+		const Record & rec=trace[i];
+
+		if(rec.bSent)
+		{
+			ptp->FeedSentPacket(&rec.data[0],(int) rec.data.size(),rec.ulTimestamp);
+		}
+		else
+		{
+			ptp->FeedPacket(rec.port,&rec.data[0],(int) rec.data.size(),rec.ulTimestamp);
+		}
+	}
+
+	printf("\n");
+	printf("syncs accepted %u, rejected %u, locked %u time(s), %.1f%% of the time\n",st.syncAccepted,st.syncRejected,st.locks,
+			ulDuration?100.0*ulLocked/ulDuration:0.0);
+	if(ulFirstLock) printf("first lock %.3f s after the first sync\n",(ulFirstLock-1)/1000.0);
+	else printf("never locked\n");
+	if(samples)
+	{
+		double mean=sum/samples;
+		double var=sumSquares/samples-mean*mean;
+		printf("offset while locked: %d..%d ms  mean %.3f ms  stddev %.3f ms  (%u syncs)\n",lo,hi,mean,sqrt(var>0?var:0),samples);
+	}
+
+	delete ptp;
+
+	ESP1588_SetClockSource(nullptr);
+
+	return 0;
+}
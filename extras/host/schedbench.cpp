@@ -0,0 +1,137 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * ESP1588_Scheduler against a 1ms polling tick (what Blink1588_ISR does), on the real clock: a number of cues, each
+ * firing once a second at a phase of its own, run for a while both ways. Reports how late the cues were and what they
+ * cost in CPU time. No network needed, and no lock: PTP time is local time until there is one.
+ *
+ * usage: schedbench [cues] [seconds]
+ */
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <vector>
+#include <algorithm>
+#include <ESP1588.h>
+
+#define CUE_PERIOD	1000		//ms
+
+static ESP1588 ptp;
+static std::vector<uint32_t> lateness;
+
+static void Cue(void * ctx, uint64_t ulDue)
+{
+	lateness.push_back((uint32_t) (ptp.GetEpochMillis64()-ulDue));
+}
+
+static double CpuSeconds()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF,&ru);
+
+	return ru.ru_utime.tv_sec+ru.ru_stime.tv_sec+(ru.ru_utime.tv_usec+ru.ru_stime.tv_usec)*1e-6;
+}
+
+static uint32_t Percentile(std::vector<uint32_t> & v, int p)
+{
+	if(v.empty()) return 0;
+	return v[(v.size()-1)*p/100];
+}
+
+static void Report(const char * name, double cpu, int seconds)
+{
+	std::sort(lateness.begin(),lateness.end());
+
+	printf("%-10s %7d   %5u %5u %5u   %9.2f %8.3f%%\n",name,(int) lateness.size(),
+			Percentile(lateness,50),Percentile(lateness,99),Percentile(lateness,100),
+			lateness.empty()?0.0:cpu*1e6/lateness.size(),100*cpu/seconds);
+
+	lateness.clear();
+}
+
+int main(int argc, char * argv[])
+{
+	int cues=argc>1?atoi(argv[1]):ESP1588_SCHEDULER_EVENTS;
+	int seconds=argc>2?atoi(argv[2]):10;
+
+	if(cues<1 || cues>ESP1588_SCHEDULER_EVENTS)
+	{
+		fprintf(stderr,"1 to %d cues (ESP1588_SCHEDULER_EVENTS)\n",ESP1588_SCHEDULER_EVENTS);
+		return 1;
+	}
+
+	ptp.BeginOffline();
+
+	lateness.reserve(cues*(seconds+1));
+
+	printf("%d cues every %d ms, %d s each way. lateness in ms\n",cues,CUE_PERIOD,seconds);
+	printf("%-10s %7s   %5s %5s %5s   %9s %9s\n","","cues","p50","p99","max","us/cue","cpu");
+
+	//the scheduler, the main thread asleep meanwhile
+
+	ESP1588_Scheduler scheduler(ptp);
+	scheduler.Begin();
+
+	double cpu=CpuSeconds();
+
+	for(int i=0;i<cues;i++)
+	{
+		scheduler.Every(CUE_PERIOD,i*CUE_PERIOD/cues,Cue);
+	}
+
+	sleep(seconds);
+	scheduler.End();
+
+	Report("scheduler",CpuSeconds()-cpu,seconds);
+
+	//polling every millisecond
+
+	std::vector<uint64_t> next(cues);
+
+	uint64_t ulNow=ptp.GetEpochMillis64();
+	for(int i=0;i<cues;i++)
+	{
+		uint32_t phase=i*CUE_PERIOD/cues;
+		next[i]=ulNow-ulNow%CUE_PERIOD+phase;
+		if(next[i]<ulNow) next[i]+=CUE_PERIOD;
+	}
+
+	cpu=CpuSeconds();
+	uint64_t ulEnd=ulNow+seconds*1000;
+
+	while((ulNow=ptp.GetEpochMillis64())<ulEnd)
+	{
+		for(int i=0;i<cues;i++)
+		{
+			if(ulNow>=next[i])
+			{
+				Cue(nullptr,next[i]);
+				next[i]+=CUE_PERIOD;
+			}
+		}
+
+		usleep(1000);
+	}
+
+	Report("1ms poll",CpuSeconds()-cpu,seconds);
+
+	return 0;
+}
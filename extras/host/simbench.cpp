@@ -0,0 +1,268 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The servo, the tracker and the BMCA against a set of impaired networks (see NetSim.h): DTIM bursting, loss,
+ * reordering, one-way delay spikes, a wandering crystal, a master rebooting, a master failing over to a backup and a
+ * better master turning up. Every scenario runs a number of seeded trials of SIM_DURATION each, and reports
+ *
+ *   lock		ms from the first sync to lock, p50 and p90
+ *   |err|		ms our time is off from the master we follow, sampled every 100ms from SIM_SETTLE on, p50/p95/p99/max
+ *   locked		percent of those samples we were locked for
+ *   event		ms from the scenario's event (master gone, back or new) to locked to the right master on fresh syncs
+ *   cpu		ns per packet, FeedPacket() plus the Loop() after it
+ *
+ * usage: simbench [trials] [logSyncInterval] [scenario]
+ */
+
+#include <vector>
+#include <algorithm>
+#include "NetSim.h"
+
+#define SIM_DURATION	180000		//ms per trial
+#define SIM_SETTLE		30000		//ms before the error counts
+#define SIM_SAMPLE		100			//ms between error samples
+
+struct Scenario
+{
+	const char * name;
+	void (*Setup)(NetSim & sim);
+	double event;					//ms, 0 for none
+	uint8_t idAfter;				//the master we should be following after the event
+};
+
+static void Wired(NetSim & sim)
+{
+	sim.link.jitter=0.2;
+}
+
+static void Dtim1(NetSim & sim)
+{
+	sim.link.dtim=1;
+}
+
+static void Dtim3(NetSim & sim)
+{
+	sim.link.dtim=3;
+}
+
+static void Lossy(NetSim & sim)
+{
+	sim.link.dtim=1;
+	sim.link.loss=20;
+}
+
+static void Reorder(NetSim & sim)
+{
+	sim.link.jitter=2;
+	sim.link.reorder=10;
+}
+
+static void Spikes(NetSim & sim)
+{
+	sim.link.spikes=5;
+	sim.link.spikeMax=50;
+}
+
+static void Wander(NetSim & sim)
+{
+	sim.clock.drift=100;
+	sim.clock.wander=10;
+	sim.clock.wanderPeriod=120000;
+}
+
+static void Reboot(NetSim & sim)
+{
+	sim.masters[0].stop=60000;
+	sim.masters[0].restart=75000;
+}
+
+static void Failover(NetSim & sim)
+{
+	NetSimMaster backup=sim.masters[0];
+	backup.id=2;
+	backup.priority1=129;
+	backup.offset=2;					//grandmasters never quite agree
+	sim.masters.push_back(backup);
+
+	sim.masters[0].stop=60000;
+}
+
+static void Competing(NetSim & sim)
+{
+	NetSimMaster better=sim.masters[0];
+	better.id=2;
+	better.priority1=100;
+	better.offset=5;
+	better.bTwoStep=true;
+	better.start=60000;
+	sim.masters.push_back(better);
+}
+
+static void Hostile(NetSim & sim)
+{
+	sim.link.dtim=1;
+	sim.link.loss=10;
+	sim.link.reorder=5;
+	sim.link.spikes=5;
+	sim.clock.wander=5;
+	sim.clock.wanderPeriod=120000;
+}
+
+static const Scenario scenarios[]=
+{
+	{"wired",		Wired,		0,		1},
+	{"dtim1",		Dtim1,		0,		1},
+	{"dtim3",		Dtim3,		0,		1},
+	{"lossy",		Lossy,		0,		1},
+	{"reorder",		Reorder,	0,		1},
+	{"spikes",		Spikes,		0,		1},
+	{"wander",		Wander,		0,		1},
+	{"reboot",		Reboot,		75000,	1},
+	{"failover",	Failover,	60000,	2},
+	{"competing",	Competing,	60000,	2},
+	{"hostile",		Hostile,	0,		1},
+};
+
+struct Totals
+{
+	std::vector<uint32_t> lock;
+	std::vector<uint32_t> event;
+	std::vector<uint32_t> err;
+	uint32_t samples=0;
+	uint32_t lockedSamples=0;
+	uint64_t ulCpuNanos=0;
+	uint32_t packets=0;
+};
+
+static void Trial(const Scenario & sc, int logInterval, uint32_t seed, Totals & totals)
+{
+	NetSim sim(seed);
+
+	NetSimMaster m;
+	m.logSyncInterval=logInterval;
+	sim.masters.push_back(m);
+
+	sim.clock.drift=((rand()%1001)-500)*0.1;		//+-50ppm, unless the scenario says otherwise
+
+	sc.Setup(sim);
+	sim.Begin();
+
+	double firstSync=sim.masters[0].phase;
+	double nextSample=SIM_SETTLE;
+	bool bLocked=false;
+	bool bEvent=sc.event==0;
+	bool bArmed=false;
+	uint32_t ulAcceptedAtEvent=0;
+
+	ESP1588_Stats stats;
+
+	sim.Run(SIM_DURATION,[&]()
+	{
+		bool bLock=sim.ptp->GetLockStatus();
+
+		if(!bLocked && bLock)
+		{
+			bLocked=true;
+			totals.lock.push_back((uint32_t) (sim.Now()-firstSync));
+		}
+
+		if(!bEvent && sim.Now()>=sc.event)
+		{
+			sim.ptp->GetStats(stats);
+
+			if(!bArmed)
+			{
+				bArmed=true;
+				ulAcceptedAtEvent=stats.syncAccepted;
+			}
+			else if(bLock && stats.syncAccepted!=ulAcceptedAtEvent)
+			{
+				const NetSimMaster * f=sim.Following();
+				if(f && f->id==sc.idAfter)
+				{
+					bEvent=true;
+					totals.event.push_back((uint32_t) (sim.Now()-sc.event));
+				}
+			}
+		}
+
+		if(sim.Now()>=nextSample)
+		{
+			nextSample+=SIM_SAMPLE;
+			totals.samples++;
+
+			if(bLock)
+			{
+				totals.lockedSamples++;
+				totals.err.push_back((uint32_t) abs(sim.Error()));
+			}
+		}
+	});
+
+	totals.ulCpuNanos+=sim.ulCpuNanos;
+	totals.packets+=sim.packets;
+}
+
+static uint32_t Percentile(std::vector<uint32_t> & v, int p)
+{
+	if(v.empty()) return 0;
+	return v[(v.size()-1)*p/100];
+}
+
+int main(int argc, char * argv[])
+{
+	int trials=argc>1?atoi(argv[1]):20;
+	int logInterval=argc>2?atoi(argv[2]):-3;
+	const char * only=argc>3?argv[3]:nullptr;
+
+	printf("logSyncInterval %d, %d trials of %ds per scenario. times in ms, errors in ms\n",logInterval,trials,SIM_DURATION/1000);
+	printf("%-10s %6s %6s %6s   %5s %5s %5s %5s %7s   %6s %6s %6s   %6s\n","","locked","lock50","lock90",
+			"err50","err95","err99","max","locked%","events","evt50","evtmax","ns/pkt");
+
+	for(int s=0;s<(int) (sizeof(scenarios)/sizeof(scenarios[0]));s++)
+	{
+		const Scenario & sc=scenarios[s];
+		if(only && strcmp(only,sc.name)) continue;
+
+		Totals totals;
+
+		for(int i=0;i<trials;i++)
+		{
+			Trial(sc,logInterval,1588+i,totals);
+		}
+
+		std::sort(totals.lock.begin(),totals.lock.end());
+		std::sort(totals.event.begin(),totals.event.end());
+		std::sort(totals.err.begin(),totals.err.end());
+
+		printf("%-10s %6d %6u %6u   %5u %5u %5u %5u %6.1f%%",sc.name,(int) totals.lock.size(),
+				Percentile(totals.lock,50),Percentile(totals.lock,90),
+				Percentile(totals.err,50),Percentile(totals.err,95),Percentile(totals.err,99),Percentile(totals.err,100),
+				totals.samples?100.0*totals.lockedSamples/totals.samples:0.0);
+
+		if(sc.event) printf("   %6d %6u %6u",(int) totals.event.size(),Percentile(totals.event,50),Percentile(totals.event,100));
+		else printf("   %6s %6s %6s","-","-","-");
+
+		printf("   %6u\n",totals.packets?(uint32_t) (totals.ulCpuNanos/totals.packets):0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,397 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Regression tests for the host build: each one drives the engine (or a piece of it) through a case that has gone wrong
+ * before. Prints a line per test, and exits non-zero if any failed.
+ *
+ * usage: tests [name]
+ */
+
+#include <vector>
+#include "NetSim.h"
+
+static int failures=0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("    %s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#cond); return false; } } while(0)
+
+//the local clock, in place of CLOCK_MONOTONIC
+
+static uint32_t ulClock=0;
+
+static uint32_t Clock()
+{
+	return ulClock;
+}
+
+//ESP1588_Sync straight from packets, without the sockets and the master selection in front of it
+
+class ESP1588_Tests
+{
+public:
+	ESP1588_Sync sync;
+
+	ESP1588_Tests()
+	{
+		ESP1588_SetClockSource(Clock);
+		sync.Reset();
+	}
+
+	~ESP1588_Tests()
+	{
+		ESP1588_SetClockSource(nullptr);
+	}
+
+	//a sync that left the master at ulMaster and got here at once, with correctionMs in the correctionField
+
+	void Sync(uint64_t ulMaster, int32_t correctionMs, bool bTwoStep)
+	{
+		PTP_PACKET pkt;
+		memset(&pkt,0,sizeof(pkt));
+		pkt.header.txSpecificMsgType=PTP_MSGTYPE_SYNC;
+		pkt.header.versionPTP=2;
+		pkt.header.SetCorrectionNanos((int64_t) correctionMs*1000000);
+
+		if(bTwoStep)
+		{
+			pkt.header.flagField[0]=2;
+			sync.FeedSync(pkt,PTP_EVENT_PORT,ulClock);
+
+			//the follow-up, a millisecond behind with the time the sync left
+
+			ulClock++;
+			pkt.header.txSpecificMsgType=PTP_MSGTYPE_FOLLOW_UP;
+			pkt.header.SetCorrectionNanos(0);
+		}
+
+		Timestamp(pkt.msg.sync,ulMaster-correctionMs);
+		sync.FeedSync(pkt,bTwoStep?PTP_GENERAL_PORT:PTP_EVENT_PORT,ulClock);
+	}
+
+	void Reset() { sync.Reset(); }
+	bool GetLockStatus() { return sync.GetLockStatus(); }
+	uint32_t GetMillis() { return sync.GetMillis(); }
+	uint64_t GetEpochMillis64() { return sync.GetEpochMillis64(); }
+
+	static void Timestamp(PTP_SYNC_MESSAGE & ts, uint64_t ulMillis)
+	{
+		uint64_t secs=ulMillis/1000;
+		ts.timestamp_secs_ESB=htons((uint16_t) (secs>>32));
+		ts.timestamp_secs=htonl((uint32_t) secs);
+		ts.timestamp_nanos=htonl((uint32_t) (ulMillis%1000)*1000000);
+	}
+};
+
+//A negative correctionField, one-step or two-step, used to reach the 64-bit epoch as a 32-bit unsigned number: four
+//billion milliseconds in the future. The 32-bit timeline never noticed.
+
+static bool NegativeCorrection(bool bTwoStep)
+{
+	ulClock=1000;
+	ESP1588_Tests t;
+
+	uint64_t ulBase=1700000000000ULL-ulClock;		//master time minus ours
+
+	while(ulClock<10000)
+	{
+		t.Sync(ulBase+ulClock,-3,bTwoStep);
+		ulClock+=125;
+	}
+
+	uint64_t ulMaster=ulBase+ulClock;
+
+	CHECK(abs((int32_t) (t.GetMillis()-(uint32_t) ulMaster))<=2);
+	CHECK(llabs((int64_t) (t.GetEpochMillis64()-ulMaster))<=2);
+	return true;
+}
+
+static bool NegativeCorrectionOneStep() { return NegativeCorrection(false); }
+static bool NegativeCorrectionTwoStep() { return NegativeCorrection(true); }
+
+//GetMillis() must not go back when the timeline does: it holds until the timeline catches up, across any number of
+//clock updates in between. Here a new master 300ms behind the old one, after a Reset().
+
+static bool MonotonicAcrossStepBack()
+{
+	ulClock=1000;
+	ESP1588_Tests t;
+
+	uint64_t ulBase=1700000000000ULL-ulClock;
+
+	uint32_t ulLast=0;
+	uint32_t ulDrops=0;
+	bool bLocked=false;
+
+	for(;ulClock<20000;ulClock++)
+	{
+		if(ulClock==10000)
+		{
+			t.Reset();
+			ulBase-=300;
+		}
+
+		if(ulClock%125==0) t.Sync(ulBase+ulClock,0,false);
+
+		uint32_t ms=t.GetMillis();
+
+		if(bLocked && (int32_t) (ms-ulLast)<0) ulDrops++;
+		if(t.GetLockStatus()) bLocked=true;
+
+		ulLast=ms;
+	}
+
+	CHECK(bLocked);
+	CHECK(ulDrops==0);
+	CHECK(abs((int32_t) (t.GetMillis()-(uint32_t) (ulBase+ulClock)))<=2);		//and it did follow the master back in the end
+	return true;
+}
+
+//The smooth clock on before the first lock: that is local time to PTP time, decades of it, and has to be stepped rather than
+//slewed even at the cap. The default step limit does that.
+
+static bool SmoothClockFirstLock()
+{
+	NetSim sim(1588);
+
+	NetSimMaster m;
+	sim.masters.push_back(m);
+	sim.Begin();
+
+	sim.ptp->SetSmoothClock(500000);
+	sim.Run(20000,[](){});
+
+	CHECK(sim.ptp->GetLockStatus());
+	CHECK(abs(sim.ptp->GetSlewRemainingMs())<=20);
+	CHECK(abs((int32_t) (sim.ptp->GetMillis()-sim.ptp->GetRawMillis()))<=20);
+	return true;
+}
+
+//DTIM 3 buffering, with the bounds closing in on the master from both sides: lock has to land between them, which it
+//didn't when they got tight with us already within 10ms of their midpoint. (the lock check took that, and left the rest
+//to the servo.) The path delay is on top, nothing measures it here.
+
+static bool DtimLockWithinBounds()
+{
+	for(uint32_t seed=1;seed<=20;seed++)
+	{
+		NetSim sim(seed);
+
+		NetSimMaster m;
+		m.logSyncInterval=-3;
+		sim.masters.push_back(m);
+
+		sim.link.dtim=3;
+		sim.link.pathDelay=1;
+		sim.link.jitter=0;
+		sim.clock.drift=((rand()%1001)-500)*0.1;
+		sim.Begin();
+
+		bool bLocked=false;
+		int32_t err=0;
+		int16_t bounds=-1;
+
+		sim.Run(60000,[&]()
+		{
+			if(bLocked || !sim.ptp->GetLockStatus()) return;
+
+			ESP1588_Stats st;
+			sim.ptp->GetStats(st);
+
+			bLocked=true;
+			err=sim.Error();
+			bounds=st.dtimBoundsMs;
+		});
+
+		CHECK(bLocked);
+		CHECK(bounds>=0);
+		CHECK(abs(err)<=bounds/2+1);
+	}
+	return true;
+}
+
+//A wired link with nothing but jitter: the servo has to hold the master to tens of microseconds once it's settled, which
+//it can't from millisecond timestamps. (and didn't, with the whole milliseconds of the rate term folded into the
+//timeline moving the microseconds the filters held.) No path delay, as nothing measures it here.
+
+static bool WiredMicroseconds()
+{
+	for(uint32_t seed=1;seed<=8;seed++)
+	{
+		NetSim sim(seed);
+
+		NetSimMaster m;
+		sim.masters.push_back(m);
+
+		sim.link.pathDelay=0;
+		sim.link.jitter=0.3;
+		sim.clock.drift=((rand()%1001)-500)*0.1;
+		sim.Begin();
+
+		int32_t worst=0;
+
+		sim.Run(240000,[&]()
+		{
+			if(sim.Now()<180000) return;
+
+			int32_t err=sim.ErrorMicros();
+			if(abs(err)>abs(worst)) worst=err;
+		});
+
+		CHECK(sim.ptp->GetLockStatus());
+		CHECK(abs(worst)<=100);
+	}
+	return true;
+}
+
+//pcapng output into memory, and the enhanced packet blocks' timestamps back out of it
+
+static bool CaptureWrite(void * ctx, const void * buf, size_t len)
+{
+	std::vector<uint8_t> & out=*(std::vector<uint8_t> *) ctx;
+	out.insert(out.end(),(const uint8_t *) buf,(const uint8_t *) buf+len);
+	return true;
+}
+
+static std::vector<uint64_t> CaptureTimestamps(const std::vector<uint8_t> & file)
+{
+	std::vector<uint64_t> ret;
+
+	for(size_t pos=0;pos+12<=file.size();)
+	{
+		uint32_t block[5]={0};
+		memcpy(block,&file[pos],pos+20<=file.size()?20:8);
+
+		if(block[0]==6) ret.push_back(((uint64_t) block[3]<<32) | block[4]);	//enhanced packet block
+		if(block[1]<12) break;
+		pos+=block[1];
+	}
+	return ret;
+}
+
+static void SyncPacket(uint8_t * buf)
+{
+	memset(buf,0,sizeof(PTP_PACKET));
+	((PTP_HEADER *) buf)->txSpecificMsgType=PTP_MSGTYPE_SYNC;
+	((PTP_HEADER *) buf)->versionPTP=2;
+}
+
+//Timestamps come to the writer out of order (the ports are drained in turn, sent packets are interleaved), and only a
+//move forward across the top of the 32-bit range is a wrap. A straggler from before one keeps the old high word.
+
+static bool PcapWraps()
+{
+	static const uint32_t in[]=		{1000,	1010,	1005,	1020,	0x70000000,	0xE0000000,	0xFFFFFFF0,	0xFFFFFFFA,	3,	0xFFFFFFFC,	10,	5};
+	static const uint32_t high[]=	{0,		0,		0,		0,		0,			0,			0,			0,			1,	0,			1,	1};
+
+	std::vector<uint8_t> file;
+	ESP1588_PcapWriter writer;
+	CHECK(writer.Begin(CaptureWrite,&file));
+
+	uint8_t pkt[sizeof(PTP_PACKET)];
+	SyncPacket(pkt);
+
+	for(size_t i=0;i<sizeof(in)/sizeof(in[0]);i++)
+	{
+		CHECK(writer.Packet(in[i],PTP_EVENT_PORT,i%2!=0,pkt,sizeof(pkt)));
+	}
+
+	std::vector<uint64_t> ts=CaptureTimestamps(file);
+	CHECK(ts.size()==sizeof(in)/sizeof(in[0]));
+
+	for(size_t i=0;i<ts.size();i++)
+	{
+		CHECK((uint32_t) ts[i]==in[i]);
+		CHECK((uint32_t) (ts[i]>>32)==high[i]);
+	}
+	return true;
+}
+
+//The capture ring records both ports and both directions as they're handled, so its export sees the same inversions.
+//Over a wrap of the ring, and nowhere near a wrap of the clock, every high word has to stay 0.
+
+static bool RingExportOrder()
+{
+	ESP1588_CaptureRing ring;
+
+	uint8_t pkt[sizeof(PTP_PACKET)];
+	SyncPacket(pkt);
+
+	uint32_t ulNow=5000;
+
+	for(int i=0;i<ESP1588_CAPTURE_PACKETS+20;i++)
+	{
+		ulNow+=40;
+
+		//a sync, our delay request, then an announce that was queued on the other port before the sync arrived
+
+		ring.Insert(ulNow,PTP_EVENT_PORT,false,pkt,sizeof(pkt));
+		ring.Insert(ulNow+1,PTP_EVENT_PORT,true,pkt,sizeof(pkt));
+		ring.Insert(ulNow-7,PTP_GENERAL_PORT,false,pkt,sizeof(pkt));
+	}
+
+	std::vector<uint8_t> file;
+	CHECK(ring.Export(CaptureWrite,&file)==ESP1588_CAPTURE_PACKETS);
+
+	std::vector<uint64_t> ts=CaptureTimestamps(file);
+	CHECK(ts.size()==ESP1588_CAPTURE_PACKETS);
+
+	for(size_t i=0;i<ts.size();i++)
+	{
+		CHECK((ts[i]>>32)==0);
+		CHECK(ts[i]>5000 && ts[i]<=ulNow+1);
+	}
+	return true;
+}
+
+struct Test
+{
+	const char * name;
+	bool (*fn)();
+};
+
+static const Test tests[]=
+{
+	{"negative-correction-1step",	NegativeCorrectionOneStep},
+	{"negative-correction-2step",	NegativeCorrectionTwoStep},
+	{"monotonic-step-back",			MonotonicAcrossStepBack},
+	{"smooth-first-lock",			SmoothClockFirstLock},
+	{"dtim-lock-within-bounds",		DtimLockWithinBounds},
+	{"wired-microseconds",			WiredMicroseconds},
+	{"pcap-wraps",					PcapWraps},
+	{"ring-export-order",			RingExportOrder},
+};
+
+int main(int argc, char * argv[])
+{
+	const char * only=argc>1?argv[1]:nullptr;
+
+	for(int i=0;i<(int) (sizeof(tests)/sizeof(tests[0]));i++)
+	{
+		if(only && strcmp(only,tests[i].name)) continue;
+
+		bool bPass=tests[i].fn();
+		if(!bPass) failures++;
+
+		printf("%-28s %s\n",tests[i].name,bPass?"ok":"FAILED");
+	}
+
+	return failures?1:0;
+}
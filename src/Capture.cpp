@@ -0,0 +1,265 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Capture.h"
+
+//pcapng (https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-02.html), written in our own byte order, which the
+//byte order magic tells the reader.
+
+#define PCAPNG_SHB			0x0A0D0D0A		//section header block
+#define PCAPNG_IDB			0x00000001		//interface description block
+#define PCAPNG_EPB			0x00000006		//enhanced packet block
+#define PCAPNG_MAGIC		0x1A2B3C4D
+
+#define PCAPNG_LINKTYPE_RAW	101				//starts at the IP header
+#define PCAPNG_IF_TSRESOL	9
+#define PCAPNG_EPB_FLAGS	2
+
+static uint16_t IpChecksum(const uint8_t * p, int len)
+{
+	uint32_t sum=0;
+	for(int i=0;i<len;i+=2)
+	{
+		sum+=(p[i]<<8) | p[i+1];
+	}
+	while(sum>>16) sum=(sum & 0xFFFF)+(sum>>16);
+	return (uint16_t) ~sum;
+}
+
+ESP1588_PcapWriter::ESP1588_PcapWriter()
+{
+}
+
+bool ESP1588_PcapWriter::Begin(ESP1588_CaptureWrite write, void * ctx)
+{
+	this->write=write;
+	this->ctx=ctx;
+	ulLastTimestamp=0;
+	ulWraps=0;
+	bStarted=false;
+
+	uint32_t shb[7]=
+	{
+		PCAPNG_SHB,
+		28,
+		PCAPNG_MAGIC,
+		1,							//version 1.0
+		0xFFFFFFFF,0xFFFFFFFF,		//section length unknown
+		28,
+	};
+
+	uint32_t idb[8]=
+	{
+		PCAPNG_IDB,
+		32,
+		PCAPNG_LINKTYPE_RAW,		//and 16 reserved bits
+		0,							//no snap length
+		PCAPNG_IF_TSRESOL | (1<<16),
+		0,							//timestamps in 10^-3 s (the first byte, see below), the rest of it is padding
+		0,							//end of options
+		32,
+	};
+
+	*((uint8_t *) &idb[5])=3;
+
+	return write(ctx,shb,sizeof(shb)) && write(ctx,idb,sizeof(idb));
+}
+
+bool ESP1588_PcapWriter::Packet(uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len, int wireLen)
+{
+	if(!write || len<(int) sizeof(PTP_HEADER)) return false;
+
+	//timestamps don't arrive in order: the two ports are drained in turn, and what we send is interleaved with what we
+	//receive. only a move forward across the top of the range is a wrap, and a straggler from before it belongs to the last one.
+
+	uint32_t ulHigh=ulWraps;
+
+	if(!bStarted || (int32_t) (ulTimestamp-ulLastTimestamp)>=0)
+	{
+		if(bStarted && ulTimestamp<ulLastTimestamp) ulHigh=++ulWraps;
+		ulLastTimestamp=ulTimestamp;
+		bStarted=true;
+	}
+	else if(ulTimestamp>ulLastTimestamp && ulWraps)
+	{
+		ulHigh--;
+	}
+
+	if(wireLen<len) wireLen=len;
+
+	int captured=28+len;				//IPv4 + UDP + PTP
+	int original=28+wireLen;
+	int pad=(4-(captured & 3)) & 3;
+	uint32_t total=28+captured+pad+12+4;
+
+	uint8_t head[28+28];
+	uint32_t * epb=(uint32_t *) head;
+
+	epb[0]=PCAPNG_EPB;
+	epb[1]=total;
+	epb[2]=0;							//interface
+	epb[3]=ulHigh;						//timestamp, high and low
+	epb[4]=ulTimestamp;
+	epb[5]=captured;
+	epb[6]=original;
+
+	//peer delay messages go to their own group, everything else to the primary one
+
+	uint8_t type=((const PTP_HEADER *) buf)->txSpecificMsgType & 0xF;
+	bool bPeer=type==PTP_MSGTYPE_PDELAY_REQ || type==PTP_MSGTYPE_PDELAY_RESP || type==PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP;
+
+	uint8_t * ip=head+28;
+	memset(ip,0,28);
+	ip[0]=0x45;
+	ip[2]=original>>8;
+	ip[3]=original;
+	ip[8]=1;							//TTL
+	ip[9]=17;							//UDP
+	ip[16]=224;
+	ip[18]=bPeer?0:1;
+	ip[19]=bPeer?107:129;
+
+	uint16_t sum=IpChecksum(ip,20);
+	ip[10]=sum>>8;
+	ip[11]=sum;
+
+	uint8_t * udp=ip+20;
+	udp[0]=port>>8;
+	udp[1]=port;
+	udp[2]=port>>8;
+	udp[3]=port;
+	udp[4]=(8+wireLen)>>8;
+	udp[5]=8+wireLen;					//no checksum, allowed over IPv4
+
+	uint32_t tail[4]=
+	{
+		PCAPNG_EPB_FLAGS | (4<<16),
+		bSent?2u:1u,					//outbound/inbound
+		0,								//end of options
+		total,
+	};
+
+	static const uint8_t zeros[3]={0,0,0};
+
+	return write(ctx,head,sizeof(head)) && write(ctx,buf,len) && (!pad || write(ctx,zeros,pad)) && write(ctx,tail,sizeof(tail));
+}
+
+void ESP1588_PcapWriter::Hook(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len)
+{
+	((ESP1588_PcapWriter *) ctx)->Packet(ulTimestamp,port,bSent,buf,len);
+}
+
+
+static_assert((ESP1588_CAPTURE_PACKETS & (ESP1588_CAPTURE_PACKETS-1))==0,"ESP1588_CAPTURE_PACKETS must be a power of two");
+
+ESP1588_CaptureRing::ESP1588_CaptureRing()
+{
+	Clear();
+}
+
+void ESP1588_CaptureRing::Clear()
+{
+	memset(ring,0,sizeof(ring));
+	ulCount=0;
+}
+
+void ESP1588_CaptureRing::Insert(uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len)
+{
+	//One writer, so no need for anything more than a generation per slot to let Export() know what it's looking at,
+	//the same way the clock snapshot does it.
+
+	uint32_t n=ulCount;
+	SLOT & slot=ring[n & (ESP1588_CAPTURE_PACKETS-1)];
+
+	slot.generation=2*n+1;
+	__sync_synchronize();
+
+	slot.ulTimestamp=ulTimestamp;
+	slot.port=port;
+	slot.bSent=bSent;
+	slot.wireLen=len;
+	slot.len=len<ESP1588_CAPTURE_SNAPLEN?len:ESP1588_CAPTURE_SNAPLEN;
+	memcpy(slot.data,buf,slot.len);
+
+	__sync_synchronize();
+	slot.generation=2*n+2;
+	__sync_synchronize();
+
+	ulCount=n+1;
+}
+
+void ESP1588_CaptureRing::Hook(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len)
+{
+	((ESP1588_CaptureRing *) ctx)->Insert(ulTimestamp,port,bSent,buf,len);
+}
+
+int ESP1588_CaptureRing::Export(ESP1588_CaptureWrite write, void * ctx)
+{
+	ESP1588_PcapWriter writer;
+	if(!writer.Begin(write,ctx)) return -1;
+
+	uint32_t end=ulCount;
+	uint32_t n=end>ESP1588_CAPTURE_PACKETS?end-ESP1588_CAPTURE_PACKETS:0;
+
+	int written=0;
+
+	for(;n!=end;n++)
+	{
+		SLOT & slot=ring[n & (ESP1588_CAPTURE_PACKETS-1)];
+
+		//copy it out first, the write may take a while. if the slot has moved on since, the packet is gone
+
+		SLOT copy;
+
+		copy.generation=slot.generation;
+		__sync_synchronize();
+
+		if(copy.generation!=2*n+2) continue;
+
+		copy.ulTimestamp=slot.ulTimestamp;
+		copy.port=slot.port;
+		copy.bSent=slot.bSent;
+		copy.wireLen=slot.wireLen;
+		copy.len=slot.len;
+		memcpy(copy.data,slot.data,copy.len);
+
+		__sync_synchronize();
+		if(slot.generation!=copy.generation || copy.len<sizeof(PTP_HEADER)) continue;
+
+		if(!writer.Packet(copy.ulTimestamp,copy.port,copy.bSent,copy.data,copy.len,copy.wireLen)) return -1;
+		written++;
+	}
+
+	return written;
+}
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+
+static bool PrintWrite(void * ctx, const void * buf, size_t len)
+{
+	return ((Print *) ctx)->write((const uint8_t *) buf,len)==len;
+}
+
+int ESP1588_CaptureRing::Export(Print & out)
+{
+	return Export(PrintWrite,&out);
+}
+
+#endif
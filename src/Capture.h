@@ -0,0 +1,116 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "PTP.h"
+
+//Packet recording. ESP1588::SetPacketHook() hands every datagram we receive, and every one we send, to a function of
+//yours along with its local timestamp: the receive timestamp the sync manager works from, or the send timestamp of our
+//delay requests. That's all it takes to re-run the engine on the host later (ESP1588::FeedPacket()/FeedSentPacket(),
+//see extras/host/replay.cpp) with exactly the same inputs.
+//
+//ESP1588_PcapWriter turns those into a pcapng stream that Wireshark opens as it is: the PTP payload in synthesized
+//IPv4/UDP headers (the sender's address isn't known, it's left as 0.0.0.0), millisecond timestamps in local time,
+//and the direction of each packet.
+//
+//ESP1588_CaptureRing keeps the last ESP1588_CAPTURE_PACKETS of them in RAM instead, for a look at what a device in the
+//field was seeing when it misbehaved: pass ESP1588_CaptureRing::Hook and the ring to SetPacketHook(), and Export() it as
+//pcapng when the time comes. Recording is a copy into a slot and never waits for anything, and the ring may be exported
+//from any task while it carries on recording.
+
+#ifndef ESP1588_CAPTURE_PACKETS
+#define ESP1588_CAPTURE_PACKETS		64		//datagrams the ring holds, power of two
+#endif
+
+#ifndef ESP1588_CAPTURE_SNAPLEN
+#define ESP1588_CAPTURE_SNAPLEN		64		//bytes kept of each. the largest message we use is an announce, 64 bytes
+#endif
+
+typedef void (*ESP1588_PacketHook)(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len);
+
+typedef bool (*ESP1588_CaptureWrite)(void * ctx, const void * buf, size_t len);	//false if it couldn't take it
+
+class ESP1588_PcapWriter
+{
+public:
+	ESP1588_PcapWriter();
+
+	bool Begin(ESP1588_CaptureWrite write, void * ctx);		//writes the file header
+	bool Packet(uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len, int wireLen=0);	//wireLen if more than len made it in
+
+	static void Hook(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len);	//ctx is the writer
+
+	enum
+	{
+		HEADER_SIZE=60,		//the file header
+		OVERHEAD=72,		//per packet, on top of the PTP message (and up to 3 bytes of padding)
+	};
+
+private:
+
+	ESP1588_CaptureWrite write=nullptr;
+	void * ctx=nullptr;
+
+	uint32_t ulLastTimestamp=0;		//to carry the millisecond counter into 64 bits: the latest seen so far
+	uint32_t ulWraps=0;
+	bool bStarted=false;			//..once there is one
+
+};
+
+
+class ESP1588_CaptureRing
+{
+public:
+	ESP1588_CaptureRing();
+
+	void Insert(uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len);
+	void Clear();			//not while recording
+
+	static void Hook(void * ctx, uint32_t ulTimestamp, int port, bool bSent, const void * buf, int len);	//ctx is the ring
+
+	//Writes a pcapng file of what's in the ring, oldest first. Returns the number of packets written, -1 if write failed.
+	//Packets that get overwritten while the export is under way (a slow write) are left out.
+	int Export(ESP1588_CaptureWrite write, void * ctx);
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+	int Export(Print & out);	//e.g. Serial. it's binary, so nothing else should be printing meanwhile
+#endif
+
+	uint32_t GetCount() { return ulCount; }		//packets recorded since Clear(), the ring has the last ESP1588_CAPTURE_PACKETS
+
+private:
+
+	struct SLOT
+	{
+		volatile uint32_t generation;	//2*(n+1) holding packet n, odd while being written
+		uint32_t ulTimestamp;
+		uint16_t port;
+		uint16_t len;
+		uint16_t wireLen;
+		bool bSent;
+		uint8_t data[ESP1588_CAPTURE_SNAPLEN];
+	};
+
+	SLOT ring[ESP1588_CAPTURE_PACKETS];
+
+	volatile uint32_t ulCount=0;
+
+};
@@ -0,0 +1,114 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "DtimEstimator.h"
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while(b)
+	{
+		uint32_t t=a%b;
+		a=b;
+		b=t;
+	}
+	return a;
+}
+
+ESP1588_DtimEstimator::ESP1588_DtimEstimator()
+{
+	Reset();
+}
+
+void ESP1588_DtimEstimator::Reset()
+{
+	bStarted=false;
+	score=0;
+	gaps=0;
+	blockGcd=0;
+	blockCount=0;
+	dtim=0;
+}
+
+void ESP1588_DtimEstimator::Seed(uint8_t dtim)
+{
+	//start out believing it. a couple of gaps that don't fit will still change our mind.
+
+	Reset();
+
+	if(dtim==ESP1588_DTIM_UNKNOWN) return;
+
+	this->dtim=dtim;
+	score=dtim?BURSTY_SCORE:0;
+	gaps=BLOCK_GAPS;
+}
+
+uint32_t ESP1588_DtimEstimator::GetPeriod()
+{
+	if(!IsBursty()) return 0;
+
+	return (dtim*(ESP1588_BEACON_INTERVAL_US/100)+5)/10;
+}
+
+bool ESP1588_DtimEstimator::Feed(uint32_t ulArrival)
+{
+	if(!bStarted)
+	{
+		bStarted=true;
+		ulLastArrival=ulArrival;
+		ulBurstStart=ulArrival;
+		return true;
+	}
+
+	int32_t since=ulArrival-ulLastArrival;
+	ulLastArrival=ulArrival;
+
+	if(since<=BURST_GAP) return false;	//same delivery
+
+	//a new burst. how many beacon intervals since the previous one started?
+
+	uint32_t gap=(ulArrival-ulBurstStart)*10;		//0.1 ms
+	ulBurstStart=ulArrival;
+
+	const uint32_t beacon=ESP1588_BEACON_INTERVAL_US/100;
+
+	uint32_t beacons=(gap+beacon/2)/beacon;
+	int32_t error=(int32_t) (gap-beacons*beacon);
+
+	if(beacons>0 && beacons<256 && abs(error)<=TOLERANCE)
+	{
+		if(score<MAX_SCORE) score++;
+
+		blockGcd=gcd(blockGcd,beacons);
+		if(++blockCount>=BLOCK_GAPS)
+		{
+			dtim=blockGcd;
+			blockGcd=0;
+			blockCount=0;
+		}
+	}
+	else
+	{
+		score=score>2?score-2:0;
+	}
+
+	if(gaps<BLOCK_GAPS) gaps++;
+
+	return true;
+}
@@ -0,0 +1,80 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "Platform.h"
+
+//Learns whether multicast is being held back for DTIM beacons (see the long comment in SyncMgr.cpp) from arrival times alone.
+//
+//Deliveries are clustered: everything that arrives within a few milliseconds of the previous datagram belongs to the same burst.
+//When the access point buffers, the bursts start on beacons, so the gaps between them are whole multiples of the beacon interval,
+//and the DTIM setting is their greatest common divisor. Sync intervals are all powers of two seconds, none of which are
+//close to a multiple of 102.4 ms, so a wired or DTIM-less path doesn't look bursty by accident.
+
+#ifndef ESP1588_BEACON_INTERVAL_US
+#define ESP1588_BEACON_INTERVAL_US	102400		//100 TU, practically every access point's default
+#endif
+
+#define ESP1588_DTIM_UNKNOWN	0xFF
+
+class ESP1588_DtimEstimator
+{
+public:
+	ESP1588_DtimEstimator();
+
+	void Reset();
+	void Seed(uint8_t dtim);			//what we knew before a reboot. 0 for no burst delivery, ESP1588_DTIM_UNKNOWN for nothing
+
+	bool Feed(uint32_t ulArrival);		//returns true if this arrival starts a new burst
+
+	bool IsBursty() { return dtim && score>=BURSTY_SCORE; }		//deliveries follow DTIM beacons
+	bool IsSteady() { return gaps>=BLOCK_GAPS && score<STEADY_SCORE; }	//they clearly don't
+	uint8_t GetDtim() { return IsBursty()?dtim:0; }					//beacons per delivery, 0 if not bursty or not known yet
+	uint8_t GetKnownDtim() { return IsBursty()?dtim:IsSteady()?0:ESP1588_DTIM_UNKNOWN; }
+	uint32_t GetPeriod();											//milliseconds between deliveries, 0 if not bursty
+	uint32_t GetLastBurst() { return ulBurstStart; }				//when the latest delivery started, i.e. the beacon phase
+
+private:
+
+	enum
+	{
+		BURST_GAP=4,			//ms. closer than that is the same delivery
+		TOLERANCE=30,			//0.1 ms, how far off a multiple of the beacon interval a gap may be
+		BLOCK_GAPS=16,			//gaps per DTIM estimate
+		MAX_SCORE=16,
+		BURSTY_SCORE=12,
+		STEADY_SCORE=4,
+	};
+
+	bool bStarted=false;
+
+	uint32_t ulLastArrival=0;
+	uint32_t ulBurstStart=0;
+
+	uint8_t score=0;			//+1 for a gap that fits the beacon grid, -2 for one that doesn't
+	uint8_t gaps=0;				//gaps seen, up to BLOCK_GAPS
+
+	uint8_t blockGcd=0;			//of the beacon counts in the current block
+	uint8_t blockCount=0;
+
+	uint8_t dtim=0;				//result of the last complete block
+
+};
@@ -18,11 +18,6 @@
 	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#if defined(ARDUINO_ARCH_ESP8266)
-#include <ESP8266WiFi.h>
-#else
-#include <WiFi.h>
-#endif
 #include "ESP1588.h"
 
 #ifndef NO_GLOBAL_INSTANCES
@@ -34,7 +29,10 @@ ESP1588 esp1588;
 ESP1588::ESP1588()
 {
 	trackerCurMaster.bIsMaster=true;
+	memset(&durableMaster,0,sizeof(durableMaster));
+#if defined(ESP1588_PLATFORM_ARDUINO)
 	strShortStatus.reserve(16);
+#endif
 }
 
 ESP1588::~ESP1588()
@@ -46,30 +44,67 @@ void ESP1588::SetDomain(uint8_t domain)
 	ucDomain=domain;
 }
 
-bool ESP1588::Begin()
+void ESP1588::SetDelayMechanism(ESP1588_DelayMechanism mechanism)
 {
+	delayMechanism=mechanism;
+}
 
+void ESP1588::Prepare()
+{
+	ResetStats();
 	syncmgr.Reset();
+	if(bPersistState) LoadState();
+	syncStandby.ResetStandby(syncmgr);
+
+	//our clock identity is the EUI-64 form of the MAC address
+
+	uint8_t mac[6];
+	ESP1588_GetMacAddress(mac);
+
+	portId.clockId[0]=mac[0];
+	portId.clockId[1]=mac[1];
+	portId.clockId[2]=mac[2];
+	portId.clockId[3]=0xFF;
+	portId.clockId[4]=0xFE;
+	portId.clockId[5]=mac[3];
+	portId.clockId[6]=mac[4];
+	portId.clockId[7]=mac[5];
+	portId.portNumber=htons(1);
+}
 
-	IPAddress ipMulticast=IPAddress(224,0,1,129);
-
-#if defined(ARDUINO_ARCH_ESP8266)
-	if(Udp.beginMulticast(WiFi.localIP(), ipMulticast, 319) && Udp2.beginMulticast(WiFi.localIP(), ipMulticast, 320))
-#else
-	if(Udp.beginMulticast(ipMulticast, 319) && Udp2.beginMulticast(ipMulticast, 320))
+bool ESP1588::Begin()
+{
+#if defined(ESP1588_HAVE_TASK)
+	task.Stop();	//started again below, if we're in task mode
 #endif
+
+	Prepare();
+
+	if(Udp.BeginMulticast(PTP_EVENT_PORT) && Udp2.BeginMulticast(PTP_GENERAL_PORT))
 	{
 #ifdef PTP_MAIN_DEBUG
-		Serial.printf("Joined multicast group %s\n",ipMulticast.toString().c_str() );
+		csprintf("Joined multicast group 224.0.1.129\n");
+#endif
+
+#if defined(ESP1588_HAVE_TASK)
+		if(bTaskMode && !task.Start(TaskMain,this,ucTaskPriority,cTaskCore))
+		{
+			Udp.Stop();
+			Udp2.Stop();
+#ifdef PTP_MAIN_DEBUG
+			csprintf("### couldn't start PTP task\n");
+#endif
+			return false;
+		}
 #endif
 		return true;
 	}
 	else
 	{
-		Udp.stop();
-		Udp2.stop();
+		Udp.Stop();
+		Udp2.Stop();
 #ifdef PTP_MAIN_DEBUG
-		Serial.printf("### multicast join failed\n");
+		csprintf("### multicast join failed\n");
 #endif
 		return false;
 	}
@@ -79,91 +114,535 @@ bool ESP1588::Begin()
 
 static char packetBuffer[256];
 
+void ESP1588::SetStatePersistence(bool bEnable)
+{
+	bPersistState=bEnable;
+}
+
+//What we keep across a reboot. magic changes with the layout, so a different version of the library ignores it.
+
+#define ESP1588_STATE_MAGIC		0x15880001
+
+struct ESP1588_SavedState
+{
+	uint32_t magic;
+	uint8_t domain;
+	PTP_PORTID master;
+	ESP1588_SyncState sync;
+};
+
+static_assert(sizeof(ESP1588_SavedState)<=ESP1588_STATE_SIZE,"ESP1588_STATE_SIZE is too small");
+
+void ESP1588::SaveState()
+{
+	if(!bPersistState || !syncmgr.GetLockStatus()) return;	//nothing worth keeping
+
+	ESP1588_SavedState state;
+	memset(&state,0,sizeof(state));
+
+	state.magic=ESP1588_STATE_MAGIC;
+	state.domain=ucDomain;
+	state.master=trackerCurMaster.id;
+	syncmgr.GetState(state.sync);
+
+	bool bDurable=state.master!=durableMaster || abs(state.sync.lFreq-lDurableFreq)>ESP1588_STATE_DURABLE_PPB;
+
+	if(ESP1588_SaveState(&state,sizeof(state),bDurable) && bDurable)
+	{
+		durableMaster=state.master;
+		lDurableFreq=state.sync.lFreq;
+	}
+
+	ulStateSaved=ESP1588_Millis();
+	bStateSaved=true;
+}
+
+bool ESP1588::LoadState()
+{
+	ESP1588_SavedState state;
+	uint32_t ulAge;
+
+	if(!ESP1588_LoadState(&state,sizeof(state),ulAge)) return false;
+	if(state.magic!=ESP1588_STATE_MAGIC || state.domain!=ucDomain) return false;
+
+	syncmgr.Seed(state.sync,ulAge);
+	trackerCurMaster.Expect(state.master);
+
+	durableMaster=state.master;		//no need to write the same thing back to flash
+	lDurableFreq=state.sync.lFreq;
+
+	return true;
+}
+
+void ESP1588::SetHoldoverLimit(uint16_t ms)
+{
+	syncmgr.usHoldoverLimitMs=ms;
+	syncStandby.usHoldoverLimitMs=ms;
+}
+
+void ESP1588::SetSmoothClock(uint32_t maxSlewPpm, uint32_t stepLimitMs)
+{
+	syncmgr.SetSmoothClock(maxSlewPpm,stepLimitMs);
+	syncStandby.SetSmoothClock(maxSlewPpm,stepLimitMs);
+}
+
+void ESP1588::SetReceiveBudget(uint16_t maxPackets, uint16_t maxMillis)
+{
+	usReceiveBudgetPackets=maxPackets;
+	usReceiveBudgetMillis=maxMillis;
+}
+
+#if defined(ESP1588_HAVE_TASK)
+void ESP1588::SetTaskMode(bool bEnable, uint8_t priority, int8_t core)
+{
+	bTaskMode=bEnable;
+	ucTaskPriority=priority;
+	cTaskCore=core;
+}
+
+void ESP1588::TaskMain(void * arg)
+{
+	ESP1588 * self=(ESP1588 *) arg;
+
+	while(!self->task.StopRequested())
+	{
+		self->Run();
+
+		ESP1588_UDP::WaitAny(self->Udp,self->Udp2,self->GetIdleTime());
+	}
+}
+
+uint32_t ESP1588::GetIdleTime()
+{
+	//how long the task can sleep if nothing arrives: until the next delay request or maintenance is due.
+	//capped, so Quit() on the host (which can't interrupt poll()) doesn't have to wait long for the task.
+
+	uint32_t ulNow=ESP1588_Millis();
+	int32_t wait=100;
+
+	int32_t untilMaintenance=1000-(int32_t) (ulNow-ulMaintenance);
+	if(untilMaintenance<wait) wait=untilMaintenance;
+
+	if(delayMechanism==ESP1588_DELAY_P2P || (delayMechanism==ESP1588_DELAY_E2E && trackerCurMaster.HasValidSource()))
+	{
+		int32_t untilDelayReq=ulDelayReqInterval-(ulNow-ulDelayReqTimestamp);
+		if(untilDelayReq<wait) wait=untilDelayReq;
+	}
+
+	return wait<1?1:wait;
+}
+#endif
+
 void ESP1588::Loop()
 {
+#if defined(ESP1588_HAVE_TASK)
+	if(task.Running()) return;	//the task is doing it
+#endif
+
+	Run();
+}
+
+void ESP1588::Run()
+{
+
+	//Drain everything that's queued on both sockets, so a DTIM burst is dealt with in one go instead of one packet per Loop() call,
+	//taking turns between them so that two-step syncs and their follow-ups stay in order. The budget keeps a flood from starving the sketch.
+
+	uint32_t ulStart=ESP1588_Millis();
+	uint16_t budget=usReceiveBudgetPackets;
+
+	bool bMore=true;
 
-	for(int i=0;i<2;i++)
+	while(bMore && budget>0 && (ESP1588_Millis()-ulStart)<usReceiveBudgetMillis)
 	{
-		WiFiUDP * udp=i==1?&Udp2:&Udp;
-		int port=i==1?320:319;
+		bMore=false;
 
-		udp->parsePacket();
+		for(int i=0;i<2 && budget>0;i++)
+		{
+			ESP1588_UDP & udp=i==1?Udp2:Udp;
+			int port=i==1?PTP_GENERAL_PORT:PTP_EVENT_PORT;
+
+			int len=udp.ParsePacket();
 
-		int len=udp->read(packetBuffer,sizeof(packetBuffer));
+			if(len>0)
+			{
+				bMore=true;
+				budget--;
+
+				ReceivePacket(udp,port,len);
+			}
+		}
+	}
+
+
+
+	if(delayMechanism==ESP1588_DELAY_E2E && trackerCurMaster.HasValidSource() && ESP1588_Millis()-ulDelayReqTimestamp>=ulDelayReqInterval)
+	{
+		SendDelayReq();
+	}
+	else if(delayMechanism==ESP1588_DELAY_P2P && ESP1588_Millis()-ulDelayReqTimestamp>=ulDelayReqInterval)
+	{
+		SendPdelayReq();
+	}
 
-		if(len>=(int) sizeof(PTP_PACKET))
+
+	if(ESP1588_Millis()-ulMaintenance>=1000)
+	{
+		ulMaintenance=ESP1588_Millis();
+		Maintenance();
+	}
+
+
+	ESP1588_Scheduler * sched=scheduler;
+	if(sched)
+	{
+		ESP1588_ClockSnapshot snap;
+		syncmgr.GetClockSnapshot(snap);
+
+		if(snap.generation!=ulScheduledGeneration)
 		{
-			PTP_PACKET & pkt=*((PTP_PACKET *) packetBuffer);
+			ulScheduledGeneration=snap.generation;
+			sched->Retime();
+		}
+	}
+
+}
+
+void ESP1588::ReceivePacket(ESP1588_UDP & udp, int port, int len)
+{
+	if(port==PTP_EVENT_PORT) ulRxEvent++; else ulRxGeneral++;
+
+	if(len<(int) sizeof(PTP_PACKET))
+	{
+		ulRxIgnored++;
+		return;
+	}
+
+	pps_counter++;
 
-			pps_counter++;
+	if(len>(int) sizeof(packetBuffer)) len=sizeof(packetBuffer);
 
-			if(pkt.header.domainNumber!=ucDomain) return;
+	//read just the header first, most of what's on the wire is of no interest to us (other domains, other clocks, other clients' traffic).
+	//all of it if we're recording, the recording should have everything.
+
+	int head=packetHook?len:(int) sizeof(PTP_HEADER);
+
+	if(udp.Read(packetBuffer,head)!=head) return;
+
+	if(packetHook) packetHook(packetHookCtx,udp.GetTimestamp(),port,false,packetBuffer,len);
+
+	if(!WantPacket(*((PTP_HEADER *) packetBuffer),port))
+	{
+		ulRxIgnored++;
+		return;
+	}
+
+	if(head<len) udp.Read(packetBuffer+head,len-head);
+
+	HandlePacket(port,len,udp.GetTimestamp(),udp.GetTimestampMicros());
+}
+
+bool ESP1588::SendPacket(const void * buf, int len, bool bPeerDelay, uint32_t ulTimestamp)
+{
+	if(!Udp.Send(buf,len,bPeerDelay)) return false;
+
+	if(packetHook) packetHook(packetHookCtx,ulTimestamp,PTP_EVENT_PORT,true,buf,len);
+
+	return true;
+}
+
+void ESP1588::SetPacketHook(ESP1588_PacketHook hook, void * ctx)
+{
+	packetHook=nullptr;		//never a new hook with the old context
+	packetHookCtx=ctx;
+	packetHook=hook;
+}
+
+#if defined(ESP1588_PLATFORM_POSIX)
+void ESP1588::BeginOffline()
+{
+#if defined(ESP1588_HAVE_TASK)
+	task.Stop();
+#endif
+
+	Prepare();
+}
+
+void ESP1588::FeedPacket(int port, const void * buf, int len, uint32_t ulTimestamp, uint16_t usMicros)
+{
+	//as if it had arrived on the socket at ulTimestamp
+
+	if(port==PTP_EVENT_PORT) ulRxEvent++; else ulRxGeneral++;
+
+	if(len<(int) sizeof(PTP_PACKET))
+	{
+		ulRxIgnored++;
+		return;
+	}
+
+	pps_counter++;
+
+	if(len>(int) sizeof(packetBuffer)) len=sizeof(packetBuffer);
+
+	if(packetHook) packetHook(packetHookCtx,ulTimestamp,port,false,buf,len);
+
+	if(!WantPacket(*((const PTP_HEADER *) buf),port))
+	{
+		ulRxIgnored++;
+		return;
+	}
+
+	memcpy(packetBuffer,buf,len);
+
+	HandlePacket(port,len,ulTimestamp,usMicros);
+}
 
-			if(port==320 && (pkt.header.txSpecificMsgType & 0xF)==0xb && len==(int) sizeof(PTP_ANNOUNCE_PACKET))
+void ESP1588::FeedSentPacket(const void * buf, int len, uint32_t ulTimestamp, uint16_t usMicros)
+{
+	//a request we sent, according to a recording. offline, the ones the engine tries to send itself go nowhere,
+	//so the responses in the recording can only be to these.
+
+	if(len<(int) sizeof(PTP_HEADER)) return;
+
+	const PTP_HEADER & header=*((const PTP_HEADER *) buf);
+
+	switch(header.txSpecificMsgType & 0xF)
+	{
+	case PTP_MSGTYPE_DELAY_REQ:
+		portId=header.sourcePortId;		//whoever recorded it was us, the responses will be addressed to them
+		syncmgr.DelayReqSent(header.sequenceId,ulTimestamp,usMicros);
+		break;
+	case PTP_MSGTYPE_PDELAY_REQ:
+		portId=header.sourcePortId;
+		syncmgr.PdelayReqSent(header.sequenceId,ulTimestamp,usMicros);
+		break;
+	}
+}
+#endif
+
+bool ESP1588::WantPacket(const PTP_HEADER & header, int port)
+{
+	if(header.domainNumber!=ucDomain) return false;
+
+	switch(header.txSpecificMsgType & 0xF)
+	{
+	case PTP_MSGTYPE_ANNOUNCE:
+		return port==320;
+	case PTP_MSGTYPE_SYNC:
+	case PTP_MSGTYPE_FOLLOW_UP:
+		return header.sourcePortId==trackerCurMaster.id || header.sourcePortId==trackerCandidate.id;
+	case PTP_MSGTYPE_DELAY_RESP:
+		return port==320 && delayMechanism==ESP1588_DELAY_E2E && header.sourcePortId==trackerCurMaster.id;
+	case PTP_MSGTYPE_PDELAY_REQ:
+	case PTP_MSGTYPE_PDELAY_RESP:
+		return port==319 && delayMechanism==ESP1588_DELAY_P2P;
+	case PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP:
+		return port==320 && delayMechanism==ESP1588_DELAY_P2P;
+	default:
+		return false;	//Delay_Req from other clients, management, signaling..
+	}
+}
+
+void ESP1588::HandlePacket(int port, int len, uint32_t ulTimestamp, uint16_t usMicros)
+{
+	PTP_PACKET & pkt=*((PTP_PACKET *) packetBuffer);
+
+	if(port==320 && (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_ANNOUNCE && len==(int) sizeof(PTP_ANNOUNCE_PACKET))
+	{
+		PTP_ANNOUNCE_PACKET & pkt=*((PTP_ANNOUNCE_PACKET *) packetBuffer);
+
+		// this code forms part of the BMCA (Best Master Clock Algorithm) as defined in IEEE Standard 1588-2008
+
+		ESP1588_ForeignMaster * fm=foreignMasters.FeedAnnounce(pkt,ulTimestamp);
+
+		if(!trackerCurMaster.HasValidSource())	//if we don't have any current master, take it!
+		{
+			trackerCurMaster.Start(pkt);
+			usMasterChanges++;
+		}
+		else if(pkt.header.sourcePortId==trackerCurMaster.id)	//is this our current master?
+		{
+			trackerCurMaster.FeedAnnounce(pkt);
+		}
+		else if(pkt.header.sourcePortId==trackerCandidate.id)	//is this the candidate we're tracking
+		{
+			trackerCandidate.FeedAnnounce(pkt);
+
+			if((trackerCandidate.Healthy() && trackerCandidate.key<trackerCurMaster.key) ||
+				(!trackerCurMaster.Healthy() && trackerCandidate.Healthy()))
 			{
-				PTP_ANNOUNCE_PACKET & pkt=*((PTP_ANNOUNCE_PACKET *) packetBuffer);
-
-				// this code forms part of the BMCA (Best Master Clock Algorithm) as defined in IEEE Standard 1588-2008
-
-				if(!trackerCurMaster.HasValidSource())	//if we don't have any current master, take it!
-				{
-					trackerCurMaster.Start(pkt);
-				}
-				else if(pkt.header.sourcePortId==trackerCurMaster.id)	//is this our current master?
-				{
-					trackerCurMaster.FeedAnnounce(pkt);
-				}
-				else if(pkt.header.sourcePortId==trackerCandidate.id)	//is this the candidate we're tracking
-				{
-					trackerCandidate.FeedAnnounce(pkt);
-
-					if((trackerCandidate.Healthy() && trackerCandidate.msgAnnounce>trackerCurMaster.msgAnnounce) ||
-						(!trackerCurMaster.Healthy() && trackerCandidate.Healthy()))
-					{
-
-						//if the candidate we're tracking is healthy (has announce messages and sync messages) and
-						// is better than our current master, take it!
-						//Also, if the candidate is healthy and the current master is not, take it!
-						trackerCurMaster.Take(trackerCandidate);
-					}
-
-				}
-				else if(trackerCandidate.msgAnnounce<pkt.announce)	//is this better than the candidate we're tracking?
-				{
-					//start tracking this new candidate
-					trackerCandidate.Start(pkt);
-				}
+
+				//if the candidate we're tracking is healthy (has announce messages and sync messages) and
+				// is better than our current master, take it!
+				//Also, if the candidate is healthy and the current master is not, take it!
+				//The standby sync has been following it all along, so unless it hasn't settled yet, hand over what it knows.
+
+				if(syncStandby.IsConverged()) syncmgr.TakeOver(syncStandby);
+
+				trackerCurMaster.Take(trackerCandidate);
+				syncStandby.ResetStandby(syncmgr);
+				usMasterChanges++;
 			}
-			else if(((pkt.header.txSpecificMsgType & 0xF)==0x0 || (pkt.header.txSpecificMsgType & 0xF)==0x8)
-					&& len==(int) sizeof(PTP_PACKET))
+
+		}
+		else if(fm && foreignMasters.IsQualified(*fm,ulTimestamp))
+		{
+			//a clock that has announced itself steadily. track it as the candidate if it's better than the one we have,
+			//or if the one we have has gone quiet. (one-off announces from a third clock no longer throw out a good candidate.)
+
+			ESP1588_ForeignMaster * cur=foreignMasters.Find(trackerCandidate.id);
+
+			if(!cur || !foreignMasters.IsQualified(*cur,ulTimestamp) || fm->key<trackerCandidate.key)
 			{
-				if(pkt.header.sourcePortId==trackerCurMaster.id)	//is this sync packet from our current master?
-				{
-					trackerCurMaster.FeedSync(pkt,port);
-					syncmgr.FeedSync(pkt,port);
-				}
-				else if(pkt.header.sourcePortId==trackerCandidate.id)	//is this sync packet from our current candidate?
-				{
-					trackerCandidate.FeedSync(pkt,port);
-
-				}
-		//		csprintf("SYNC ");
+				trackerCandidate.Start(pkt);
+				syncStandby.ResetStandby(syncmgr);
 			}
+		}
+	}
+	else if(port==320 && (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_DELAY_RESP && len>=(int) sizeof(PTP_DELAY_RESP_PACKET))
+	{
+		PTP_DELAY_RESP_PACKET & pkt=*((PTP_DELAY_RESP_PACKET *) packetBuffer);
+
+		//everybody gets everybody's delay responses, we only want the ones from our master answering us
 
+		if(pkt.header.sourcePortId==trackerCurMaster.id && pkt.delayResp.requestingPortId==portId)
+		{
+			logMinDelayReqInterval=pkt.header.logMessageInterval;
+			syncmgr.FeedDelayResp(pkt);
 		}
 	}
+	else if(port==319 && (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_PDELAY_RESP && len>=(int) sizeof(PTP_PDELAY_RESP_PACKET))
+	{
+		PTP_PDELAY_RESP_PACKET & pkt=*((PTP_PDELAY_RESP_PACKET *) packetBuffer);
 
+		if(delayMechanism==ESP1588_DELAY_P2P && pkt.pdelayResp.requestingPortId==portId)	//our peer answering us?
+		{
+			syncmgr.FeedPdelayResp(pkt,ulTimestamp,usMicros);
+		}
+	}
+	else if(port==320 && (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP && len>=(int) sizeof(PTP_PDELAY_RESP_PACKET))
+	{
+		PTP_PDELAY_RESP_PACKET & pkt=*((PTP_PDELAY_RESP_PACKET *) packetBuffer);
 
+		if(delayMechanism==ESP1588_DELAY_P2P && pkt.pdelayResp.requestingPortId==portId)
+		{
+			syncmgr.FeedPdelayRespFollowUp(pkt);
+		}
+	}
+	else if(port==319 && (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_PDELAY_REQ && len>=(int) sizeof(PTP_PDELAY_REQ_PACKET))
+	{
+		PTP_PDELAY_REQ_PACKET & pkt=*((PTP_PDELAY_REQ_PACKET *) packetBuffer);
+
+		//the switch measures its link to us too, and may not consider us PTP capable unless we answer.
 
-	if(millis()-ulMaintenance>=1000)
+		if(delayMechanism==ESP1588_DELAY_P2P && pkt.header.sourcePortId!=portId)
+		{
+			SendPdelayResp(pkt,ulTimestamp,usMicros);
+		}
+	}
+	else if(((pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_SYNC || (pkt.header.txSpecificMsgType & 0xF)==PTP_MSGTYPE_FOLLOW_UP)
+			&& len==(int) sizeof(PTP_PACKET))
 	{
-		ulMaintenance=millis();
-		Maintenance();
+		if(pkt.header.sourcePortId==trackerCurMaster.id)	//is this sync packet from our current master?
+		{
+			trackerCurMaster.FeedSync(pkt,port);
+			syncmgr.FeedSync(pkt,port,ulTimestamp,usMicros);
+		}
+		else if(pkt.header.sourcePortId==trackerCandidate.id)	//is this sync packet from our current candidate?
+		{
+			trackerCandidate.FeedSync(pkt,port);
+			syncStandby.FeedSync(pkt,port,ulTimestamp,usMicros);
+		}
+//		csprintf("SYNC ");
+	}
+
+}
+
+void ESP1588::SendDelayReq()
+{
+	PTP_DELAY_REQ_PACKET pkt;
+	memset(&pkt,0,sizeof(pkt));
+
+	pkt.header.txSpecificMsgType=PTP_MSGTYPE_DELAY_REQ;
+	pkt.header.versionPTP=2;
+	pkt.header.msgLen=htons(sizeof(pkt));
+	pkt.header.domainNumber=ucDomain;
+	pkt.header.sourcePortId=portId;
+	pkt.header.sequenceId=htons(++usDelayReqSeqId);
+	pkt.header.controlField=1;
+	pkt.header.logMessageInterval=0x7F;
+
+	ulDelayReqTimestamp=ESP1588_MillisMicros(usDelayReqMicros);
+
+	if(SendPacket(&pkt,sizeof(pkt),false,ulDelayReqTimestamp))
+	{
+		syncmgr.DelayReqSent(pkt.header.sequenceId,ulDelayReqTimestamp,usDelayReqMicros);
 	}
 
+	//the master tells us how often we may ask (logMessageInterval of its delay responses, one second until we know).
+	//IEEE 1588 wants the actual interval randomized so that a room full of fixtures powered up together don't all ask at once.
+
+	int log=logMinDelayReqInterval;
+	if(log<-3) log=-3;
+	if(log>4) log=4;
+
+	uint32_t interval=log>=0?(1000<<log):(1000>>(-log));
+
+	ulDelayReqInterval=(interval>>1)+(rand() % interval);
 
 }
 
+void ESP1588::SendPdelayReq()
+{
+	PTP_PDELAY_REQ_PACKET pkt;
+	memset(&pkt,0,sizeof(pkt));
+
+	pkt.header.txSpecificMsgType=PTP_MSGTYPE_PDELAY_REQ;
+	pkt.header.versionPTP=2;
+	pkt.header.msgLen=htons(sizeof(pkt));
+	pkt.header.domainNumber=ucDomain;
+	pkt.header.sourcePortId=portId;
+	pkt.header.sequenceId=htons(++usPdelayReqSeqId);
+	pkt.header.controlField=5;
+	pkt.header.logMessageInterval=0x7F;
+
+	ulDelayReqTimestamp=ESP1588_MillisMicros(usDelayReqMicros);
+
+	if(SendPacket(&pkt,sizeof(pkt),true,ulDelayReqTimestamp))
+	{
+		syncmgr.PdelayReqSent(pkt.header.sequenceId,ulDelayReqTimestamp,usDelayReqMicros);
+	}
+
+	ulDelayReqInterval=1000;	//logMinPdelayReqInterval default. link delay doesn't change much, no need to hurry.
+}
+
+void ESP1588::SendPdelayResp(PTP_PDELAY_REQ_PACKET & req, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros)
+{
+	//one-step response: no timestamps, our turnaround time (t3-t2) goes in the correctionField
+
+	PTP_PDELAY_RESP_PACKET pkt;
+	memset(&pkt,0,sizeof(pkt));
+
+	pkt.header.txSpecificMsgType=PTP_MSGTYPE_PDELAY_RESP;
+	pkt.header.versionPTP=2;
+	pkt.header.msgLen=htons(sizeof(pkt));
+	pkt.header.domainNumber=req.header.domainNumber;
+	pkt.header.sourcePortId=portId;
+	pkt.header.sequenceId=req.header.sequenceId;
+	pkt.header.controlField=5;
+	pkt.header.logMessageInterval=0x7F;
+	pkt.pdelayResp.requestingPortId=req.header.sourcePortId;
+
+	uint16_t usMicros;
+	uint32_t ulNow=ESP1588_MillisMicros(usMicros);
+
+	int64_t turnaround=((int64_t) (ulNow-ulReceiveTimestamp)*1000+usMicros-usReceiveMicros)*1000;
+
+	pkt.header.SetCorrectionNanos(req.header.GetCorrectionNanos()+turnaround);
+
+	SendPacket(&pkt,sizeof(pkt),true,ulNow);
+}
+
 void ESP1588::Maintenance()
 {
 	last_pps_count=pps_counter;
@@ -172,18 +651,43 @@ void ESP1588::Maintenance()
 	trackerCurMaster.Housekeeping();
 	trackerCandidate.Housekeeping();
 
+	foreignMasters.Housekeeping(ESP1588_Millis());
+
+	if(bPersistState && (!bStateSaved || ESP1588_Millis()-ulStateSaved>=ESP1588_STATE_INTERVAL)) SaveState();
+
 	syncmgr.Housekeeping();
+	syncStandby.Housekeeping();
+
+	if(++ucStatsShort>=ESP1588_STATS_SHORT_WINDOW)
+	{
+		ucStatsShort=0;
+		syncmgr.CompleteStatsWindow(false);
+		trackerCurMaster.CompleteWindow();
+		trackerCandidate.CompleteWindow();
+	}
+
+	if(++ucStatsLong>=ESP1588_STATS_LONG_WINDOW)
+	{
+		ucStatsLong=0;
+		syncmgr.CompleteStatsWindow(true);
+	}
 
 }
 
 
 void ESP1588::Quit()
 {
-	Udp.stop();
-	Udp2.stop();
+#if defined(ESP1588_HAVE_TASK)
+	task.Stop();
+#endif
+	SaveState();
+	Udp.Stop();
+	Udp2.Stop();
 	trackerCurMaster.Reset();
 	trackerCandidate.Reset();
+	foreignMasters.Reset();
 	syncmgr.Reset();
+	syncStandby.ResetStandby(syncmgr);
 }
 
 uint32_t IRAM_ATTR ESP1588::GetMillis()
@@ -191,6 +695,16 @@ uint32_t IRAM_ATTR ESP1588::GetMillis()
 	return syncmgr.GetMillis();
 }
 
+uint32_t IRAM_ATTR ESP1588::GetRawMillis()
+{
+	return syncmgr.GetRawMillis();
+}
+
+int32_t ESP1588::GetSlewRemainingMs()
+{
+	return syncmgr.GetSlewRemainingMs();
+}
+
 bool ESP1588::GetLockStatus()
 {
 	return syncmgr.GetLockStatus();
@@ -207,44 +721,130 @@ bool ESP1588::GetEverLocked()
 	return false;
 }
 
-bool ESP1588::GetEpochValid()
+bool IRAM_ATTR ESP1588::GetEpochValid()
 {
 	return syncmgr.GetEpochValid();
 }
 
-uint64_t ESP1588::GetEpochMillis64()
+uint64_t IRAM_ATTR ESP1588::GetEpochMillis64()
 {
 	return syncmgr.GetEpochMillis64();
 }
 
+uint64_t IRAM_ATTR ESP1588::GetMicros64()
+{
+	return syncmgr.GetEpochMicros64();
+}
+
+uint64_t IRAM_ATTR ESP1588::GetEpochNanos64()
+{
+	return syncmgr.GetEpochNanos64();
+}
+
+void IRAM_ATTR ESP1588::GetClockSnapshot(ESP1588_ClockSnapshot & out)
+{
+	syncmgr.GetClockSnapshot(out);
+}
+
 int16_t ESP1588::GetLastDiffMs()
 {
 	return syncmgr.GetLastDiffMs();
 }
 
+int16_t ESP1588::GetMeanPathDelayMs()
+{
+	return syncmgr.GetMeanPathDelayMs();
+}
+
+int32_t ESP1588::GetFrequencyPpb()
+{
+	return syncmgr.GetFrequencyPpb();
+}
+
+bool ESP1588::GetHoldover()
+{
+	return syncmgr.GetHoldover();
+}
+
+uint32_t ESP1588::GetHoldoverAgeMs()
+{
+	return syncmgr.GetHoldoverAgeMs();
+}
+
+uint32_t ESP1588::GetHoldoverErrorMs()
+{
+	return syncmgr.GetHoldoverErrorMs();
+}
+
+uint8_t ESP1588::GetDtim()
+{
+	return syncmgr.GetDtim();
+}
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
 const String & ESP1588::GetShortStatusString()
 {
-	if(GetLockStatus())
+	//formatted on the stack and copied in, so the String keeps the one buffer instead of reallocating for every piece on every call
+
+	char buf[24];
+
+	if(GetHoldover())
 	{
-		strShortStatus="OK (";
-		strShortStatus+=String(GetLastDiffMs());
-		strShortStatus+="ms)";
+		snprintf(buf,sizeof(buf),"HOLD (+-%ums)",(unsigned int) GetHoldoverErrorMs());
+	}
+	else if(GetLockStatus())
+	{
+		snprintf(buf,sizeof(buf),"OK (%dms)",GetLastDiffMs());
 	}
 	else
 	{
 		if(GetEpochValid())
 		{
-			strShortStatus="not OK";
+			strcpy(buf,"not OK");
 		}
 		else
 		{
-			strShortStatus="NOT OK";
+			strcpy(buf,"NOT OK");
 		}
 	}
+
+	strShortStatus.reserve(sizeof(buf));
+	strShortStatus=buf;
+
 	return strShortStatus;
 }
+#endif
 
 uint16_t ESP1588::GetRawPPS()			//raw packets per second
 {
 	return last_pps_count;
 }
+
+void ESP1588::GetStats(ESP1588_Stats & out)
+{
+	memset(&out,0,sizeof(out));
+
+	out.rxEvent=ulRxEvent;
+	out.rxGeneral=ulRxGeneral;
+	out.rxIgnored=ulRxIgnored;
+	out.pps=last_pps_count;
+	out.masterChanges=usMasterChanges;
+	out.foreignMasters=foreignMasters.GetCount();
+
+	syncmgr.GetStats(out);
+
+	trackerCurMaster.GetStats(out.master);
+	trackerCandidate.GetStats(out.candidate);
+}
+
+void ESP1588::ResetStats()
+{
+	ulRxEvent=0;
+	ulRxGeneral=0;
+	ulRxIgnored=0;
+	usMasterChanges=0;
+	ucStatsShort=0;
+	ucStatsLong=0;
+
+	syncmgr.ResetStats();
+}
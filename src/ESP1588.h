@@ -21,10 +21,13 @@
 #ifndef ESP1588_H_
 #define ESP1588_H_
 
-#include <WiFiUDP.h>
-
+#include "Platform.h"
 #include "Tracker.h"
+#include "ForeignMaster.h"
 #include "SyncMgr.h"
+#include "Capture.h"
+#include "Scheduler.h"
+#include "FastClock.h"
 #include "SmoothTimeLoop.h"
 
 
@@ -36,6 +39,32 @@ extern ESP1588 esp1588;
 
 
 
+#ifndef ESP1588_STATE_INTERVAL
+#define ESP1588_STATE_INTERVAL	60000	//ms between saves of the learned state while locked
+#endif
+
+#ifndef ESP1588_STATE_DURABLE_PPB
+#define ESP1588_STATE_DURABLE_PPB	1000	//the learned frequency has to move this much before it's worth a flash write
+#endif
+
+
+#ifndef ESP1588_TASK_PRIORITY
+#define ESP1588_TASK_PRIORITY	5		//above loop() (1), below the WiFi and lwIP tasks
+#endif
+
+#ifndef ESP1588_TASK_CORE
+#define ESP1588_TASK_CORE		0		//the protocol core. the Arduino loop() runs on core 1
+#endif
+
+
+enum ESP1588_DelayMechanism
+{
+	ESP1588_DELAY_NONE,				//trust one-way sync arrival, every node is offset by its own network latency
+	ESP1588_DELAY_E2E,				//delay request-response (end to end), the IEEE 1588 default
+	ESP1588_DELAY_P2P,				//peer delay (peer to peer), for networks of P2P transparent clocks
+};
+
+
 class ESP1588
 {
 public:
@@ -43,49 +72,174 @@ public:
 	virtual ~ESP1588();
 
 	void SetDomain(uint8_t domain);
+	void SetDelayMechanism(ESP1588_DelayMechanism mechanism);
+	void SetReceiveBudget(uint16_t maxPackets, uint16_t maxMillis);	//limits how much work one Loop() call may do draining the sockets
 	bool Begin();
 	void Loop();
 	void Quit();
 
+	//Call before Begin(). Remembers the master, the learned frequency, the path delay and the time across a reboot or deep sleep,
+	//so Begin() can pick up from there and lock within a sync interval or two. Saved every ESP1588_STATE_INTERVAL while locked,
+	//and by Quit(). Call SaveState() yourself right before going to deep sleep.
+	void SetStatePersistence(bool bEnable);
+	void SaveState();
+
+#if defined(ESP1588_PLATFORM_POSIX)
+	//Simulation and replay on the host: BeginOffline() is Begin() without the sockets, FeedPacket() then hands in datagrams
+	//as if they had arrived on port at ulTimestamp, usMicros into that millisecond (see ESP1588_MillisMicros()). Use ESP1588_SetClockSource()
+	//for the clock, and keep calling Loop() for the maintenance (the delay requests it sends go nowhere).
+	void BeginOffline();
+	void FeedPacket(int port, const void * buf, int len, uint32_t ulTimestamp, uint16_t usMicros=0);
+	void FeedSentPacket(const void * buf, int len, uint32_t ulTimestamp, uint16_t usMicros=0);	//one of our requests, from a recording (see SetPacketHook())
+#endif
+
+#if defined(ESP1588_HAVE_TASK)
+	//Call before Begin(). Begin() then starts a task of its own that sleeps until PTP traffic arrives and does everything Loop() does,
+	//so the sketch no longer needs to call Loop() (it returns immediately) and is free to use delay().
+	//GetMillis(), GetRawMillis(), GetEpochMillis64(), GetMicros64(), GetEpochNanos64(), GetEpochValid(), GetClockSnapshot() and GetLockStatus() are safe to call from anywhere meanwhile,
+	//GetMaster()/GetCandidate() and the status string are a best-effort look at state the task is updating.
+	void SetTaskMode(bool bEnable, uint8_t priority=ESP1588_TASK_PRIORITY, int8_t core=ESP1588_TASK_CORE);
+#endif
+
 	bool GetLockStatus();			//true if we're locked to a PTP clock
 	uint32_t GetMillis();			//returns PTP global epoch-based 32-bit milliseconds value
+	uint32_t GetRawMillis();		//the same without the smooth clock or the monotonic clamp, i.e. where the servo has the timeline right now
+
+	//Smooth clock, off by default. GetMillis() then doesn't step and doesn't go back: whatever moves the timeline (a servo step,
+	//a new master) is made up by running up to maxSlewPpm fast or slow until it has caught up with GetRawMillis().
+	//maxSlewPpm is capped at 500000. A difference bigger than stepLimitMs is stepped instead, so the first lock (local time to PTP
+	//time, could be decades) doesn't take days to catch up on even at the cap. stepLimitMs 0 never steps, whatever the difference.
+	//Takes effect with the next clock update. maxSlewPpm 0 turns it off again.
+	void SetSmoothClock(uint32_t maxSlewPpm, uint32_t stepLimitMs=1000);
+	int32_t GetSlewRemainingMs();	//how far GetMillis() is behind GetRawMillis(), negative if ahead. 0 once caught up
 
 	bool GetEverLocked();			//true if we're even been locked to a PTP clock
 
 	int16_t GetLastDiffMs();		//returns last difference between our time and the received sync packets
+	int16_t GetMeanPathDelayMs();	//returns the measured network latency from the master, zero until it has been measured
+	int32_t GetFrequencyPpb();		//returns the learned frequency correction of our crystal in parts per billion
+	uint8_t GetDtim();				//returns the access point's DTIM setting as detected from sync arrivals, 0 if no burst delivery is seen
+
+	//Holdover: when the master goes quiet we carry on at the learned frequency and stay locked until the estimated error exceeds the limit.
+	void SetHoldoverLimit(uint16_t ms);	//default 20ms
+	bool GetHoldover();					//true while locked without a master
+	uint32_t GetHoldoverAgeMs();		//time since the last sync packet, 0 when not in holdover
+	uint32_t GetHoldoverErrorMs();		//how far off we could have drifted by now, 0 when not in holdover
 
 
 	bool GetEpochValid();			//return true if the epoch is valid, i.e. actual time and date
 	uint64_t GetEpochMillis64();	//returns PTP global epoch-based 64-bit millisecond value.
 									//This does includes the ESB (extra significant bits) from the sync packet but please note this is MILLISECONDS not nanoseconds.
+	uint64_t GetMicros64();			//GetEpochMillis64() in microseconds and in nanoseconds, off the local microsecond clock (see ESP1588_MillisMicros()).
+	uint64_t GetEpochNanos64();		//packets are timestamped and the servo steered in microseconds, so these are as good as the software receive
+									//timestamps: tens of microseconds on a quiet wired link, whatever the Wi-Fi adds on top of that.
+
+	void GetClockSnapshot(ESP1588_ClockSnapshot & out);	//consistent copy of the clock state, safe from any context including ISRs.
+														//out.Millis(ESP1588_Millis()) is GetRawMillis(), out.SmoothMillis() the smooth clock.
 
 	ESP1588_Tracker & GetMaster() { return trackerCurMaster; }
 	ESP1588_Tracker & GetCandidate() { return trackerCandidate; }
+	uint8_t GetForeignMasterCount() { return foreignMasters.GetCount(); }	//clocks announcing in our domain, up to ESP1588_FOREIGN_MASTERS
 
+#if defined(ESP1588_PLATFORM_ARDUINO)
 	const String & GetShortStatusString();
+#endif
 
 	uint16_t GetRawPPS();			//raw packets per second
 
+	//Everything above and more (packet counters, offset statistics, time to lock, how the masters are doing) in one go,
+	//without touching the heap. Cheap enough to poll every second. Counters run from Begin() or ResetStats().
+	void GetStats(ESP1588_Stats & out);
+	void ResetStats();
+
+	//Hands every PTP datagram we receive or send to hook, with its local timestamp, e.g. to record a trace for replay on the host
+	//(see Capture.h). Called from Loop(), or from the task in task mode. Pass nullptr to stop.
+	void SetPacketHook(ESP1588_PacketHook hook, void * ctx=nullptr);
+
 protected:
+	friend class ESP1588_Scheduler;
+	friend class ESP1588_FastClock;
 
+#if defined(ESP1588_PLATFORM_ARDUINO)
 	String strShortStatus;
+#endif
 
 
 	ESP1588_Tracker trackerCurMaster;
 	ESP1588_Tracker trackerCandidate;
 
-	WiFiUDP Udp;
-	WiFiUDP Udp2;
+	ESP1588_ForeignMasters foreignMasters;
+
+	ESP1588_UDP Udp;
+	ESP1588_UDP Udp2;
 
 	uint32_t ulMaintenance=0;
 
+	void Prepare();		//everything Begin() does short of opening the sockets
+	void Run();			//one round of receiving, delay requests and maintenance. Loop() or the task
 	void Maintenance();
 
+#if defined(ESP1588_HAVE_TASK)
+	ESP1588_Task task;
+
+	bool bTaskMode=false;
+	uint8_t ucTaskPriority=ESP1588_TASK_PRIORITY;
+	int8_t cTaskCore=ESP1588_TASK_CORE;
+
+	static void TaskMain(void * arg);
+	uint32_t GetIdleTime();
+#endif
+
+	void ReceivePacket(ESP1588_UDP & udp, int port, int len);
+	bool WantPacket(const PTP_HEADER & header, int port);
+	void HandlePacket(int port, int len, uint32_t ulTimestamp, uint16_t usMicros);
+
+	uint16_t usReceiveBudgetPackets=32;
+	uint16_t usReceiveBudgetMillis=5;
+
+	bool SendPacket(const void * buf, int len, bool bPeerDelay, uint32_t ulTimestamp);
+	void SendDelayReq();
+	void SendPdelayReq();
+	void SendPdelayResp(PTP_PDELAY_REQ_PACKET & req, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros);
+
+	PTP_PORTID portId;		//our own port identity, derived from the MAC address
+
+	ESP1588_DelayMechanism delayMechanism=ESP1588_DELAY_E2E;
+
+	uint16_t usDelayReqSeqId=0;
+	uint16_t usPdelayReqSeqId=0;
+	uint32_t ulDelayReqTimestamp=0;
+	uint16_t usDelayReqMicros=0;
+	uint32_t ulDelayReqInterval=1000;
+	int8_t logMinDelayReqInterval=0;
+
 	ESP1588_Sync syncmgr;
+	ESP1588_Sync syncStandby;		//follows the candidate in the background, for a hitless failover
+
+	bool LoadState();
+
+	bool bPersistState=false;
+	bool bStateSaved=false;
+	uint32_t ulStateSaved=0;
+	PTP_PORTID durableMaster;		//what the last durable save had, see ESP1588_STATE_DURABLE_PPB
+	int32_t lDurableFreq=0;
+
+	ESP1588_PacketHook packetHook=nullptr;
+	void * packetHookCtx=nullptr;
+
+	ESP1588_Scheduler * volatile scheduler=nullptr;	//told whenever the clock changes, see ESP1588_Scheduler::Begin()
+	uint32_t ulScheduledGeneration=0;				//..of the clock snapshot it was last told about
 
 	uint16_t pps_counter=0;
 	uint16_t last_pps_count=0;
 
+	uint32_t ulRxEvent=0;
+	uint32_t ulRxGeneral=0;
+	uint32_t ulRxIgnored=0;
+	uint16_t usMasterChanges=0;
+	uint8_t ucStatsShort=0;		//seconds into the current ESP1588_STATS_SHORT_WINDOW
+	uint8_t ucStatsLong=0;
+
 	uint8_t ucDomain=0;
 
 	bool bInitialized=false;
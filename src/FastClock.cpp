@@ -0,0 +1,72 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "ESP1588.h"
+
+ESP1588_FastClock::ESP1588_FastClock(ESP1588 & ptp) : ptp(ptp), sync(ptp.syncmgr)
+{
+}
+
+uint32_t IRAM_ATTR ESP1588_FastClock::Anchor()
+{
+	ESP1588_ClockSnapshot s;
+	ptp.GetClockSnapshot(s);
+
+	uint32_t ulCycles=ESP1588_CycleCount();
+	uint16_t usMicros;
+	uint32_t ulLocal=ESP1588_MillisMicros(usMicros);
+
+	ulGeneration=s.generation;
+	ulAnchorCycles=ulCycles;
+
+	uint32_t ret;
+
+	if(s.ulSlewRateQ32 && s.SlewResidual(ulLocal))
+	{
+		ulHorizon=0;		//slewing, the rate changes when it has caught up. no shortcuts until then
+		ret=ptp.GetMillis();
+	}
+	else
+	{
+		//the CPU clock and the local millisecond clock come off the same crystal, so the nominal cycles per ms is exact.
+		//the servo's rate correction goes on top.
+
+		uint32_t ulPerMs=ESP1588_CyclesPerMs();
+
+		if(ulPerMs!=ulCyclesPerMs)
+		{
+			ulCyclesPerMs=ulPerMs;
+			ulNominalQ48=(uint32_t) (((1ULL<<48)+ulPerMs/2)/ulPerMs);	//rounded, truncating would floor exact ms a hair short
+		}
+
+		ulScaleQ48=ulNominalQ48+(int32_t) (((int64_t) ulNominalQ48*s.lRateQ32)>>32);
+		ulAnchorQ32=s.MillisQ32Micros(ulLocal,usMicros);
+		ulHorizon=ESP1588_FASTCLOCK_HORIZON;
+
+		ret=(uint32_t) (ulAnchorQ32>>32);
+	}
+
+	int32_t diff=ret-ulLast;
+	if(diff<0 && diff>-1000) return ulLast;
+
+	ulLast=ret;
+	return ret;
+}
@@ -0,0 +1,80 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "Platform.h"
+#include "SyncMgr.h"
+
+class ESP1588;
+
+//GetMillis() for hot paths, e.g. a 1kHz ISR. Once per clock update it anchors PTP time to the CPU cycle counter,
+//and from then on each call is a counter read, a check that the clock hasn't been updated since, and one multiply-shift:
+//no millis() (with its 64-bit arithmetic on ESP8266) and no snapshot copy.
+//
+//The cycle counter belongs to the core, so use one ESP1588_FastClock per core (or per context, it isn't locked either).
+//It follows GetMillis(), including its monotonic clamp. While the smooth clock is slewing it just calls GetMillis().
+//Call it at least every ESP1588_FASTCLOCK_HORIZON cycles (9s at 240MHz) for it to notice the counter wrapping,
+//or it can be one wrap out between clock updates.
+
+#ifndef ESP1588_FASTCLOCK_HORIZON
+#define ESP1588_FASTCLOCK_HORIZON	0x80000000		//cycles to extrapolate over at most, before anchoring again
+#endif
+
+class ESP1588_FastClock
+{
+public:
+	ESP1588_FastClock(ESP1588 & ptp);
+
+	inline uint32_t IRAM_ATTR GetMillis()
+	{
+		uint32_t ulElapsed=ESP1588_CycleCount()-ulAnchorCycles;
+
+		if(ulElapsed>=ulHorizon || sync.snap[sync.snapIdx].generation!=ulGeneration) return Anchor();
+
+		uint32_t ret=(uint32_t) ((ulAnchorQ32+(((uint64_t) ulElapsed*ulScaleQ48)>>16))>>32);
+
+		int32_t diff=ret-ulLast;
+		if(diff<0 && diff>-1000) return ulLast;		//as GetMillis(), don't go back over a clock update
+
+		ulLast=ret;
+		return ret;
+	}
+
+private:
+
+	ESP1588 & ptp;
+	ESP1588_Sync & sync;
+
+	uint32_t ulGeneration=0;		//of the clock snapshot we're anchored to
+	uint32_t ulAnchorCycles=0;
+	uint32_t ulHorizon=0;			//0 while there's no anchor to extrapolate from
+	uint64_t ulAnchorQ32=0;			//PTP millis at ulAnchorCycles, 32.32
+	uint32_t ulScaleQ48=0;			//PTP millis per cycle, of 2^48
+
+	uint32_t ulCyclesPerMs=0;		//what ulNominalQ48 was worked out for, the CPU clock can change
+	uint32_t ulNominalQ48=0;		//local millis per cycle, of 2^48
+
+	uint32_t ulLast=0;
+
+	uint32_t Anchor();
+
+};
@@ -0,0 +1,112 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ForeignMaster.h"
+
+ESP1588_ForeignMasters::ESP1588_ForeignMasters()
+{
+	Reset();
+}
+
+void ESP1588_ForeignMasters::Reset()
+{
+	count=0;
+}
+
+uint32_t ESP1588_ForeignMasters::Window(const ESP1588_ForeignMaster & fm)
+{
+	int8_t log=fm.logAnnounceInterval;
+	if(log<-3) log=-3;
+	if(log>4) log=4;
+
+	return log<0?(FOREIGN_MASTER_TIME_WINDOW*1000)>>-log:(FOREIGN_MASTER_TIME_WINDOW*1000)<<log;
+}
+
+ESP1588_ForeignMaster * ESP1588_ForeignMasters::Find(const PTP_PORTID & id)
+{
+	for(int i=0;i<count;i++)
+	{
+		if(table[i].id==id) return &table[i];
+	}
+	return nullptr;
+}
+
+bool ESP1588_ForeignMasters::IsQualified(const ESP1588_ForeignMaster & fm, uint32_t ulNow)
+{
+	return fm.announceCount>=FOREIGN_MASTER_THRESHOLD && (ulNow-fm.ulAnnounce[1])<=Window(fm);
+}
+
+ESP1588_ForeignMaster * ESP1588_ForeignMasters::FeedAnnounce(PTP_ANNOUNCE_PACKET & pkt, uint32_t ulNow)
+{
+	PTP_BMCA_KEY key=PTP_BMCA_KEY::From(pkt.announce);
+
+	ESP1588_ForeignMaster * fm=Find(pkt.header.sourcePortId);
+
+	if(!fm)
+	{
+		if(count<ESP1588_FOREIGN_MASTERS)
+		{
+			fm=&table[count++];
+		}
+		else
+		{
+			//full. make room by forgetting the worst one, if this is better.
+
+			ESP1588_ForeignMaster * worst=&table[0];
+			for(int i=1;i<count;i++)
+			{
+				if(worst->key<table[i].key) worst=&table[i];
+			}
+
+			if(!(key<worst->key)) return nullptr;
+
+			fm=worst;
+		}
+
+		fm->id=pkt.header.sourcePortId;
+		fm->announceCount=0;
+		fm->ulAnnounce[0]=ulNow;
+	}
+
+	fm->key=key;
+	fm->logAnnounceInterval=pkt.header.logMessageInterval;
+
+	fm->ulAnnounce[1]=fm->ulAnnounce[0];
+	fm->ulAnnounce[0]=ulNow;
+
+	if(fm->announceCount<FOREIGN_MASTER_THRESHOLD) fm->announceCount++;
+
+	return fm;
+}
+
+void ESP1588_ForeignMasters::Housekeeping(uint32_t ulNow)
+{
+	for(int i=0;i<count;)
+	{
+		if((ulNow-table[i].ulAnnounce[0])>Window(table[i]))
+		{
+			table[i]=table[--count];	//order doesn't matter
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
@@ -0,0 +1,73 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "PTP.h"
+
+//Foreign master table (IEEE 1588-2008 9.3.2.4). Every clock announcing in our domain gets an entry, and it only becomes
+//eligible as a candidate once it has proven to be there: FOREIGN_MASTER_THRESHOLD announces within
+//FOREIGN_MASTER_TIME_WINDOW announce intervals. Entries that stop announcing age out.
+
+#ifndef ESP1588_FOREIGN_MASTERS
+#define ESP1588_FOREIGN_MASTERS		5		//the standard's minimum
+#endif
+
+struct ESP1588_ForeignMaster
+{
+	PTP_PORTID id;
+	PTP_BMCA_KEY key;
+
+	int8_t logAnnounceInterval;
+	uint8_t announceCount;			//up to FOREIGN_MASTER_THRESHOLD
+	uint32_t ulAnnounce[2];			//arrival of the latest announce and the one before it
+};
+
+class ESP1588_ForeignMasters
+{
+public:
+	enum
+	{
+		FOREIGN_MASTER_THRESHOLD=2,
+		FOREIGN_MASTER_TIME_WINDOW=4,
+	};
+
+	ESP1588_ForeignMasters();
+
+	void Reset();
+
+	//records an announce. returns its entry, or nullptr if the table is full of better clocks.
+	ESP1588_ForeignMaster * FeedAnnounce(PTP_ANNOUNCE_PACKET & pkt, uint32_t ulNow);
+
+	ESP1588_ForeignMaster * Find(const PTP_PORTID & id);
+	bool IsQualified(const ESP1588_ForeignMaster & fm, uint32_t ulNow);
+
+	void Housekeeping(uint32_t ulNow);	//drops the ones that have gone quiet
+
+	uint8_t GetCount() { return count; }
+
+private:
+
+	uint32_t Window(const ESP1588_ForeignMaster & fm);
+
+	ESP1588_ForeignMaster table[ESP1588_FOREIGN_MASTERS];
+	uint8_t count=0;
+
+};
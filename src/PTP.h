@@ -20,23 +20,50 @@
 
 #pragma once
 
-#define PACKED
-#pragma pack(push,1)
-
 //#define PTP_SYNCMGR_DEBUG
 //#define PTP_TRACKER_DEBUG
 //#define PTP_MAIN_DEBUG
 
-#include <WiFiUDP.h>
+#include "Platform.h"
+
+//messageType, the low nibble of txSpecificMsgType
+#define PTP_MSGTYPE_SYNC				0x0
+#define PTP_MSGTYPE_DELAY_REQ			0x1
+#define PTP_MSGTYPE_PDELAY_REQ			0x2
+#define PTP_MSGTYPE_PDELAY_RESP			0x3
+#define PTP_MSGTYPE_FOLLOW_UP			0x8
+#define PTP_MSGTYPE_DELAY_RESP			0x9
+#define PTP_MSGTYPE_PDELAY_RESP_FOLLOW_UP	0xA
+#define PTP_MSGTYPE_ANNOUNCE			0xB
+
+
+//Nanoseconds to milliseconds without dividing: ESP8266 has no hardware divider, and a 64-bit division is a software routine
+//on both. Multiply by 2^50/10^6 rounded up and shift back, which is exact for every 32-bit input: the rounding error, less than
+//2^18 per 10^6, stays below one 2^50th of a millisecond for anything under 2^32 ns.
+
+constexpr uint32_t PTP_MILLIS_PER_NANO_Q50=(uint32_t) (((1ULL<<50)+999999)/1000000);
+
+static_assert((uint64_t) PTP_MILLIS_PER_NANO_Q50*1000000-(1ULL<<50)<=(1ULL<<18),"PTP_NanosToMillis() wouldn't be exact");
+
+inline uint32_t PTP_NanosToMillis(uint32_t nanos)
+{
+	return (uint32_t) (((uint64_t) nanos*PTP_MILLIS_PER_NANO_Q50)>>50);
+}
+
+//..and to microseconds, for what that leaves of a millisecond. The same with 2^32/1000, exact for anything under 6ms.
 
-#if defined(ARDUINO_ARCH_ESP32)
-#include <lwip/def.h>
-#endif
+constexpr uint32_t PTP_MICROS_PER_NANO_Q32=(uint32_t) (((1ULL<<32)+999)/1000);
 
-#if defined(PTP_SYNCMGR_DEBUG) | defined(PTP_TRACKER_DEBUG)
-//#include <LeifESPBase.h>
-#define csprintf Serial.printf
-#endif
+static_assert((uint64_t) PTP_MICROS_PER_NANO_Q32*1000-(1ULL<<32)<=(1ULL<<32)/6000000,"PTP_NanosToMicros() wouldn't be exact");
+
+inline uint32_t PTP_NanosToMicros(uint32_t nanos)	//nanos under 6000000
+{
+	return (uint32_t) (((uint64_t) nanos*PTP_MICROS_PER_NANO_Q32)>>32);
+}
+
+
+#define PACKED
+#pragma pack(push,1)
 
 
 typedef uint8_t		PTP_CLOCKID[8];
@@ -74,6 +101,49 @@ struct PTP_HEADER
 	uint8_t         controlField;
 	int8_t          logMessageInterval;
 
+	int64_t GetCorrectionNanos() const
+	{
+		//correctionField is big endian nanoseconds * 2^16. assemble it byte by byte, the packet buffer is not aligned.
+
+		const uint8_t * b=(const uint8_t *) &correctionField;
+		uint64_t v=0;
+		for(int i=0;i<8;i++)
+		{
+			v=(v<<8) | b[i];
+		}
+		return ((int64_t) v)>>16;
+	};
+
+	int32_t GetCorrectionMillis() const		//truncated toward zero, like dividing
+	{
+		int64_t nanos=GetCorrectionNanos();
+
+		int64_t sign=nanos>>63;				//0 or -1, the sign goes around the magnitude without branching on it
+		uint64_t magnitude=(nanos^sign)-sign;
+
+		if(magnitude>0xFFFFFFFF) return (int32_t) (nanos/1000000);	//more than four seconds of it. never seen one, but get it right
+
+		return ((int32_t) PTP_NanosToMillis((uint32_t) magnitude)^(int32_t) sign)-(int32_t) sign;
+	};
+
+	int32_t GetCorrectionMicros() const		//what GetCorrectionMillis() truncated, in microseconds: -999..999, the same sign
+	{
+		int32_t rest=(int32_t) (GetCorrectionNanos()-(int64_t) GetCorrectionMillis()*1000000);
+
+		return rest<0?-(int32_t) PTP_NanosToMicros((uint32_t) -rest):(int32_t) PTP_NanosToMicros((uint32_t) rest);
+	};
+
+	void SetCorrectionNanos(int64_t nanos)
+	{
+		uint64_t v=(uint64_t) nanos<<16;
+		uint8_t * b=(uint8_t *) &correctionField;
+		for(int i=7;i>=0;i--)
+		{
+			b[i]=(uint8_t) v;
+			v>>=8;
+		}
+	};
+
 };
 
 struct PTP_SYNC_MESSAGE
@@ -81,6 +151,25 @@ struct PTP_SYNC_MESSAGE
 	uint16_t		timestamp_secs_ESB;	//extra significant bits
 	uint32_t		timestamp_secs;
 	uint32_t		timestamp_nanos;
+
+	uint64_t GetMillis64() const		//the timestamp in milliseconds, extra significant bits and all
+	{
+		uint64_t secs=((uint64_t) ntohs(timestamp_secs_ESB)<<32) | ntohl(timestamp_secs);
+
+		return secs*1000+PTP_NanosToMillis(ntohl(timestamp_nanos));
+	};
+
+	uint32_t GetMillis() const			//the low 32 bits of that, for less work
+	{
+		return ntohl(timestamp_secs)*1000+PTP_NanosToMillis(ntohl(timestamp_nanos));
+	};
+
+	uint32_t GetMicros() const			//what those truncated, in microseconds: 0..999
+	{
+		uint32_t nanos=ntohl(timestamp_nanos);
+
+		return PTP_NanosToMicros(nanos-PTP_NanosToMillis(nanos)*1000000);
+	};
 };
 
 struct PTP_FOLLOWUP_MESSAGE
@@ -99,6 +188,43 @@ struct PTP_PACKET
 	} msg;
 };
 
+struct PTP_DELAY_REQ_PACKET
+{
+	PTP_HEADER header;
+	PTP_SYNC_MESSAGE originTimestamp;
+};
+
+struct PTP_DELAY_RESP_MESSAGE
+{
+	PTP_SYNC_MESSAGE receiveTimestamp;			// 10 octets
+	PTP_PORTID requestingPortId;				// 10 octets
+};
+
+struct PTP_DELAY_RESP_PACKET
+{
+	PTP_HEADER header;
+	PTP_DELAY_RESP_MESSAGE delayResp;
+};
+
+struct PTP_PDELAY_REQ_PACKET
+{
+	PTP_HEADER header;
+	PTP_SYNC_MESSAGE originTimestamp;
+	uint8_t reserved[10];
+};
+
+struct PTP_PDELAY_RESP_MESSAGE
+{
+	PTP_SYNC_MESSAGE timestamp;					// 10 octets, requestReceiptTimestamp (Pdelay_Resp) or responseOriginTimestamp (Pdelay_Resp_Follow_Up)
+	PTP_PORTID requestingPortId;				// 10 octets
+};
+
+struct PTP_PDELAY_RESP_PACKET
+{
+	PTP_HEADER header;
+	PTP_PDELAY_RESP_MESSAGE pdelayResp;
+};
+
 struct PTP_CLOCK_QUALITY
 {
 	uint8_t clockClass;
@@ -185,3 +311,54 @@ struct PTP_ANNOUNCE_PACKET
 #pragma pack(pop)
 #undef PACKED
 
+
+//The BMCA dataset comparison (IEEE 1588-2008 9.3.4) packed into one big-endian number, lower is better:
+//priority1, clockClass, clockAccuracy, offsetScaledLogVariance, priority2, grandmaster identity, stepsRemoved.
+//Computed once per announce so choosing between masters is an integer compare rather than walking the fields.
+//(Unlike bmca_compare() above, identity ties go to the lower identity, as in the standard.)
+
+struct PTP_BMCA_KEY
+{
+	uint64_t hi;	//priority1 .. priority2, then the first two octets of the identity
+	uint64_t lo;	//the other six octets of the identity, stepsRemoved
+
+	static PTP_BMCA_KEY Worst()
+	{
+		PTP_BMCA_KEY k;
+		k.hi=~0ULL;
+		k.lo=~0ULL;
+		return k;
+	}
+
+	static PTP_BMCA_KEY From(const PTP_ANNOUNCE_MESSAGE & a)
+	{
+		PTP_BMCA_KEY k;
+
+		k.hi=((uint64_t) a.grandmasterPriority1<<56) |
+			((uint64_t) a.grandmasterClockQuality.clockClass<<48) |
+			((uint64_t) a.grandmasterClockQuality.clockAccuracy<<40) |
+			((uint64_t) ntohs(a.grandmasterClockQuality.offsetScaledLogVariance)<<24) |
+			((uint64_t) a.grandmasterPriority2<<16) |
+			((uint64_t) a.grandmasterIdentity[0]<<8) |
+			a.grandmasterIdentity[1];
+
+		k.lo=0;
+		for(int i=2;i<8;i++)
+		{
+			k.lo=(k.lo<<8) | a.grandmasterIdentity[i];
+		}
+		k.lo=(k.lo<<16) | ntohs(a.stepsRemoved);
+
+		return k;
+	}
+
+	bool operator < (const PTP_BMCA_KEY & other) const	//"better than"
+	{
+		return hi<other.hi || (hi==other.hi && lo<other.lo);
+	}
+	bool operator== (const PTP_BMCA_KEY & other) const
+	{
+		return hi==other.hi && lo==other.lo;
+	}
+};
+
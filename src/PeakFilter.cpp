@@ -0,0 +1,75 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "PeakFilter.h"
+
+#define MASK (ESP1588_PEAKFILTER_SIZE-1)
+
+ESP1588_PeakFilter::ESP1588_PeakFilter()
+{
+	Reset();
+}
+
+void ESP1588_PeakFilter::Reset()
+{
+	head=0;
+	count=0;
+	bias=0;
+}
+
+void ESP1588_PeakFilter::Insert(uint32_t ulTimestamp, int32_t sample)
+{
+	int32_t v=sample-bias;
+
+	//anything at the back that isn't higher than the new sample is history
+
+	while(count && value[(head+count-1) & MASK]<=v) count--;
+
+	//anything at the front that has aged out of the window, too
+
+	while(count && (ulTimestamp-timestamp[head])>ulWindow)
+	{
+		head=(head+1) & MASK;
+		count--;
+	}
+
+	if(count==ESP1588_PEAKFILTER_SIZE)	//full of a long falling run, give up the oldest
+	{
+		head=(head+1) & MASK;
+		count--;
+	}
+
+	int idx=(head+count) & MASK;
+	timestamp[idx]=ulTimestamp;
+	value[idx]=v;
+	count++;
+}
+
+int32_t ESP1588_PeakFilter::GetPeak()
+{
+	if(!count) return INT32_MIN;
+
+	return value[head]+bias;
+}
+
+void ESP1588_PeakFilter::Shift(int32_t delta)
+{
+	bias+=delta;
+}
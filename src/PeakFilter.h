@@ -0,0 +1,61 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "Platform.h"
+
+//Running maximum over a time window, e.g. the highest sync diff of the last four seconds.
+//
+//Kept as a monotonic deque: every entry is newer and lower than the one before it, since an older sample that's
+//no higher than a newer one can never be the peak again. Insert() and GetPeak() are amortized O(1) no matter how
+//many samples the window holds, and the window is in milliseconds, so lost packets don't stretch it.
+
+#ifndef ESP1588_PEAKFILTER_SIZE
+#define ESP1588_PEAKFILTER_SIZE	64	//power of two. only falling runs take up room, if one overflows the window is cut short.
+#endif
+
+class ESP1588_PeakFilter
+{
+public:
+	ESP1588_PeakFilter();
+
+	void Reset();
+	void SetWindow(uint32_t ulWindowMillis) { ulWindow=ulWindowMillis; }
+	uint32_t GetWindow() { return ulWindow; }
+
+	void Insert(uint32_t ulTimestamp, int32_t value);
+	int32_t GetPeak();					//INT32_MIN if empty
+
+	void Shift(int32_t delta);			//adds delta to every sample in the window, O(1)
+
+private:
+
+	uint32_t ulWindow=4000;
+
+	uint32_t timestamp[ESP1588_PEAKFILTER_SIZE];
+	int32_t value[ESP1588_PEAKFILTER_SIZE];	//minus bias
+
+	uint8_t head=0;		//oldest (highest)
+	uint8_t count=0;
+
+	int32_t bias=0;
+
+};
@@ -0,0 +1,356 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+//Thin platform layer. Everything the PTP core needs from the outside world goes through here:
+//a millisecond clock source, the multicast UDP transport and debug logging.
+//
+//ESP8266/ESP32 (Arduino core) is implemented in PlatformArduino.cpp,
+//Linux/POSIX in PlatformPosix.cpp so the same servo and BMCA code can be run and measured on a PC.
+
+#if defined(ARDUINO)
+#define ESP1588_PLATFORM_ARDUINO
+#else
+#define ESP1588_PLATFORM_POSIX
+#endif
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(ESP1588_PLATFORM_POSIX)
+#define ESP1588_HAVE_TASK		//ESP8266 has no scheduler, there the sketch has to call Loop()
+#endif
+
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+
+#include <Arduino.h>
+#include <lwip/udp.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <lwip/def.h>
+#include <esp_timer.h>
+#else
+extern "C" {
+#include <user_interface.h>		//os_timer
+}
+#endif
+
+#ifndef csprintf
+#define csprintf Serial.printf
+#endif
+
+#else
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <thread>
+#include <mutex>
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+#ifndef csprintf
+#define csprintf printf
+#endif
+
+#endif
+
+
+#define PTP_EVENT_PORT		319
+#define PTP_GENERAL_PORT	320
+
+
+//Clock source. Free-running milliseconds since boot, wraps every 49.7 days exactly like millis().
+//ESP1588_Micros64() is the same clock in microseconds, 64 bits so it doesn't wrap: ESP1588_Millis() is it /1000, truncated.
+//Timestamps are taken with ESP1588_MillisMicros() below, the milliseconds for everything that counts in them, and the
+//microseconds into that millisecond for the servo.
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+
+inline uint32_t ESP1588_Millis()
+{
+	return millis();
+}
+
+inline uint64_t IRAM_ATTR ESP1588_Micros64()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+	return esp_timer_get_time();
+#else
+	return micros64();
+#endif
+}
+
+//Cycle counter for ESP1588_FastClock: one register read on the ESPs. 32 bits, wraps every 2^32 cycles (18s at 240MHz).
+
+inline uint32_t IRAM_ATTR ESP1588_CycleCount()
+{
+	return ESP.getCycleCount();
+}
+
+inline uint32_t ESP1588_CyclesPerMs()
+{
+	return ESP.getCpuFreqMHz()*1000;
+}
+
+#else
+
+uint32_t ESP1588_Millis();
+uint64_t ESP1588_Micros64();
+
+//The host has no cycle counter that's both cheap and steady across cores and frequency changes, so it counts nanoseconds
+//(clock_gettime() is a vDSO call). Simulated milliseconds when there's a clock source.
+uint32_t ESP1588_CycleCount();
+inline uint32_t ESP1588_CyclesPerMs() { return 1000000; }
+
+//The host clock can be replaced, e.g. with a simulated clock when replaying or generating traffic.
+//Pass nullptr to go back to CLOCK_MONOTONIC.
+typedef uint32_t (*ESP1588_ClockSource)();
+void ESP1588_SetClockSource(ESP1588_ClockSource source);
+
+#endif
+
+//ESP1588_Millis(), and how many microseconds into that millisecond it is (0..999), without a 64-bit division: the low
+//32 bits of the microseconds are enough for the difference. A millisecond that ticks over between the two reads is
+//caught, and a clock source without microseconds gets 0.
+
+inline uint32_t IRAM_ATTR ESP1588_MillisMicros(uint16_t & usMicros)
+{
+	uint32_t ulMillis=ESP1588_Millis();
+	uint32_t fraction=(uint32_t) ESP1588_Micros64()-ulMillis*1000;
+
+	if(fraction>=1000 && fraction<2000)
+	{
+		ulMillis++;
+		fraction-=1000;
+	}
+
+	usMicros=fraction<1000?(uint16_t) fraction:0;
+	return ulMillis;
+}
+
+
+//Hardware address of the network interface, used to derive our PTP clock identity.
+void ESP1588_GetMacAddress(uint8_t mac[6]);
+
+
+//Somewhere to keep what we've learned across a reboot or deep sleep (see ESP1588::SetStatePersistence()).
+//ESP32: RTC memory, which survives deep sleep and resets, plus NVS for power cycles when bDurable is set.
+//ESP8266: RTC user memory, ESP1588_RTC_USER_OFFSET onwards. Host: a file, see ESP1588_SetStateFile().
+//
+//LoadState() fills in how long ago the state was saved, if the platform has a clock that kept running meanwhile.
+
+#ifndef ESP1588_STATE_SIZE
+#define ESP1588_STATE_SIZE			64		//bytes, at most
+#endif
+
+#define ESP1588_STATE_AGE_UNKNOWN	0xFFFFFFFF
+
+bool ESP1588_SaveState(const void * buf, size_t len, bool bDurable);
+bool ESP1588_LoadState(void * buf, size_t len, uint32_t & ulAge);
+
+#if defined(ESP1588_PLATFORM_POSIX)
+void ESP1588_SetStateFile(const char * path);	//default "esp1588.state" in the working directory
+#endif
+
+
+//UDP transport. One instance per PTP port, joined to the PTP primary multicast group (224.0.1.129)
+//and the peer delay group (224.0.0.107), which link-local peer delay messages use.
+//
+//Every datagram is timestamped the moment it arrives, not when Loop() gets around to reading it:
+//on ESP8266/ESP32 in the lwIP receive callback, which queues it in a small lock-free ring,
+//on Linux by the kernel (SO_TIMESTAMPNS).
+
+#ifndef ESP1588_RX_RING_SLOTS
+#define ESP1588_RX_RING_SLOTS	8		//per port, power of two. a DTIM 3 burst at logSyncInterval -3 is about 3 syncs + 3 follow-ups
+#endif
+
+#ifndef ESP1588_RX_SLOT_SIZE
+#define ESP1588_RX_SLOT_SIZE	64		//the largest message we use is an announce, 64 bytes
+#endif
+
+class ESP1588_UDP
+{
+public:
+	ESP1588_UDP();
+	~ESP1588_UDP();
+
+	bool BeginMulticast(uint16_t port);
+	void Stop();
+
+	//Same model as WiFiUDP: ParsePacket() moves on to the next queued datagram and returns its length (0 if there is none),
+	//Read() then reads it piecewise, so a packet can be rejected from its header without reading the rest.
+	int ParsePacket();
+	int Read(void * buf, int len);
+	uint32_t GetTimestamp() { return rxTimestamp; }	//ESP1588_Millis() when the current datagram arrived
+	uint16_t GetTimestampMicros() { return rxMicros; }	//..and the microseconds into that millisecond, see ESP1588_MillisMicros()
+
+	bool Send(const void * buf, int len, bool bPeerDelay=false);	//sends a datagram to the primary (or peer delay) group on our port.
+
+#if defined(ESP1588_HAVE_TASK)
+	//Blocks until a datagram is waiting on either port or ulTimeout milliseconds have passed. For the PTP task only.
+	static void WaitAny(ESP1588_UDP & a, ESP1588_UDP & b, uint32_t ulTimeout);
+#endif
+
+private:
+
+	uint16_t port=0;
+
+	uint32_t rxTimestamp=0;
+	uint16_t rxMicros=0;
+	int rxLen=0;
+	int rxPos=0;
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+
+	struct RX_SLOT
+	{
+		uint32_t timestamp;
+		uint16_t micros;
+		uint16_t len;
+		uint8_t data[ESP1588_RX_SLOT_SIZE];
+	};
+
+	//single producer (the lwIP callback), single consumer (ParsePacket)
+	RX_SLOT ring[ESP1588_RX_RING_SLOTS];
+	volatile uint8_t ringHead=0;
+	volatile uint8_t ringTail=0;
+	bool bHoldingSlot=false;
+
+	struct udp_pcb * pcb=nullptr;
+
+	static void OnReceive(void * arg, struct udp_pcb * pcb, struct pbuf * p, const ip_addr_t * addr, u16_t port);
+
+	friend struct ESP1588_UDP_Call;
+	bool BeginInternal();
+	void StopInternal();
+	bool SendInternal(const void * buf, int len, bool bPeerDelay);
+
+#else
+	int fd=-1;
+
+	uint8_t rxBuffer[512];
+#endif
+
+};
+
+
+//A thread of our own for the PTP engine (see ESP1588::SetTaskMode()): a FreeRTOS task on ESP32, a std::thread on the host.
+
+#if defined(ESP1588_HAVE_TASK)
+
+class ESP1588_Task
+{
+public:
+	typedef void (*Function)(void * arg);
+
+	//priority and core are FreeRTOS' (core <0 means either). the host ignores both and leaves it to the OS scheduler.
+	bool Start(Function fn, void * arg, uint8_t priority, int8_t core);
+	void Stop();			//asks the function to return (it has to check StopRequested()) and waits until it has
+
+	bool Running() { return bRunning; }
+	bool StopRequested() { return bStop; }
+
+private:
+
+	Function fn=nullptr;
+	void * arg=nullptr;
+
+	volatile bool bRunning=false;
+	volatile bool bStop=false;
+
+	static void Entry(void * param);
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+	TaskHandle_t handle=nullptr;
+#else
+	std::thread thread;
+#endif
+};
+
+#endif
+
+
+//A short critical section, for state shared with a timer callback: interrupts off on ESP8266, a spinlock on ESP32, a mutex
+//on the host. Not recursive, and nothing slow in between.
+
+class ESP1588_Lock
+{
+public:
+#if defined(ARDUINO_ARCH_ESP8266)
+	void IRAM_ATTR Enter() { ulSavedPS=xt_rsil(15); }
+	void IRAM_ATTR Leave() { xt_wsr_ps(ulSavedPS); }
+private:
+	uint32_t ulSavedPS=0;
+#elif defined(ESP1588_PLATFORM_ARDUINO)
+	void Enter() { portENTER_CRITICAL(&mux); }
+	void Leave() { portEXIT_CRITICAL(&mux); }
+private:
+	portMUX_TYPE mux=portMUX_INITIALIZER_UNLOCKED;
+#else
+	void Enter() { mutex.lock(); }
+	void Leave() { mutex.unlock(); }
+private:
+	std::mutex mutex;
+#endif
+};
+
+
+//A one-shot timer (see ESP1588_Scheduler). The callback runs in the esp_timer task on ESP32, and in a thread of its own
+//waiting on a timerfd on Linux. On ESP8266 it's an SDK software timer (os_timer), not timer1: the core's waveform generator
+//(analogWrite(), tone(), Servo) and the timer interrupt libraries take timer1 for themselves. The callback runs between
+//loop() passes, so a loop() that blocks holds it up, and the resolution is a millisecond.
+
+#define ESP1588_ONESHOT_MAX_MICROS	60000000
+
+class ESP1588_OneShot
+{
+public:
+	typedef void (*Function)(void * arg);
+
+	bool Begin(Function fn, void * arg);
+	void End();
+
+	void Arm(uint32_t ulMicros);	//fires once that long from now (at most ESP1588_ONESHOT_MAX_MICROS), replacing whatever was armed
+	void Disarm();
+
+private:
+
+	Function fn=nullptr;
+	void * arg=nullptr;
+
+#if defined(ARDUINO_ARCH_ESP8266)
+	os_timer_t timer;
+	bool bBegun=false;
+#elif defined(ESP1588_PLATFORM_ARDUINO)
+	esp_timer_handle_t handle=nullptr;
+#else
+	int fd=-1;						//timerfd
+	volatile uint64_t ulDeadline=0;	//CLOCK_MONOTONIC microseconds, where there's no timerfd (not Linux)
+	volatile bool bStop=false;
+	std::thread thread;
+
+	static void Entry(ESP1588_OneShot * self);
+#endif
+};
+
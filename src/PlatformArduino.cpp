@@ -0,0 +1,552 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Platform.h"
+
+#if defined(ESP1588_PLATFORM_ARDUINO)
+
+#if defined(ARDUINO_ARCH_ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+
+#include <lwip/igmp.h>
+#include <lwip/pbuf.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <lwip/priv/tcpip_priv.h>
+#include <Preferences.h>
+#include <sys/time.h>
+
+//On ESP32 lwIP runs in its own task, and the raw API may only be used from there.
+//(ESP8266 has a single context, we can call it directly.)
+
+struct ESP1588_UDP_Call
+{
+	struct tcpip_api_call_data call;
+	ESP1588_UDP * udp;
+	const void * buf;
+	int len;
+	bool bPeerDelay;
+	bool bResult;
+
+	static err_t Begin(struct tcpip_api_call_data * data)
+	{
+		ESP1588_UDP_Call * c=(ESP1588_UDP_Call *) data;
+		c->bResult=c->udp->BeginInternal();
+		return ERR_OK;
+	}
+
+	static err_t Stop(struct tcpip_api_call_data * data)
+	{
+		ESP1588_UDP_Call * c=(ESP1588_UDP_Call *) data;
+		c->udp->StopInternal();
+		return ERR_OK;
+	}
+
+	static err_t Send(struct tcpip_api_call_data * data)
+	{
+		ESP1588_UDP_Call * c=(ESP1588_UDP_Call *) data;
+		c->bResult=c->udp->SendInternal(c->buf,c->len,c->bPeerDelay);
+		return ERR_OK;
+	}
+};
+#endif
+
+#if defined(ESP1588_HAVE_TASK)
+static volatile TaskHandle_t waitingTask=nullptr;	//whoever is in WaitAny(), woken by OnReceive()
+#endif
+
+void ESP1588_GetMacAddress(uint8_t mac[6])
+{
+	WiFi.macAddress(mac);
+}
+
+
+//Persistent state. RTC memory holds garbage after power-up, so it carries a checksum.
+
+#ifndef ESP1588_RTC_USER_OFFSET
+#define ESP1588_RTC_USER_OFFSET		96		//ESP8266, in 4-byte blocks of the 128 the sketch may use. leaves the first 384 bytes alone
+#endif
+
+struct ESP1588_RtcState
+{
+	uint32_t check;
+	uint32_t len;
+	uint64_t ulSaved;		//ESP32: gettimeofday() milliseconds, which the RTC keeps counting through deep sleep
+	uint8_t data[ESP1588_STATE_SIZE];
+};
+
+static uint32_t StateCheck(const ESP1588_RtcState & state)
+{
+	uint32_t check=0x1588;
+
+	const uint8_t * p=(const uint8_t *) &state.len;
+	const uint8_t * end=state.data+ESP1588_STATE_SIZE;
+
+	while(p<end)
+	{
+		check=(check*31)+*p++;
+	}
+
+	return check;
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+
+static RTC_NOINIT_ATTR ESP1588_RtcState rtcState;
+
+static uint64_t WallMillis()
+{
+	struct timeval tv;
+	gettimeofday(&tv,nullptr);
+
+	return ((uint64_t) tv.tv_sec*1000) + (tv.tv_usec/1000);
+}
+
+bool ESP1588_SaveState(const void * buf, size_t len, bool bDurable)
+{
+	if(len>ESP1588_STATE_SIZE) return false;
+
+	memset(rtcState.data,0,sizeof(rtcState.data));
+	memcpy(rtcState.data,buf,len);
+	rtcState.len=len;
+	rtcState.ulSaved=WallMillis();
+	rtcState.check=StateCheck(rtcState);
+
+	if(!bDurable) return true;
+
+	//flash wears out, the caller only asks for this when something worth keeping over a power cycle has changed
+
+	Preferences prefs;
+	if(!prefs.begin("esp1588")) return false;
+	bool bOk=prefs.putBytes("state",buf,len)==len;
+	prefs.end();
+
+	return bOk;
+}
+
+bool ESP1588_LoadState(void * buf, size_t len, uint32_t & ulAge)
+{
+	if(rtcState.check==StateCheck(rtcState) && rtcState.len==len)	//woken from deep sleep, or reset
+	{
+		memcpy(buf,rtcState.data,len);
+
+		uint64_t ulNow=WallMillis();
+
+		ulAge=ESP1588_STATE_AGE_UNKNOWN;
+		if(ulNow>=rtcState.ulSaved && ulNow-rtcState.ulSaved<ESP1588_STATE_AGE_UNKNOWN) ulAge=(uint32_t) (ulNow-rtcState.ulSaved);
+
+		return true;
+	}
+
+	//powered up. no idea how long we've been off.
+
+	Preferences prefs;
+	if(!prefs.begin("esp1588",true)) return false;
+	bool bOk=prefs.getBytesLength("state")==len && prefs.getBytes("state",buf,len)==len;
+	prefs.end();
+
+	ulAge=ESP1588_STATE_AGE_UNKNOWN;
+
+	return bOk;
+}
+
+#else
+
+bool ESP1588_SaveState(const void * buf, size_t len, bool bDurable)
+{
+	//RTC user memory only, it survives deep sleep and resets but not a power cycle.
+
+	if(len>ESP1588_STATE_SIZE) return false;
+
+	ESP1588_RtcState state;
+	memset(&state,0,sizeof(state));
+	memcpy(state.data,buf,len);
+	state.len=len;
+	state.check=StateCheck(state);
+
+	return ESP.rtcUserMemoryWrite(ESP1588_RTC_USER_OFFSET,(uint32_t *) &state,sizeof(state));
+}
+
+bool ESP1588_LoadState(void * buf, size_t len, uint32_t & ulAge)
+{
+	ESP1588_RtcState state;
+
+	if(!ESP.rtcUserMemoryRead(ESP1588_RTC_USER_OFFSET,(uint32_t *) &state,sizeof(state))) return false;
+	if(state.check!=StateCheck(state) || state.len!=len) return false;
+
+	memcpy(buf,state.data,len);
+	ulAge=ESP1588_STATE_AGE_UNKNOWN;	//millis() starts over after deep sleep
+
+	return true;
+}
+
+#endif
+
+ESP1588_UDP::ESP1588_UDP()
+{
+}
+
+ESP1588_UDP::~ESP1588_UDP()
+{
+	Stop();
+}
+
+bool ESP1588_UDP::BeginMulticast(uint16_t port)
+{
+	Stop();
+
+	this->port=port;
+
+#if defined(ARDUINO_ARCH_ESP32)
+	ESP1588_UDP_Call c;
+	c.udp=this;
+	c.bResult=false;
+	tcpip_api_call(ESP1588_UDP_Call::Begin,&c.call);
+	return c.bResult;
+#else
+	return BeginInternal();
+#endif
+}
+
+void ESP1588_UDP::Stop()
+{
+	if(!pcb) return;
+
+#if defined(ARDUINO_ARCH_ESP32)
+	ESP1588_UDP_Call c;
+	c.udp=this;
+	tcpip_api_call(ESP1588_UDP_Call::Stop,&c.call);
+#else
+	StopInternal();
+#endif
+
+	ringHead=0;
+	ringTail=0;
+	bHoldingSlot=false;
+	rxLen=0;
+	rxPos=0;
+}
+
+bool ESP1588_UDP::Send(const void * buf, int len, bool bPeerDelay)
+{
+	if(!pcb) return false;
+
+#if defined(ARDUINO_ARCH_ESP32)
+	ESP1588_UDP_Call c;
+	c.udp=this;
+	c.buf=buf;
+	c.len=len;
+	c.bPeerDelay=bPeerDelay;
+	c.bResult=false;
+	tcpip_api_call(ESP1588_UDP_Call::Send,&c.call);
+	return c.bResult;
+#else
+	return SendInternal(buf,len,bPeerDelay);
+#endif
+}
+
+bool ESP1588_UDP::BeginInternal()
+{
+	pcb=udp_new();
+	if(!pcb) return false;
+
+	ip4_addr_t group;
+	ip4_addr_t groupPeerDelay;
+	IP4_ADDR(&group, 224, 0, 1, 129);
+	IP4_ADDR(&groupPeerDelay, 224, 0, 0, 107);
+
+	if(udp_bind(pcb, IP_ANY_TYPE, port)!=ERR_OK ||
+		igmp_joingroup(IP4_ADDR_ANY4, &group)!=ERR_OK ||
+		igmp_joingroup(IP4_ADDR_ANY4, &groupPeerDelay)!=ERR_OK)
+	{
+		udp_remove(pcb);
+		pcb=nullptr;
+		return false;
+	}
+
+	udp_recv(pcb, OnReceive, this);
+
+	return true;
+}
+
+void ESP1588_UDP::StopInternal()
+{
+	ip4_addr_t group;
+	ip4_addr_t groupPeerDelay;
+	IP4_ADDR(&group, 224, 0, 1, 129);
+	IP4_ADDR(&groupPeerDelay, 224, 0, 0, 107);
+
+	igmp_leavegroup(IP4_ADDR_ANY4, &group);
+	igmp_leavegroup(IP4_ADDR_ANY4, &groupPeerDelay);
+
+	udp_remove(pcb);
+	pcb=nullptr;
+}
+
+bool ESP1588_UDP::SendInternal(const void * buf, int len, bool bPeerDelay)
+{
+	struct pbuf * p=pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+	if(!p) return false;
+
+	memcpy(p->payload, buf, len);
+
+	ip_addr_t dst;
+	if(bPeerDelay)
+	{
+		IP_ADDR4(&dst, 224, 0, 0, 107);
+	}
+	else
+	{
+		IP_ADDR4(&dst, 224, 0, 1, 129);
+	}
+
+	err_t err=udp_sendto(pcb, p, &dst, port);
+
+	pbuf_free(p);
+
+	return err==ERR_OK;
+}
+
+void ESP1588_UDP::OnReceive(void * arg, struct udp_pcb * pcb, struct pbuf * p, const ip_addr_t * addr, u16_t port)
+{
+	//lwIP context. Timestamp first, then just copy into the ring and get out of the way.
+
+	uint16_t usMicros;
+	uint32_t ulNow=ESP1588_MillisMicros(usMicros);
+
+	ESP1588_UDP * self=(ESP1588_UDP *) arg;
+
+	uint8_t head=self->ringHead;
+	uint8_t next=(head+1) & (ESP1588_RX_RING_SLOTS-1);
+
+	if(next!=self->ringTail)	//if the ring is full, drop the newest. Loop() isn't keeping up anyway.
+	{
+		RX_SLOT & slot=self->ring[head];
+
+		slot.timestamp=ulNow;
+		slot.micros=usMicros;
+		slot.len=p->tot_len;
+		pbuf_copy_partial(p, slot.data, p->tot_len<sizeof(slot.data)?p->tot_len:sizeof(slot.data), 0);
+
+		__sync_synchronize();	//slot contents before the index
+
+		self->ringHead=next;
+
+#if defined(ESP1588_HAVE_TASK)
+		TaskHandle_t task=waitingTask;
+		if(task) xTaskNotifyGive(task);
+#endif
+	}
+
+	pbuf_free(p);
+}
+
+int ESP1588_UDP::ParsePacket()
+{
+	if(bHoldingSlot)	//done with the previous datagram, hand its slot back
+	{
+		ringTail=(ringTail+1) & (ESP1588_RX_RING_SLOTS-1);
+		bHoldingSlot=false;
+	}
+
+	rxLen=0;
+	rxPos=0;
+
+	if(ringTail==ringHead) return 0;
+
+	__sync_synchronize();	//index before the slot contents
+
+	RX_SLOT & slot=ring[ringTail];
+
+	bHoldingSlot=true;
+	rxTimestamp=slot.timestamp;
+	rxMicros=slot.micros;
+	rxLen=slot.len;
+
+	return rxLen;
+}
+
+#if defined(ESP1588_HAVE_TASK)
+void ESP1588_UDP::WaitAny(ESP1588_UDP & a, ESP1588_UDP & b, uint32_t ulTimeout)
+{
+	waitingTask=xTaskGetCurrentTaskHandle();
+
+	//anything beyond the slot we're holding? checked after registering, so a datagram arriving in between still wakes us up.
+
+	ESP1588_UDP * udp[2]={&a,&b};
+
+	bool bPending=false;
+	for(int i=0;i<2;i++)
+	{
+		uint8_t tail=udp[i]->bHoldingSlot?(udp[i]->ringTail+1) & (ESP1588_RX_RING_SLOTS-1):udp[i]->ringTail;
+		if(tail!=udp[i]->ringHead) bPending=true;
+	}
+
+	if(!bPending) ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(ulTimeout));
+
+	waitingTask=nullptr;
+}
+
+
+bool ESP1588_Task::Start(Function fn, void * arg, uint8_t priority, int8_t core)
+{
+	if(bRunning) return false;
+
+	this->fn=fn;
+	this->arg=arg;
+
+	bStop=false;
+	bRunning=true;
+
+	if(xTaskCreatePinnedToCore(Entry,"esp1588",4096,this,priority,&handle,core<0?tskNO_AFFINITY:core)!=pdPASS)
+	{
+		bRunning=false;
+		return false;
+	}
+
+	return true;
+}
+
+void ESP1588_Task::Stop()
+{
+	if(!bRunning) return;
+
+	bStop=true;
+
+	if(handle) xTaskNotifyGive(handle);	//in case it's sitting in WaitAny()
+
+	while(bRunning) delay(1);
+
+	handle=nullptr;
+}
+
+void ESP1588_Task::Entry(void * param)
+{
+	ESP1588_Task * self=(ESP1588_Task *) param;
+
+	self->fn(self->arg);
+
+	self->bRunning=false;
+
+	vTaskDelete(nullptr);
+}
+#endif
+
+int ESP1588_UDP::Read(void * buf, int len)
+{
+	if(!bHoldingSlot) return 0;
+
+	int avail=(rxLen<(int) sizeof(ring[0].data)?rxLen:(int) sizeof(ring[0].data))-rxPos;	//anything past the slot size was dropped
+
+	if(len>avail) len=avail;
+	if(len<=0) return 0;
+
+	memcpy(buf, ring[ringTail].data+rxPos, len);
+	rxPos+=len;
+
+	return len;
+}
+
+
+
+#if defined(ARDUINO_ARCH_ESP8266)
+
+bool ESP1588_OneShot::Begin(Function fn, void * arg)
+{
+	if(bBegun) return false;
+
+	this->fn=fn;
+	this->arg=arg;
+
+	os_timer_disarm(&timer);
+	os_timer_setfn(&timer,fn,arg);
+	bBegun=true;
+
+	return true;
+}
+
+void ESP1588_OneShot::End()
+{
+	if(!bBegun) return;
+
+	os_timer_disarm(&timer);
+	bBegun=false;
+}
+
+void ESP1588_OneShot::Arm(uint32_t ulMicros)
+{
+	if(ulMicros>ESP1588_ONESHOT_MAX_MICROS) ulMicros=ESP1588_ONESHOT_MAX_MICROS;
+
+	os_timer_disarm(&timer);
+	os_timer_arm(&timer,(ulMicros+999)/1000,false);		//whole milliseconds, rounded up so it's never early
+}
+
+void ESP1588_OneShot::Disarm()
+{
+	os_timer_disarm(&timer);
+}
+
+#else
+
+bool ESP1588_OneShot::Begin(Function fn, void * arg)
+{
+	if(handle) return false;
+
+	this->fn=fn;
+	this->arg=arg;
+
+	esp_timer_create_args_t args;
+	memset(&args,0,sizeof(args));
+	args.callback=fn;
+	args.arg=arg;
+	args.dispatch_method=ESP_TIMER_TASK;
+	args.name="esp1588";
+
+	return esp_timer_create(&args,&handle)==ESP_OK;
+}
+
+void ESP1588_OneShot::End()
+{
+	if(!handle) return;
+
+	esp_timer_stop(handle);
+	esp_timer_delete(handle);
+	handle=nullptr;
+}
+
+void ESP1588_OneShot::Arm(uint32_t ulMicros)
+{
+	if(ulMicros>ESP1588_ONESHOT_MAX_MICROS) ulMicros=ESP1588_ONESHOT_MAX_MICROS;
+
+	esp_timer_stop(handle);		//fails harmlessly if it wasn't running
+	esp_timer_start_once(handle,ulMicros);
+}
+
+void ESP1588_OneShot::Disarm()
+{
+	esp_timer_stop(handle);
+}
+
+#endif
+
+#endif
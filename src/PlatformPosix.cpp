@@ -0,0 +1,465 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Platform.h"
+
+#if defined(ESP1588_PLATFORM_POSIX)
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#if defined(__linux__)
+#include <netpacket/packet.h>
+#include <sys/timerfd.h>
+#endif
+
+static ESP1588_ClockSource clockSource=nullptr;
+
+void ESP1588_SetClockSource(ESP1588_ClockSource source)
+{
+	clockSource=source;
+}
+
+uint32_t ESP1588_Millis()
+{
+	if(clockSource) return clockSource();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (uint32_t) (((uint64_t) ts.tv_sec*1000) + (ts.tv_nsec/1000000));
+}
+
+uint64_t ESP1588_Micros64()
+{
+	if(clockSource) return (uint64_t) clockSource()*1000;	//whole milliseconds is all a simulated clock has
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return ((uint64_t) ts.tv_sec*1000000) + (ts.tv_nsec/1000);
+}
+
+uint32_t ESP1588_CycleCount()
+{
+	if(clockSource) return clockSource()*1000000;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (uint32_t) ((uint64_t) ts.tv_sec*1000000000+ts.tv_nsec);
+}
+
+
+void ESP1588_GetMacAddress(uint8_t mac[6])
+{
+	memset(mac,0,6);
+
+#if defined(__linux__)
+	struct ifaddrs * ifap;
+	if(getifaddrs(&ifap)!=0) return;
+
+	//first interface that is up, isn't loopback and has a hardware address
+
+	for(struct ifaddrs * ifa=ifap;ifa;ifa=ifa->ifa_next)
+	{
+		if(!ifa->ifa_addr || ifa->ifa_addr->sa_family!=AF_PACKET) continue;
+		if((ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP)) continue;
+
+		struct sockaddr_ll * ll=(struct sockaddr_ll *) ifa->ifa_addr;
+		if(ll->sll_halen!=6) continue;
+
+		memcpy(mac,ll->sll_addr,6);
+		break;
+	}
+
+	freeifaddrs(ifap);
+#endif
+}
+
+
+static const char * stateFile="esp1588.state";
+
+void ESP1588_SetStateFile(const char * path)
+{
+	stateFile=path;
+}
+
+struct ESP1588_StateHeader
+{
+	uint64_t ulSaved;		//CLOCK_REALTIME milliseconds, which unlike ours keeps going across a reboot
+	uint32_t len;
+};
+
+static uint64_t WallMillis()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+
+	return ((uint64_t) ts.tv_sec*1000) + (ts.tv_nsec/1000000);
+}
+
+bool ESP1588_SaveState(const void * buf, size_t len, bool bDurable)
+{
+	//write a new file and rename it over the old one, so a crash halfway through leaves the previous state intact.
+
+	char tmp[512];
+	snprintf(tmp,sizeof(tmp),"%s.tmp",stateFile);
+
+	FILE * f=fopen(tmp,"wb");
+	if(!f) return false;
+
+	ESP1588_StateHeader header;
+	header.ulSaved=WallMillis();
+	header.len=(uint32_t) len;
+
+	bool bOk=fwrite(&header,sizeof(header),1,f)==1 && fwrite(buf,len,1,f)==1;
+	bOk=fclose(f)==0 && bOk;
+
+	return bOk && rename(tmp,stateFile)==0;
+}
+
+bool ESP1588_LoadState(void * buf, size_t len, uint32_t & ulAge)
+{
+	FILE * f=fopen(stateFile,"rb");
+	if(!f) return false;
+
+	ESP1588_StateHeader header;
+
+	bool bOk=fread(&header,sizeof(header),1,f)==1 && header.len==len && fread(buf,len,1,f)==1;
+	fclose(f);
+
+	if(!bOk) return false;
+
+	uint64_t ulNow=WallMillis();
+
+	ulAge=ESP1588_STATE_AGE_UNKNOWN;
+	if(!clockSource && ulNow>=header.ulSaved && ulNow-header.ulSaved<ESP1588_STATE_AGE_UNKNOWN) ulAge=(uint32_t) (ulNow-header.ulSaved);
+
+	return true;
+}
+
+
+ESP1588_UDP::ESP1588_UDP()
+{
+}
+
+ESP1588_UDP::~ESP1588_UDP()
+{
+	Stop();
+}
+
+bool ESP1588_UDP::BeginMulticast(uint16_t port)
+{
+	Stop();
+
+	fd=socket(AF_INET,SOCK_DGRAM,0);
+	if(fd<0) return false;
+
+	this->port=port;
+
+	int one=1;
+	setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+#ifdef SO_TIMESTAMPNS
+	setsockopt(fd,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one));	//have the kernel timestamp arrival for us
+#endif
+#ifdef SO_REUSEPORT
+	setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one));	//let ptp4l or a second client share the ports
+#endif
+
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_ANY);
+	addr.sin_port=htons(port);
+
+	struct ip_mreq mreq;
+	memset(&mreq,0,sizeof(mreq));
+	mreq.imr_multiaddr.s_addr=inet_addr("224.0.1.129");
+	mreq.imr_interface.s_addr=htonl(INADDR_ANY);
+
+	struct ip_mreq mreqPeer=mreq;
+	mreqPeer.imr_multiaddr.s_addr=inet_addr("224.0.0.107");
+
+	if(bind(fd,(struct sockaddr *) &addr,sizeof(addr))<0 ||
+		setsockopt(fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,sizeof(mreq))<0 ||
+		setsockopt(fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreqPeer,sizeof(mreqPeer))<0 ||
+		fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0) | O_NONBLOCK)<0)
+	{
+		Stop();
+		return false;
+	}
+
+	return true;
+}
+
+void ESP1588_UDP::Stop()
+{
+	if(fd>=0)
+	{
+		close(fd);
+		fd=-1;
+	}
+}
+
+int ESP1588_UDP::ParsePacket()
+{
+	rxLen=0;
+	rxPos=0;
+
+	if(fd<0) return 0;
+
+	struct iovec iov;
+	iov.iov_base=rxBuffer;
+	iov.iov_len=sizeof(rxBuffer);
+
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control.buf;
+	msg.msg_controllen=sizeof(control.buf);
+
+	ssize_t len=recvmsg(fd,&msg,0);
+
+	if(len<=0) return 0;
+
+	rxLen=(int) len;
+	rxTimestamp=ESP1588_MillisMicros(rxMicros);
+
+#ifdef SO_TIMESTAMPNS
+	if(!clockSource)	//a simulated clock has nothing to do with the kernel's
+	{
+		for(struct cmsghdr * cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+		{
+			if(cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_TIMESTAMPNS)
+			{
+				//the kernel timestamp is CLOCK_REALTIME, our clock is CLOCK_MONOTONIC. translate by how long ago it was.
+
+				struct timespec ts;
+				struct timespec now;
+				memcpy(&ts,CMSG_DATA(cmsg),sizeof(ts));
+				clock_gettime(CLOCK_REALTIME,&now);
+
+				int64_t age=((int64_t) (now.tv_sec-ts.tv_sec)*1000000000LL + (now.tv_nsec-ts.tv_nsec))/1000;	//microseconds
+
+				if(age>0)
+				{
+					rxTimestamp-=(uint32_t) (age/1000);
+					age%=1000;
+
+					if(age>rxMicros)
+					{
+						rxTimestamp--;
+						rxMicros+=1000;
+					}
+					rxMicros-=(uint16_t) age;
+				}
+			}
+		}
+	}
+#endif
+
+	return rxLen;
+}
+
+int ESP1588_UDP::Read(void * buf, int len)
+{
+	if(len>rxLen-rxPos) len=rxLen-rxPos;
+
+	memcpy(buf,rxBuffer+rxPos,len);
+	rxPos+=len;
+
+	return len;
+}
+
+bool ESP1588_UDP::Send(const void * buf, int len, bool bPeerDelay)
+{
+	if(fd<0) return false;
+
+	struct sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=inet_addr(bPeerDelay?"224.0.0.107":"224.0.1.129");
+	addr.sin_port=htons(port);
+
+	return sendto(fd,buf,len,0,(struct sockaddr *) &addr,sizeof(addr))==len;
+}
+
+void ESP1588_UDP::WaitAny(ESP1588_UDP & a, ESP1588_UDP & b, uint32_t ulTimeout)
+{
+	struct pollfd pfd[2];
+	pfd[0].fd=a.fd;
+	pfd[0].events=POLLIN;
+	pfd[1].fd=b.fd;
+	pfd[1].events=POLLIN;
+
+	poll(pfd,2,(int) ulTimeout);	//negative fds are ignored, so a stopped port just means waiting for the other one
+}
+
+
+bool ESP1588_Task::Start(Function fn, void * arg, uint8_t priority, int8_t core)
+{
+	if(bRunning) return false;
+
+	this->fn=fn;
+	this->arg=arg;
+
+	bStop=false;
+	bRunning=true;
+
+	thread=std::thread(Entry,this);
+
+	return true;
+}
+
+void ESP1588_Task::Stop()
+{
+	if(!thread.joinable()) return;
+
+	bStop=true;
+	thread.join();
+}
+
+void ESP1588_Task::Entry(void * param)
+{
+	ESP1588_Task * self=(ESP1588_Task *) param;
+
+	self->fn(self->arg);
+
+	self->bRunning=false;
+}
+
+
+
+bool ESP1588_OneShot::Begin(Function fn, void * arg)
+{
+	if(thread.joinable()) return false;
+
+	this->fn=fn;
+	this->arg=arg;
+
+#if defined(__linux__)
+	fd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC | TFD_NONBLOCK);
+	if(fd<0) return false;
+#endif
+
+	ulDeadline=0;
+	bStop=false;
+	thread=std::thread(Entry,this);
+
+	return true;
+}
+
+void ESP1588_OneShot::End()
+{
+	if(!thread.joinable()) return;
+
+	bStop=true;
+	thread.join();
+
+	if(fd>=0) close(fd);
+	fd=-1;
+}
+
+#if !defined(__linux__)
+static uint64_t MonotonicMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+#endif
+
+void ESP1588_OneShot::Arm(uint32_t ulMicros)
+{
+	if(ulMicros>ESP1588_ONESHOT_MAX_MICROS) ulMicros=ESP1588_ONESHOT_MAX_MICROS;
+
+#if defined(__linux__)
+	struct itimerspec its;
+	memset(&its,0,sizeof(its));
+	its.it_value.tv_sec=ulMicros/1000000;
+	its.it_value.tv_nsec=(ulMicros%1000000)*1000+1;		//zero would disarm it
+
+	timerfd_settime(fd,0,&its,nullptr);
+#else
+	ulDeadline=MonotonicMicros()+ulMicros;
+#endif
+}
+
+void ESP1588_OneShot::Disarm()
+{
+#if defined(__linux__)
+	struct itimerspec its;
+	memset(&its,0,sizeof(its));
+
+	timerfd_settime(fd,0,&its,nullptr);
+#else
+	ulDeadline=0;
+#endif
+}
+
+void ESP1588_OneShot::Entry(ESP1588_OneShot * self)
+{
+	//wakes up now and then to check for End() regardless
+
+	while(!self->bStop)
+	{
+#if defined(__linux__)
+		struct pollfd pfd;
+		pfd.fd=self->fd;
+		pfd.events=POLLIN;
+
+		uint64_t expirations;
+		if(poll(&pfd,1,100)>0 && read(self->fd,&expirations,sizeof(expirations))==sizeof(expirations))
+		{
+			self->fn(self->arg);
+		}
+#else
+		uint64_t ulDeadline=self->ulDeadline;
+		uint64_t ulNow=MonotonicMicros();
+
+		if(ulDeadline && ulNow>=ulDeadline)
+		{
+			self->ulDeadline=0;
+			self->fn(self->arg);
+			continue;
+		}
+
+		uint64_t ulWait=ulDeadline?(ulDeadline-ulNow+999)/1000:100;
+		poll(nullptr,0,ulWait<100?(int) ulWait:100);
+#endif
+	}
+}
+
+#endif
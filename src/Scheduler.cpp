@@ -0,0 +1,365 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ESP1588.h"
+
+#define SCHEDULER_REALIGN	1000	//ms. a clock step bigger than this moves the periodic events to their next period
+
+ESP1588_Scheduler::ESP1588_Scheduler(ESP1588 & ptp) : ptp(ptp)
+{
+	for(int i=0;i<ESP1588_SCHEDULER_EVENTS;i++)
+	{
+		events[i].heapPos=-1;
+	}
+}
+
+ESP1588_Scheduler::~ESP1588_Scheduler()
+{
+	End();
+}
+
+bool ESP1588_Scheduler::Begin()
+{
+	if(bRunning || !timer.Begin(OnTimer,this)) return false;
+
+	bRunning=true;
+	ulLastNow=0;
+
+	ptp.scheduler=this;
+	Retime();
+
+	return true;
+}
+
+void ESP1588_Scheduler::End()
+{
+	if(!bRunning) return;
+
+	ptp.scheduler=nullptr;
+	bRunning=false;
+	timer.End();
+
+	lock.Enter();
+	for(uint16_t i=0;i<usCount;i++)
+	{
+		events[heap[i]].heapPos=-1;
+	}
+	usCount=0;
+	lock.Leave();
+}
+
+uint64_t ESP1588_Scheduler::Now(ESP1588_ClockSnapshot & snap, uint32_t & ulLocal)
+{
+	ptp.GetClockSnapshot(snap);
+	ulLocal=ESP1588_Millis();
+
+	return snap.Millis(ulLocal)+snap.ulOffset64;
+}
+
+uint64_t ESP1588_Scheduler::Align(uint64_t ulFrom, uint32_t ulPeriod, uint32_t ulPhase)
+{
+	//the first ulFrom or later that's at ulPhase
+
+	uint32_t r=(uint32_t) ((ulFrom+ulPeriod-ulPhase)%ulPeriod);
+
+	return ulFrom+(r?ulPeriod-r:0);
+}
+
+ESP1588_EventId ESP1588_Scheduler::At(uint64_t ulEpochMillis, ESP1588_EventFunction fn, void * ctx)
+{
+	return Add(ulEpochMillis,0,0,fn,ctx);
+}
+
+ESP1588_EventId ESP1588_Scheduler::After(uint32_t ms, ESP1588_EventFunction fn, void * ctx)
+{
+	ESP1588_ClockSnapshot snap;
+	uint32_t ulLocal;
+
+	return Add(Now(snap,ulLocal)+ms,0,0,fn,ctx);
+}
+
+ESP1588_EventId ESP1588_Scheduler::Every(uint32_t period, uint32_t phase, ESP1588_EventFunction fn, void * ctx)
+{
+	if(!period) return ESP1588_EVENT_NONE;
+
+	phase%=period;
+
+	ESP1588_ClockSnapshot snap;
+	uint32_t ulLocal;
+
+	return Add(Align(Now(snap,ulLocal),period,phase),period,phase,fn,ctx);
+}
+
+ESP1588_EventId ESP1588_Scheduler::Add(uint64_t ulDue, uint32_t ulPeriod, uint32_t ulPhase, ESP1588_EventFunction fn, void * ctx)
+{
+	if(!fn) return ESP1588_EVENT_NONE;
+
+	lock.Enter();
+
+	uint16_t idx=0;
+	while(idx<ESP1588_SCHEDULER_EVENTS && events[idx].heapPos>=0) idx++;
+
+	if(idx==ESP1588_SCHEDULER_EVENTS)
+	{
+		lock.Leave();
+		return ESP1588_EVENT_NONE;
+	}
+
+	if(++usGeneration==0) usGeneration=1;
+
+	EVENT & e=events[idx];
+	e.ulDue=ulDue;
+	e.ulPeriod=ulPeriod;
+	e.ulPhase=ulPhase;
+	e.fn=fn;
+	e.ctx=ctx;
+	e.usGeneration=usGeneration;
+
+	Place(usCount,idx);
+	usCount++;
+	SiftUp(e.heapPos);
+
+	bool bEarliest=heap[0]==idx;
+
+	lock.Leave();
+
+	//the new earliest? then the timer needs to know. (from a callback it'll be armed on the way out anyway)
+
+	if(bEarliest) Arm();
+
+	return ((uint32_t) e.usGeneration<<16) | idx;
+}
+
+bool ESP1588_Scheduler::Cancel(ESP1588_EventId id)
+{
+	uint16_t idx=id & 0xFFFF;
+	if(idx>=ESP1588_SCHEDULER_EVENTS) return false;
+
+	lock.Enter();
+
+	bool bPending=events[idx].heapPos>=0 && events[idx].usGeneration==(id>>16);
+	if(bPending) Remove(events[idx].heapPos);		//if it was the earliest, the timer just finds nothing to do
+
+	lock.Leave();
+
+	return bPending;
+}
+
+void ESP1588_Scheduler::Retime()
+{
+	if(!bRunning) return;
+
+	ESP1588_ClockSnapshot snap;
+	uint32_t ulLocal;
+	uint64_t ulNow=Now(snap,ulLocal);
+
+	lock.Enter();
+
+	//the servo nudges the clock by a millisecond or so all the time, which the one-shot events and the periodic ones alike
+	//take in their stride as they're on the PTP timescale. a step (lock, a new master) leaves the periodic ones a long way
+	//from their next period, or already past it.
+
+	int64_t step=(int64_t) (ulNow-ulLastNow)-(int32_t) (ulLocal-ulLastLocal);
+
+	if(ulLastNow && (step>SCHEDULER_REALIGN || step<-SCHEDULER_REALIGN))
+	{
+		for(uint16_t i=0;i<usCount;i++)
+		{
+			EVENT & e=events[heap[i]];
+			if(e.ulPeriod) e.ulDue=Align(ulNow,e.ulPeriod,e.ulPhase);
+		}
+
+		for(int i=usCount/2-1;i>=0;i--)
+		{
+			SiftDown(i);
+		}
+	}
+
+	ulLastNow=ulNow;
+	ulLastLocal=ulLocal;
+
+	lock.Leave();
+
+	Arm();
+}
+
+void ESP1588_Scheduler::Arm()
+{
+	//the delay is worked out under the lock, the timer is armed outside it: esp_timer takes a lock of its own, and mustn't be
+	//called from inside our spinlock. if another context worked one out meanwhile, it may have armed before we did and
+	//been overwritten with our older idea, so go around again.
+
+	while(true)
+	{
+		ESP1588_ClockSnapshot snap;
+		uint32_t ulLocal;
+		uint64_t ulNow=Now(snap,ulLocal);
+
+		lock.Enter();
+
+		if(!bRunning)
+		{
+			lock.Leave();
+			return;
+		}
+
+		uint32_t seq=++ulArmSeq;
+		bool bArm=usCount!=0;
+		uint32_t ulMicros=bArm?Delay(ulNow,snap):0;
+
+		lock.Leave();
+
+		if(bArm) timer.Arm(ulMicros);
+		else timer.Disarm();
+
+		if(ulArmSeq==seq) return;
+	}
+}
+
+uint32_t ESP1588_Scheduler::Delay(uint64_t ulNow, const ESP1588_ClockSnapshot & snap)
+{
+	//microseconds of local time until the earliest event
+
+	uint64_t ulDue=events[heap[0]].ulDue;
+
+	int64_t delta=ulDue>ulNow?ulDue-ulNow:0;
+	if(delta>ESP1588_ONESHOT_MAX_MICROS/1000) delta=ESP1588_ONESHOT_MAX_MICROS/1000;
+
+	//that much PTP time is a little less or more local time, as our timeline runs at (1 + lRateQ32/2^32) times the local clock
+
+	delta-=(delta*snap.lRateQ32)>>32;
+
+	return (uint32_t) delta*1000;
+}
+
+void ESP1588_Scheduler::OnTimer(void * arg)
+{
+	((ESP1588_Scheduler *) arg)->Dispatch();
+}
+
+void ESP1588_Scheduler::Dispatch()
+{
+	//everything that's due, one at a time so the callbacks run without the lock. then the timer for what's left
+
+	while(true)
+	{
+		ESP1588_ClockSnapshot snap;
+		uint32_t ulLocal;
+		uint64_t ulNow=Now(snap,ulLocal);
+
+		lock.Enter();
+
+		if(!bRunning || !usCount || events[heap[0]].ulDue>ulNow)
+		{
+			lock.Leave();
+			Arm();
+			return;
+		}
+
+		EVENT & e=events[heap[0]];
+
+		uint64_t ulDue=e.ulDue;
+		ESP1588_EventFunction fn=e.fn;
+		void * ctx=e.ctx;
+
+		if(e.ulPeriod)
+		{
+			//fell behind? skip what was missed, a period at a time: no 64-bit division here, on ESP8266 that's a slow libgcc
+			//routine, once per cue. only a clock step leaves it further behind than SCHEDULER_REALIGN,
+			//and then Retime() is about to put it on its next period anyway.
+
+			e.ulDue+=e.ulPeriod;
+
+			if(ulNow-e.ulDue<SCHEDULER_REALIGN)
+			{
+				while(e.ulDue<=ulNow) e.ulDue+=e.ulPeriod;
+			}
+			else if(e.ulDue<=ulNow)
+			{
+				e.ulDue=ulNow+e.ulPeriod;
+			}
+			SiftDown(0);
+		}
+		else
+		{
+			Remove(0);
+		}
+
+		ulFired++;
+
+		lock.Leave();
+
+		fn(ctx,ulDue);
+	}
+}
+
+void ESP1588_Scheduler::Place(uint16_t pos, uint16_t idx)
+{
+	heap[pos]=idx;
+	events[idx].heapPos=pos;
+}
+
+void ESP1588_Scheduler::SiftUp(uint16_t pos)
+{
+	uint16_t idx=heap[pos];
+
+	while(pos>0)
+	{
+		uint16_t parent=(pos-1)/2;
+		if(events[heap[parent]].ulDue<=events[idx].ulDue) break;
+
+		Place(pos,heap[parent]);
+		pos=parent;
+	}
+
+	Place(pos,idx);
+}
+
+void ESP1588_Scheduler::SiftDown(uint16_t pos)
+{
+	uint16_t idx=heap[pos];
+
+	while(true)
+	{
+		uint16_t child=2*pos+1;
+		if(child>=usCount) break;
+
+		if(child+1<usCount && events[heap[child+1]].ulDue<events[heap[child]].ulDue) child++;
+		if(events[heap[child]].ulDue>=events[idx].ulDue) break;
+
+		Place(pos,heap[child]);
+		pos=child;
+	}
+
+	Place(pos,idx);
+}
+
+void ESP1588_Scheduler::Remove(uint16_t pos)
+{
+	events[heap[pos]].heapPos=-1;
+	usCount--;
+
+	if(pos==usCount) return;
+
+	uint16_t moved=heap[usCount];
+	Place(pos,moved);
+	SiftDown(pos);
+	SiftUp(events[moved].heapPos);
+}
@@ -0,0 +1,117 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "Platform.h"
+#include "SyncMgr.h"
+
+class ESP1588;
+
+//Callbacks at given PTP times, without polling: "at T" or "every P ms at phase F" of the PTP timescale (the one
+//GetEpochMillis64() runs on). Pending events are kept in a min-heap, and a single one-shot timer (ESP1588_OneShot) is armed
+//for the earliest. Whenever the servo adjusts the clock the timer is armed again, so an event fires when PTP time gets
+//there rather than when the local clock thought it would. Nothing runs in between events.
+//
+//Callbacks run in the timer's context: the esp_timer task on ESP32, an os_timer between loop() passes on ESP8266, a thread of
+//the scheduler's own on the host. Keep them quick. They may schedule and cancel events themselves.
+//
+//On ESP8266 this leaves timer1 to analogWrite(), tone(), Servo and timer interrupt libraries, which all want it to themselves.
+//The price is millisecond resolution, and a loop() that blocks holds cues up: keep it returning, or call delay() or yield().
+//
+//Until we're locked PTP time is local time, and when we lock it jumps: one-shot events stay put on the PTP timescale
+//(and fire right away if it jumped past them), periodic ones move to the next period at their phase.
+
+#ifndef ESP1588_SCHEDULER_EVENTS
+#define ESP1588_SCHEDULER_EVENTS	64		//pending at once, at most
+#endif
+
+typedef void (*ESP1588_EventFunction)(void * ctx, uint64_t ulDue);	//ulDue is the PTP time it was for
+
+typedef uint32_t ESP1588_EventId;
+
+#define ESP1588_EVENT_NONE		0
+
+class ESP1588_Scheduler
+{
+public:
+	ESP1588_Scheduler(ESP1588 & ptp);
+	virtual ~ESP1588_Scheduler();
+
+	bool Begin();		//takes the one-shot timer
+	void End();			//gives it back, and drops everything pending
+
+	ESP1588_EventId At(uint64_t ulEpochMillis, ESP1588_EventFunction fn, void * ctx=nullptr);		//once
+	ESP1588_EventId After(uint32_t ms, ESP1588_EventFunction fn, void * ctx=nullptr);				//once, ms from now
+	ESP1588_EventId Every(uint32_t period, uint32_t phase, ESP1588_EventFunction fn, void * ctx=nullptr);	//when PTP time % period == phase
+
+	bool Cancel(ESP1588_EventId id);	//false if it's not pending (any more)
+
+	uint16_t GetPending() { return usCount; }
+	uint32_t GetFired() { return ulFired; }
+
+private:
+	friend class ESP1588;
+
+	void Retime();		//the clock has been adjusted
+
+	struct EVENT
+	{
+		uint64_t ulDue;
+		uint32_t ulPeriod;		//0 for once
+		uint32_t ulPhase;
+		ESP1588_EventFunction fn;
+		void * ctx;
+		uint16_t usGeneration;	//of the id, so a stale id can't cancel whatever has the slot now
+		int16_t heapPos;		//-1 if the slot is free
+	};
+
+	ESP1588 & ptp;
+
+	ESP1588_Lock lock;
+	ESP1588_OneShot timer;
+	bool bRunning=false;
+
+	EVENT events[ESP1588_SCHEDULER_EVENTS];
+	uint16_t heap[ESP1588_SCHEDULER_EVENTS];	//indices into events, earliest first
+	volatile uint16_t usCount=0;
+	uint16_t usGeneration=0;
+
+	volatile uint32_t ulFired=0;
+
+	uint64_t ulLastNow=0;			//what Retime() saw last, to tell a step from the clock moving on
+	uint32_t ulLastLocal=0;
+
+	uint64_t Now(ESP1588_ClockSnapshot & snap, uint32_t & ulLocal);
+	ESP1588_EventId Add(uint64_t ulDue, uint32_t ulPeriod, uint32_t ulPhase, ESP1588_EventFunction fn, void * ctx);
+	static uint64_t Align(uint64_t ulFrom, uint32_t ulPeriod, uint32_t ulPhase);
+
+	void Arm();
+	uint32_t Delay(uint64_t ulNow, const ESP1588_ClockSnapshot & snap);
+	volatile uint32_t ulArmSeq=0;		//delays worked out, see Arm()
+	void Dispatch();
+	static void OnTimer(void * arg);
+
+	void Place(uint16_t pos, uint16_t idx);
+	void SiftUp(uint16_t pos);
+	void SiftDown(uint16_t pos);
+	void Remove(uint16_t pos);
+
+};
@@ -7,60 +7,133 @@
 
 #include "SmoothTimeLoop.h"
 
-#define abs(a) ((a)<0?-(a):(a))
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
 
+#define HALF_MS			(1LL<<31)	//32.32
+#define CATCHUP_SHIFT	4			//closes 1/16 of the difference per ms, which also smooths out esp1588_millis' whole milliseconds
 
-int32_t IRAM_ATTR WrapAround(int32_t input, int32_t wrap)
+SmoothTimeLoop::SmoothTimeLoop(int cycle_millis, int max_percent_adjustment)
 {
+	if(cycle_millis<1) cycle_millis=1;
+	if(max_percent_adjustment<0) max_percent_adjustment=0;
+	if(max_percent_adjustment>99) max_percent_adjustment=99;	//so it never runs backwards
 
-	if(input>=wrap)
-	{
-		input=-(wrap<<1)+input;	//two's complement wrap
-	}
-	else if(input<-wrap)
-	{
-		input+=(wrap<<1);	//two's complement wrap
-
-	}
+	this->cycle_millis=cycle_millis;
+	max_rate=(((int64_t) 1<<32)*max_percent_adjustment)/100;
 
-	return input;
+	num_cycles=0;
+	AddCycle(cycle_millis);
 
+	initialized=false;
+	last_system_millis=0;
+	last_esp1588_millis=0;
+	target_millis=0;
 }
 
-SmoothTimeLoop::SmoothTimeLoop(int cycle_millis, int max_percent_adjustment)
+int SmoothTimeLoop::AddCycle(uint32_t cycle_millis)
 {
-	this->cycle_millis=cycle_millis;
-	this->max_percent_adjustment=max_percent_adjustment;
+	if(num_cycles>=1+SMOOTHTIMELOOP_CYCLES || cycle_millis<1) return -1;
 
-	offset_millis=0;
-}
+	CYCLE & c=cycles[num_cycles];
+	c.length=(uint64_t) cycle_millis<<32;
+	c.reciprocal=cycle_millis>1?(uint32_t) ((1ULL<<32)/cycle_millis):0xFFFFFFFF;
+	c.phase=num_cycles?cycles[0].phase%c.length:0;		//in step with the loop from here on
 
+	return num_cycles++;
+}
 
-uint32_t IRAM_ATTR SmoothTimeLoop::GetCycleMillis(uint32_t esp1588_millis, uint32_t system_millis)
+void SmoothTimeLoop::Reset(uint32_t esp1588_millis)
 {
-	int32_t millis_since_last=system_millis-last_system_millis;
-	
-	uint32_t s=(system_millis+offset_millis) % cycle_millis;
-	uint32_t t=esp1588_millis % cycle_millis;
+	//straight to where PTP time is, the middle of the millisecond as that's all we know
 
-	int32_t diff=WrapAround(t-s,(cycle_millis>>1));
+	target_millis=esp1588_millis%cycle_millis;
 
-	if(abs(diff)>1)
+	for(int i=0;i<num_cycles;i++)
 	{
-		int needed_correction=diff;
+		CYCLE & c=cycles[i];
+		c.phase=((uint64_t) (esp1588_millis%(uint32_t) (c.length>>32))<<32)+HALF_MS;
+	}
+}
 
-		int max_corr=(millis_since_last * max_percent_adjustment)/100;
+void IRAM_ATTR SmoothTimeLoop::Advance(CYCLE & c, uint64_t delta)
+{
+	c.phase+=delta;
 
-		if(needed_correction>max_corr) needed_correction=max_corr;
-		else if(needed_correction<-max_corr) needed_correction=-max_corr;
-	
-		offset_millis += needed_correction;
-		int bp=1;
+	if(c.phase>=c.length)
+	{
+		c.phase-=c.length;
+		if(c.phase>=c.length) c.phase%=c.length;	//only after not being called for more than a cycle
+	}
+}
 
+void IRAM_ATTR SmoothTimeLoop::Update(uint32_t esp1588_millis, uint32_t system_millis)
+{
+	if(!initialized)
+	{
+		initialized=true;
+		last_system_millis=system_millis;
+		last_esp1588_millis=esp1588_millis;
+		Reset(esp1588_millis);
+		return;
 	}
 
+	uint32_t dt=system_millis-last_system_millis;
 	last_system_millis=system_millis;
 
-	return s;
+	//where PTP time is in the cycle, kept up without a modulo unless it jumped (lock) or went backwards (ditto, or wrapped)
+
+	if(esp1588_millis>=last_esp1588_millis)
+	{
+		target_millis+=esp1588_millis-last_esp1588_millis;
+
+		if(target_millis>=(uint32_t) cycle_millis)
+		{
+			target_millis-=cycle_millis;
+			if(target_millis>=(uint32_t) cycle_millis) target_millis=esp1588_millis%cycle_millis;
+		}
+	}
+	else
+	{
+		target_millis=esp1588_millis%cycle_millis;
+	}
+
+	last_esp1588_millis=esp1588_millis;
+
+	if(dt>0x10000) dt=0x10000;
+
+	//how far off we'd be after moving on by dt, the short way round the cycle
+
+	CYCLE & loop=cycles[0];
+	int64_t length=(int64_t) loop.length;
+
+	int64_t diff=(((int64_t) target_millis<<32)+HALF_MS)-(int64_t) loop.phase-((int64_t) dt<<32);
+
+	if(diff>=length || diff<-length) diff%=length;		//only after not being called for more than a cycle
+
+	if(diff>=(length>>1)) diff-=length;
+	else if(diff<-(length>>1)) diff+=length;
+
+	//make up some of it, no faster than max_rate
+
+	int64_t correction=dt>=(1<<CATCHUP_SHIFT)?diff:(diff>>CATCHUP_SHIFT)*(int32_t) dt;
+	int64_t max_corr=max_rate*(int32_t) dt;
+
+	if(correction>max_corr) correction=max_corr;
+	else if(correction<-max_corr) correction=-max_corr;
+
+	uint64_t delta=((uint64_t) dt<<32)+correction;
+
+	for(int i=0;i<num_cycles;i++)
+	{
+		Advance(cycles[i],delta);
+	}
 }
 
+uint32_t IRAM_ATTR SmoothTimeLoop::GetCycleMillis(uint32_t esp1588_millis, uint32_t system_millis)
+{
+	Update(esp1588_millis,system_millis);
+
+	return GetMillis();
+}
@@ -8,29 +8,69 @@
 #ifndef LIBRARIES_ESP1588_SMOOTHTIMELOOP_H_
 #define LIBRARIES_ESP1588_SMOOTHTIMELOOP_H_
 
-#ifdef _WIN32
-#include <stdint.h>
-#else
+#if defined(ARDUINO)
 #include <Arduino.h>
+#else
+#include <stdint.h>
 #endif
 
+#ifndef SMOOTHTIMELOOP_CYCLES
+#define SMOOTHTIMELOOP_CYCLES	4	//cycles one loop can serve on top of its own, see AddCycle()
+#endif
+
+/*
+ * A time loop that follows PTP time without ever jumping: it runs off system millis, and speeds up or slows down by
+ * at most max_percent_adjustment to catch up with esp1588_millis, modulo the cycle, so it never has more than half
+ * a cycle to make up.
+ *
+ * The phase is kept in 32.32 fixed point and corrected by fractions of a millisecond as it goes, so it steps by whole
+ * milliseconds however often it's called. A call is a few adds and multiplies, no division, fine for an ISR.
+ */
+
 class SmoothTimeLoop
 {
 public:
 	SmoothTimeLoop(int cycle_millis, int max_percent_adjustment);
 
+	//Update() and GetMillis() in one: where we are in the cycle, 0 to cycle_millis-1
 	uint32_t GetCycleMillis(uint32_t esp1588_millis, uint32_t system_millis);
 
+	//Or call Update() once per tick and read as many cycles as you like afterwards, all off the same timeline.
+	//Cycles that divide the loop cycle (beats in a bar, frames in a beat) stay in step with each other and with other units.
+	//Update() and the getters aren't safe against each other, call them from the same context.
+	void Update(uint32_t esp1588_millis, uint32_t system_millis);
+
+	int AddCycle(uint32_t cycle_millis);		//returns its index for the getters, -1 if there's no room. cycle 0 is the loop itself
+
+	uint32_t GetMillis(int cycle=0) { return (uint32_t) (cycles[cycle].phase>>32); }	//ms into the cycle
+	uint64_t GetPhaseQ32(int cycle=0) { return cycles[cycle].phase; }				//the same, 32.32 fixed point
+	uint16_t GetPhase16(int cycle=0)												//how far into the cycle, of 65536
+	{
+		return (uint16_t) (((cycles[cycle].phase>>16)*cycles[cycle].reciprocal)>>32);
+	}
+
 private:
 
+	struct CYCLE
+	{
+		uint64_t length;		//32.32
+		uint64_t phase;			//32.32, 0 to length
+		uint32_t reciprocal;	//2^32/cycle millis, for GetPhase16() without a division
+	};
+
+	CYCLE cycles[1+SMOOTHTIMELOOP_CYCLES];
+	int num_cycles;
+
 	int cycle_millis;
-	int max_percent_adjustment;
+	int64_t max_rate;				//largest correction per ms, 32.32
 
+	bool initialized;
 	uint32_t last_system_millis;
+	uint32_t last_esp1588_millis;
+	uint32_t target_millis;			//esp1588_millis modulo the cycle
 
-	int offset_millis;
-
+	void Reset(uint32_t esp1588_millis);
+	void Advance(CYCLE & c, uint64_t delta);
 };
 
 #endif /* LIBRARIES_ESP1588_SMOOTHTIMELOOP_H_ */
-
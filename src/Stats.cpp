@@ -0,0 +1,104 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Stats.h"
+
+static uint32_t isqrt(uint64_t v)
+{
+	uint64_t r=0;
+	uint64_t bit=1ULL<<62;
+
+	while(bit>v) bit>>=2;
+
+	while(bit)
+	{
+		if(v>=r+bit)
+		{
+			v-=r+bit;
+			r=(r>>1)+bit;
+		}
+		else
+		{
+			r>>=1;
+		}
+		bit>>=2;
+	}
+	return (uint32_t) r;
+}
+
+static int16_t RoundMillis(int32_t micros)
+{
+	return (int16_t) (micros<0?(micros-500)/1000:(micros+500)/1000);
+}
+
+ESP1588_OffsetWindow::ESP1588_OffsetWindow()
+{
+	Reset();
+}
+
+void ESP1588_OffsetWindow::Reset()
+{
+	count=0;
+	sum=0;
+	sumSquares=0;
+	memset(&result,0,sizeof(result));
+}
+
+void ESP1588_OffsetWindow::Insert(int32_t diff)
+{
+	if(count==0xFFFF) return;
+
+	if(!count || diff<lo) lo=diff;
+	if(!count || diff>hi) hi=diff;
+
+	count++;
+	sum+=diff;
+	sumSquares+=(uint64_t) ((int64_t) diff*diff);
+}
+
+void ESP1588_OffsetWindow::Complete()
+{
+	result.samples=count;
+
+	if(count)
+	{
+		result.min=RoundMillis(lo);
+		result.max=RoundMillis(hi);
+
+		int64_t mean=sum/count;
+		result.meanUs=(int32_t) mean;
+
+		//the mean of the squares less the square of the mean is the variance, in us^2. truncating both leaves it
+		//a fraction of a us^2 short at most.
+
+		result.stddevUs=isqrt(sumSquares/count-(uint64_t) (mean*mean));
+	}
+	else
+	{
+		result.min=0;
+		result.max=0;
+		result.meanUs=0;
+		result.stddevUs=0;
+	}
+
+	count=0;
+	sum=0;
+	sumSquares=0;
+}
@@ -0,0 +1,121 @@
+/*
+	This file is part of the ESP1588 library.
+
+	Copyright 2021 Leif Claesson - https://github.com/leifclaesson
+	Created on: 9 Oct 2021
+
+	ESP1588 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ESP1588 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "PTP.h"
+
+//Statistics and health, see ESP1588::GetStats(). All plain data of a fixed size, so filling it in and passing it around
+//never touches the heap.
+
+#ifndef ESP1588_STATS_SHORT_WINDOW
+#define ESP1588_STATS_SHORT_WINDOW	10		//seconds
+#endif
+
+#ifndef ESP1588_STATS_LONG_WINDOW
+#define ESP1588_STATS_LONG_WINDOW	60		//seconds
+#endif
+
+//Our offset from the master (the servo's view of it, see ESP1588::GetLastDiffMs()) over a window, while locked.
+
+struct ESP1588_OffsetStats
+{
+	uint16_t samples;			//syncs that went into it. 0 if none, and then the rest means nothing
+	int16_t min;				//ms
+	int16_t max;				//ms
+	int32_t meanUs;
+	uint32_t stddevUs;
+};
+
+struct ESP1588_TrackerStats
+{
+	PTP_PORTID id;				//all zeros if there's none
+	bool bHealthy;
+	bool bTwoStep;
+	uint8_t priority1;
+	int8_t logAnnounceInterval;	//what it says it sends at, 0x7F if unknown
+	int8_t logSyncInterval;
+	uint16_t announces;			//received in the last ESP1588_STATS_SHORT_WINDOW. compare with the intervals above to see what's being lost
+	uint16_t syncs;
+};
+
+struct ESP1588_Stats
+{
+	//packets. counts since Begin() or ResetStats()
+
+	uint32_t rxEvent;			//datagrams received on the event port (319)
+	uint32_t rxGeneral;			//..and on the general port (320)
+	uint32_t rxIgnored;			//of those, not for us: other domains, other clocks, other clients' delay requests
+	uint32_t syncAccepted;		//syncs from the master the servo used
+	uint32_t syncRejected;		//..and threw out as too far off
+	uint16_t pps;				//see ESP1588::GetRawPPS()
+
+	//lock
+
+	bool bLocked;
+	bool bHoldover;
+	bool bEpochValid;
+	uint16_t locks;				//times lock was gained
+	uint16_t masterChanges;
+	uint32_t timeToLock;		//ms from the first sync of the latest acquisition to lock, 0 until locked
+
+	//servo
+
+	int16_t lastDiffMs;
+	int16_t meanPathDelayMs;
+	int32_t frequencyPpb;
+	uint32_t holdoverErrorMs;
+	uint8_t dtim;
+	int16_t dtimBoundsMs;		//how far apart the DTIM bounds on the master's offset were at the last sync, -1 unless both agreed
+	uint8_t foreignMasters;
+
+	ESP1588_OffsetStats offsetShort;	//the last complete ESP1588_STATS_SHORT_WINDOW
+	ESP1588_OffsetStats offsetLong;		//the last complete ESP1588_STATS_LONG_WINDOW
+
+	ESP1588_TrackerStats master;
+	ESP1588_TrackerStats candidate;
+};
+
+//Collects ESP1588_OffsetStats over a tumbling window: the figures of the last complete window are there to be read
+//while the next one fills up, and it costs a few additions per sync no matter how long the window is.
+
+class ESP1588_OffsetWindow
+{
+public:
+	ESP1588_OffsetWindow();
+
+	void Reset();					//forgets the completed window too
+
+	void Insert(int32_t diff);		//microseconds
+	void Complete();				//closes the window, making it the one Get() returns
+
+	const ESP1588_OffsetStats & Get() { return result; }
+
+private:
+
+	uint16_t count;
+	int32_t lo;
+	int32_t hi;
+	int64_t sum;
+	uint64_t sumSquares;
+
+	ESP1588_OffsetStats result;
+
+};
@@ -18,15 +18,57 @@
 	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <Arduino.h>
 #include "SyncMgr.h"
 #include "PTP.h"
 
-#define DIFFHIST_SIZE ((int) (sizeof(diffHistory)/sizeof(diffHistory[0])))
+#define DELAYHIST_SIZE ((int) (sizeof(delayHistory)/sizeof(delayHistory[0])))
 
-ESP1588_Sync::ESP1588_Sync()
+//Frequency servo (PI controller), tuned for the peak filter's lag: ~16 second time constant, critically damped. It's fed microseconds.
+#define SERVO_PERIOD	1000		//ms between servo updates
+#define SERVO_KP		62500		//ppb per ms of phase error
+#define SERVO_KI		1000		//ppb per ms of phase error per second
+#define SERVO_MAX_FREQ	500000		//ppb. a crystal that's off by more than 500ppm is broken.
+#define SERVO_STEP		20			//ms. further out than that, step instead of slewing for minutes and winding up the integral
+
+//DTIM burst filtering
+#define BURST_MARGIN		3			//ms of air time jitter on top of the buffering
+#define BURST_RESOLUTION	4			//ms. aim for a delivery per this much of the possible buffering time in the window
+#define BURST_MAX_WINDOW	8000		//ms. much longer and the servo would be chasing old news
+#define BURST_TIGHT			16			//ms. bounds closer than that are good enough to jump to during acquisition
+
+//Once the bounds are that close we jump to their midpoint before declaring lock, so the error at lock is at most half of it,
+//plus the path delay if the master doesn't answer delay requests. Worst of 200 lockbench runs at logSyncInterval -3: 6ms at
+//DTIM 1, 8ms at DTIM 3. At 12 that's 5ms either way, for a DTIM 3 p90 time to lock of 14.1s rather than 11.6s.
+
+//Initial acquisition
+#define ACQUIRE_PACKETS		4			//consecutive diffs that have to agree before we believe a path that doesn't buffer
+#define ACQUIRE_SPREAD		2			//ms they may disagree by
+#define ACQUIRE_TIME		1500		//ms. no agreement by then on a path known not to buffer, jump to the least delayed packet anyway
+#define ACQUIRE_MAX			8000		//ms. the longest we'll wait for the DTIM bounds to close in
+
+//Holdover
+#define HOLDOVER_AVERAGE	10			//log2 of the servo updates the applied frequency is averaged over
+#define HOLDOVER_PHASE		4			//ms. how far the phase may wander while locked, which is what limits how well we know the frequency
+#define HOLDOVER_MIN_PPB	1000		//ppb. crystals wander with temperature even when the servo looked steady
+#define HOLDOVER_TIMEOUT	5000		//ms without an accepted packet before we're on our own
+
+//Warm start
+#define WARM_MAX_AGE		3600000		//ms. after longer than that, the wall clock we predicted the time from will have wandered off too far
+
+//Failover
+#define HANDOVER_MAX_SLEW	100			//ms. masters further apart than that, step to the new one. slewing would take minutes.
+
+//The diffs are measured in microseconds, the thresholds and steps are in milliseconds. Rounded, and without dividing:
+//the same 2^32/1000 as PTP_NanosToMicros(), good for six seconds either way.
+
+static inline int32_t MicrosToMillis(int32_t micros)
 {
+	return (int32_t) (((int64_t) micros*PTP_MICROS_PER_NANO_Q32+(1LL<<31))>>32);
+}
 
+ESP1588_Sync::ESP1588_Sync()
+{
+	memset((void *) snap,0,sizeof(snap));
 }
 
 void ESP1588_Sync::Reset()
@@ -35,33 +77,263 @@ void ESP1588_Sync::Reset()
 
 	bFastInitial=true;
 
-	ulAdjustmentTimestamp=millis();
+	ulAdjustmentTimestamp=ESP1588_Millis();
+
+	diffPeak.Reset();
 
-	for(int i=0;i<DIFFHIST_SIZE;i++)
+	dtim.Reset();
+	burstCeiling.Reset();
+	bBurstPending=false;
+	dtimBounds=-1;
+
+	for(int i=0;i<DELAYHIST_SIZE;i++)
 	{
-		diffHistory[i]=-32768;
+		delayHistory[i]=INT32_MAX;
 	}
 
-	diffHistoryIdx=0;
+	delayHistoryIdx=0;
+
+	bDelayReqPending=false;
+	bPdelayPending=false;
+	peakRawDiffUs=0;
+	meanPathDelayUs=0;
 
 	rejectedPackets=0;
 	acceptedPackets=0;
 
 	bLockStatus=false;
 
+	bSlewing=false;
+	bHoldover=false;
+	bWarm=false;
+	bAcquiring=false;
+
+	//the crystal's frequency error doesn't change because we lost the master, keep what we've learned but drop the phase correction.
+	SetFrequency(lFreqIntegral);
+
+}
+
+void ESP1588_Sync::ResetStandby(const ESP1588_Sync & primary)
+{
+	//a new candidate to follow. our crystal is still the same crystal, so start from what the primary has learned about it.
+
+	lFreqIntegral=primary.lFreqIntegral;
+	lFreqAverage=primary.lFreqAverage;
+	usFreqSamples=primary.usFreqSamples;
+	Reset();
+}
+
+bool ESP1588_Sync::IsConverged()
+{
+	return !bFirst && !bInitialDiffFinding && !bFastInitial && ESP1588_Millis()-ulLastAcceptedPacket<5000;
+}
+
+void ESP1588_Sync::GetState(ESP1588_SyncState & out)
+{
+	out.lFreq=usFreqSamples?lFreqAverage/256:lFreqIntegral;
+	out.usFreqSamples=usFreqSamples;
+	out.meanPathDelay=(int16_t) MicrosToMillis(meanPathDelayUs);
+	out.dtim=dtim.GetKnownDtim();
+	out.ulEpochMillis=GetEpochMillis64();
+	out.bEpochValid=GetEpochValid();
+}
+
+void ESP1588_Sync::Seed(const ESP1588_SyncState & state, uint32_t ulAge)
+{
+	//Warm start after a reboot or deep sleep, call right after Reset(). The crystal and the network are the same as before,
+	//so there's no need to find the frequency and the path delay all over again, or to crawl towards the master.
+
+	lFreqIntegral=state.lFreq;
+	lFreqAverage=state.lFreq*256;
+	usFreqSamples=state.usFreqSamples;
+	SetFrequency(lFreqIntegral);
+
+	meanPathDelayUs=state.meanPathDelay*1000;
+	dtim.Seed(state.dtim);
+
+	bFastInitial=state.dtim!=0;		//DTIM buffering still has to be seen through, acquisition does that. (and jumps as soon as it can.)
+	bWarm=true;
+
+	if(ulAge<WARM_MAX_AGE)
+	{
+		//the platform knows how long we were gone, so we know roughly what time it is even before the first sync arrives.
+		//not locked though, the first sync will put us right.
+
+		uint32_t ulNow=ESP1588_Millis();
+		uint64_t ulEpochMillis=state.ulEpochMillis+ulAge;
+
+		ulOffset=(uint32_t) ulEpochMillis-ulNow;
+		ulOffset64=ulEpochMillis-(uint32_t) ulEpochMillis;
+		ulFreqBase=ulNow;
+		ulFreqFrac=0;
+		bEpochValidInternal=state.bEpochValid;
+
+		Publish();
+	}
+}
+
+void ESP1588_Sync::TakeOver(ESP1588_Sync & standby)
+{
+	//Failover to the master the standby has been following in the background. Adopt everything it has learned about that master,
+	//but keep our timeline where it is and let the servo slew it across, so GetMillis() neither steps nor unlocks.
+
+	uint32_t ulNow=ESP1588_Millis();
+
+	Advance(ulNow);
+	standby.Advance(ulNow);
+
+	int32_t delta=standby.ulOffset-ulOffset;	//how far the new master is from our timeline
+
+	bFirst=standby.bFirst;
+	bFastInitial=standby.bFastInitial;
+	bWarm=standby.bWarm;
+	bInitialDiffFinding=standby.bInitialDiffFinding;
+	ulInitialDiffFindingTimestamp=standby.ulInitialDiffFindingTimestamp;
+
+	ulOffset=standby.ulOffset;
+	ulOffset64=standby.ulOffset64;
+	bEpochValidInternal=standby.bEpochValidInternal;
+
+	lFreq=standby.lFreq;
+	lFreqIntegral=standby.lFreqIntegral;
+	lRateQ32=standby.lRateQ32;
+	lFreqAverage=standby.lFreqAverage;
+	usFreqSamples=standby.usFreqSamples;
+	bHoldover=false;
+	ulFreqBase=standby.ulFreqBase;
+	ulFreqFrac=standby.ulFreqFrac;
+
+	lastDiffMs=standby.lastDiffMs;
+	peakRawDiffUs=standby.peakRawDiffUs;
+
+	diffPeak=standby.diffPeak;
+	dtim=standby.dtim;
+	burstCeiling=standby.burstCeiling;
+	bBurstPending=standby.bBurstPending;
+	ulBurstArrival=standby.ulBurstArrival;
+	burstLastDiffUs=standby.burstLastDiffUs;
+
+	ulAdjustmentTimestamp=standby.ulAdjustmentTimestamp;
+	ulLastAcceptedPacket=standby.ulLastAcceptedPacket;
+	rejectedPackets=standby.rejectedPackets;
+	acceptedPackets=standby.acceptedPackets;
+
+	bTwoStep=standby.bTwoStep;
+	ulTwoStepReceiveTimestamp=standby.ulTwoStepReceiveTimestamp;
+	usTwoStepReceiveMicros=standby.usTwoStepReceiveMicros;
+	usTwoStepSeqId=standby.usTwoStepSeqId;
+	lTwoStepCorrection=standby.lTwoStepCorrection;
+	twoStepCorrectionMicros=standby.twoStepCorrectionMicros;
+
+	//the standby can't ask its master for delay responses. keep our path delay, but the E2E history was measured against the old master.
+
+	for(int i=0;i<DELAYHIST_SIZE;i++)
+	{
+		delayHistory[i]=INT32_MAX;
+	}
+	delayHistoryIdx=0;
+	bDelayReqPending=false;
+
+	bSlewing=false;
+
+	if(abs(delta)<=HANDOVER_MAX_SLEW)
+	{
+		//back onto our timeline. the filters move along, so from here on they see the new master as delta ahead of us.
+
+		MoveOffset(-delta);
+		lastDiffMs+=delta;
+
+		bSlewing=abs(delta)>1;
+	}
+
+	bLockStatus=standby.bLockStatus;
+
+#ifdef PTP_SYNCMGR_DEBUG
+	csprintf("SyncMgr taking over from standby, new master is %d ms away\n",delta);
+#endif
+
+	Publish();
+}
+
+void ESP1588_Sync::Advance(uint32_t ulNow)
+{
+	//fold the frequency correction accumulated since the last call into ulOffset, keeping the fraction of a millisecond.
+	//not through MoveOffset(): the filters hold microseconds measured against the timeline with its fraction, which this
+	//doesn't move.
+
+	int64_t acc=(int64_t) (int32_t) (ulNow-ulFreqBase)*lRateQ32 + ulFreqFrac;
+
+	ulOffset+=(int32_t) (acc>>32);
+	ulFreqFrac=(uint32_t) acc;
+	ulFreqBase=ulNow;
 }
 
-void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
+void ESP1588_Sync::MoveOffset(int32_t delta)
 {
-	uint32_t ulNow=millis();
+	//move our timeline, and everything we remember about packets measured against it, so the filters stay consistent.
+
+	ulOffset+=delta;
+
+	diffPeak.Shift(-delta*1000);
+	burstCeiling.Shift(delta*1000);
+	burstLastDiffUs-=delta*1000;
+}
+
+void ESP1588_Sync::SetFrequency(int32_t ppb)
+{
+	if(ppb>SERVO_MAX_FREQ) ppb=SERVO_MAX_FREQ;
+	if(ppb<-SERVO_MAX_FREQ) ppb=-SERVO_MAX_FREQ;
+
+	lFreq=ppb;
+	lRateQ32=(int32_t) (((int64_t) ppb<<32)/1000000000);	//convert once here so GetMillis() only has to multiply
+}
+
+void ESP1588_Sync::Discipline(int32_t error, uint32_t dt)
+{
+	//PI controller. The integral term learns the crystal's frequency error, the proportional term slews the remaining phase error away
+	//so the timeline stays continuous instead of stepping a millisecond at a time.
+
+	if(dt>4*SERVO_PERIOD) dt=4*SERVO_PERIOD;	//don't let a gap in the packets wind up the integral
+
+	lFreqIntegral+=(int32_t) (((int64_t) error*SERVO_KI*(int32_t) dt)/1000000);
+
+	if(lFreqIntegral>SERVO_MAX_FREQ) lFreqIntegral=SERVO_MAX_FREQ;
+	if(lFreqIntegral<-SERVO_MAX_FREQ) lFreqIntegral=-SERVO_MAX_FREQ;
+
+	SetFrequency(lFreqIntegral+(int32_t) (((int64_t) error*SERVO_KP)/1000));
+
+	//for holdover: the frequency that kept us on time in the long run.
+	//(with the jitter the proportional term dithers around, and carries part of the correction too, so the integral alone won't do.)
+
+	if(usFreqSamples<(1<<HOLDOVER_AVERAGE)) usFreqSamples++;	//plain average until there are enough samples for the moving one
+
+	lFreqAverage+=(lFreq*256-lFreqAverage)/usFreqSamples;
+
+#ifdef PTP_SYNCMGR_DEBUG
+	csprintf("SyncMgr servo: error=%d us freq=%d ppb (integral %d)\n",error,lFreq,lFreqIntegral);
+#endif
+}
+
+void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros)
+{
+	uint32_t ulNow=ulReceiveTimestamp;	//when the packet actually arrived, not when Loop() got around to it
+
+	Advance(ulNow);
 
 	uint32_t ulTwoStepOffset=0;
+	uint16_t usArrivalMicros=usReceiveMicros;
 
 	if(port==319)
 	{
 		bTwoStep=(pkt.header.flagField[0] & 2)!=0;
 	}
 
+	//correctionField carries the residence time in transparent clocks along the way (plus the upstream link delays with P2P).
+	//for two-step it's split between the sync and the follow-up.
+
+	int32_t correction=pkt.header.GetCorrectionMillis();
+	int32_t correctionMicros=pkt.header.GetCorrectionMicros();	//what that truncated
+
 	if(bTwoStep)
 	{
 		/*
@@ -73,7 +345,7 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 		 * The client (that's us) notes the time when we the first packet is received, and when the follow-up packet arrives, check how much time elapsed and
 		 * add that to the timestamp of the second packet, for an more accurate overall timestamp which compensates for the internal delay inside the master clock.
 		 *
-		 * Of course, since we have not currently implemented PEER DELAY, and we're based on milliseconds, this additional precision is moot -- but we still have to
+		 * Of course, since we're based on milliseconds, this additional precision is mostly moot -- but we still have to
 		 * support two-step or it simply will not work with 2-step master clocks.
 		 */
 
@@ -81,6 +353,9 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 		{
 			usTwoStepSeqId=pkt.header.sequenceId;
 			ulTwoStepReceiveTimestamp=ulNow;
+			usTwoStepReceiveMicros=usReceiveMicros;
+			lTwoStepCorrection=correction;
+			twoStepCorrectionMicros=(int16_t) correctionMicros;
 			return;
 		}
 		else if(port==320)
@@ -90,24 +365,22 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 			int32_t diff=ulNow-ulTwoStepReceiveTimestamp;
 
 			ulTwoStepOffset=diff;
+			usArrivalMicros=usTwoStepReceiveMicros;
+			correction+=lTwoStepCorrection;
+			correctionMicros+=twoStepCorrectionMicros;
 		}
 	}
 
 
-	uint32_t ptpmillis=
-			(ntohl(pkt.msg.sync.timestamp_secs)*1000) + (ntohl(pkt.msg.sync.timestamp_nanos)/1000000);
+	uint64_t ptpmillis64=pkt.msg.sync.GetMillis64()+(int32_t) (ulTwoStepOffset+correction);
 
-	uint64_t ptpmillis64=
-			((((uint64_t) ntohs(pkt.msg.sync.timestamp_secs_ESB)<<32) + ntohl(pkt.msg.sync.timestamp_secs))*1000)
-			+ (ntohl(pkt.msg.sync.timestamp_nanos)/1000000);
-
-	ptpmillis+=ulTwoStepOffset;
-	ptpmillis64+=ulTwoStepOffset;
+	uint32_t ptpmillis=(uint32_t) ptpmillis64;
 
 
 	if(bFirst)
 	{
 		ulOffset=ptpmillis-ulNow;
+		ulFreqFrac=0;
 		ulAdjustmentTimestamp=ulNow;
 
 
@@ -115,8 +388,9 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 		//so let's not report that we're locked yet. Set the "initial diff finding" flag, and in a second or so, do one big jump
 		//based on the least delayed packet we found.
 
-		bInitialDiffFinding=true;
+		bInitialDiffFinding=!bWarm;		//a warm start knows the path delay and the frequency already, the servo will take it from here
 		ulInitialDiffFindingTimestamp=ulNow;
+		acquireSteady=0;
 
 
 
@@ -133,18 +407,49 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 		csprintf("MILLIS64  %llu\n",ptpmillis64);
 #endif
 
-		ulOffset64=ptpmillis64 - (millis()+ulOffset);
+		ulOffset64=ptpmillis64 - (ulNow+ulOffset);
 	}
 
 	int32_t diff=ptpmillis-ulOffset-ulNow;
 
+	//the same to the microsecond: what the milliseconds truncated of the master's timestamp and the correction, less how far
+	//into its millisecond the sync arrived and how far into one our timeline was. this is what the filters and the servo see.
+
+	int32_t diffMicros=diff*1000+(int32_t) pkt.msg.sync.GetMicros()+correctionMicros-usArrivalMicros-(int32_t) (((uint64_t) ulFreqFrac*1000)>>32);
+
+
+	//keep track of DTIM bursts (see below). every sync tells us something about those, even one we're about to reject.
+
+	uint32_t ulInterval=1000;
+	if(pkt.header.logMessageInterval<0) ulInterval=1000>>(pkt.header.logMessageInterval>-9?-pkt.header.logMessageInterval:9);
+	if(pkt.header.logMessageInterval>0) ulInterval=1000<<(pkt.header.logMessageInterval<4?pkt.header.logMessageInterval:4);
 
+	uint32_t ulArrival=ulNow-ulTwoStepOffset;		//when the sync itself was delivered
 
+	bool bNewBurst=dtim.Feed(ulArrival);
 
+	uint32_t ulPeriod=dtim.GetPeriod();
+	int32_t maxBuffering=(ulInterval<ulPeriod?ulInterval:ulPeriod)+BURST_MARGIN;
 
-	if(diff<-200 || diff>200)	//too far out
+	if(bNewBurst)
+	{
+		//the previous burst is complete, and the last packet in it (the freshest) was one we accepted.
+		//if its bound is below the lower one, it must have waited longer than it could have (we slept through a beacon?), skip it.
+
+		if(bBurstPending && ulPeriod && burstLastDiffUs+maxBuffering*1000>=diffPeak.GetPeak())
+		{
+			burstCeiling.Insert(ulBurstArrival,-(burstLastDiffUs+maxBuffering*1000));
+		}
+		bBurstPending=false;
+	}
+
+
+
+	if(diff<-200-(int32_t) ulPeriod || diff>200)	//too far out. (a long DTIM period can legitimately hold packets back further than that.)
 	{
 		rejectedPackets++;
+		bBurstPending=false;
+		ulSyncRejected++;
 
 #ifdef PTP_SYNCMGR_DEBUG
 		csprintf("SyncMgr Rejecting diff %d (%u)\n",diff,rejectedPackets);
@@ -172,6 +477,13 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 	}
 
 	rejectedPackets=0;
+	ulSyncAccepted++;
+
+	if(!bLockStatus && !bAcquiring)
+	{
+		bAcquiring=true;
+		ulAcquireStart=ulNow;
+	}
 
 
 	//if(diff<-1000) return;	//that's just too old, we're only interested in the newest packets anyway
@@ -205,75 +517,137 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 
 
 
-	diffHistory[diffHistoryIdx]=diff;
+	//now find the highest recent diff number, that will be from the most recent sync packet, and essentially eats through most of the jitter.
 
-	diffHistoryIdx++;
-	diffHistoryIdx%=DIFFHIST_SIZE;
+	//That's a lower bound for the true diff, the closer to zero the least delayed packet in the window waited, the better.
+	//When we can see deliveries following the DTIM beacons we can do one better: the freshest packet of each burst
+	//can't have waited longer than the sync interval (or the next sync would have made the same beacon) or the DTIM period
+	//(or it would have made the previous one). That's an upper bound, and the truth lies between the two.
 
+	bBurstPending=true;				//the freshest packet of this burst so far
+	ulBurstArrival=ulArrival;
+	burstLastDiffUs=diffMicros;
 
-	//now find the highest recent diff number, that will be from the most recent sync packet, and essentially eats through most of the jitter.
 
-	//let's look four seconds back, but at least 8 packets, and at most the entire history buffer.
+	//how far to look back.
+
+	uint32_t ulWindow;
+
+	if(ulPeriod)
+	{
+		//the wait of each burst's freshest packet walks across the 0..maxBuffering range as the deliveries go by.
+		//look back far enough for both bounds to have gotten close.
 
-	int numpackets=8;
+		uint32_t bursts=(maxBuffering+BURST_RESOLUTION-1)/BURST_RESOLUTION;
+		if(bursts<4) bursts=4;
 
-	if(pkt.header.logMessageInterval<=-2)
+		ulWindow=bursts*ulPeriod;
+		if(ulWindow>BURST_MAX_WINDOW) ulWindow=BURST_MAX_WINDOW;
+		if(ulWindow<64*ulInterval) ulWindow=64*ulInterval;		//slow sync rates need the time to collect enough bursts
+	}
+	else if(dtim.IsSteady())
 	{
-		numpackets=4<<(-pkt.header.logMessageInterval);
+		ulWindow=8*ulInterval;		//no DTIM buffering, just network jitter. 8 packets will do
+		if(ulWindow<1000) ulWindow=1000;
 	}
-	if(numpackets>DIFFHIST_SIZE) numpackets=DIFFHIST_SIZE;
+	else
+	{
+		ulWindow=8*ulInterval;		//don't know yet. four seconds, but at least 8 packets
+		if(ulWindow<4000) ulWindow=4000;
+	}
+
+	diffPeak.SetWindow(ulWindow);
+	burstCeiling.SetWindow(ulWindow);
 
+	diffPeak.Insert(ulNow,diffMicros);
 
+	int32_t peakMicros=diffPeak.GetPeak();
 
-	//start at the last value we wrote and work our way backwards. Add DIFFHIST_SIZE to make sure the values stay positive, then MOD with the history buffer size.
+	//how many diffs in a row have agreed to within ACQUIRE_SPREAD. on a wired or DTIM-less path most packets get through
+	//with about the least delay, so a run of them pins it down. DTIM buffering makes every delivery wait differently, so it never will.
 
-	int idx=(diffHistoryIdx+DIFFHIST_SIZE-1) % DIFFHIST_SIZE;
+	if(acquireSteady && diff>=acquireMax-ACQUIRE_SPREAD && diff<=acquireMin+ACQUIRE_SPREAD)
+	{
+		if(diff<acquireMin) acquireMin=diff;
+		if(diff>acquireMax) acquireMax=diff;
+		if(acquireSteady<255) acquireSteady++;
+	}
+	else
+	{
+		acquireMin=diff;
+		acquireMax=diff;
+		acquireSteady=1;
+	}
 
-	int16_t peak_diff=-32768;
+	bool bTight=false;
+	dtimBounds=-1;
 
-	for(int i=0;i<numpackets;i++)
+	if(ulPeriod)
 	{
-		if(peak_diff<diffHistory[idx]) peak_diff=diffHistory[idx];
+		int32_t ceiling=burstCeiling.GetPeak();
+
+		if(ceiling!=INT32_MIN)
+		{
+			ceiling=-ceiling;
 
-		idx--;
-		if(idx<0) idx=DIFFHIST_SIZE-1;
+			if(ceiling>=peakMicros && ceiling-peakMicros<=maxBuffering*1000)	//if they contradict, trust the lower bound
+			{
+				dtimBounds=(int16_t) MicrosToMillis(ceiling-peakMicros+499);	//rounded up
+				bTight=ceiling-peakMicros<=BURST_TIGHT*1000;
+				peakMicros=(peakMicros+ceiling)>>1;
+			}
+		}
 	}
 
 
 
-	//We'll be nudging one millisecond at a time, so the easiest way to control the amount is to choose the interval.
-	//If we're within +/- one millisecond we'll do nothing
-	//More than that, we'll use progressively larger intervals
+	peakRawDiffUs=peakMicros;
+
+	//The sync packet is already meanPathDelay old when it arrives. Compensate so we end up on the master's time rather than
+	//offset by our own network latency. meanPathDelay stays zero until the master answers our delay requests.
 
+	peakMicros+=meanPathDelayUs;
+
+	int16_t peak_diff=(int16_t) MicrosToMillis(peakMicros);		//what the thresholds and steps below go by
 
-	int interval=5000;
 
 	lastDiffMs=peak_diff;
 
 
 	bool bWasDiffFinding=bInitialDiffFinding;
 
-	if(!bFirst && bInitialDiffFinding && (ulNow-ulInitialDiffFindingTimestamp)>1500)	//make ONE big adjustment to eat right through the jitter
+	bool bBuffered=ulPeriod || !dtim.IsSteady();	//DTIM buffering, or we can't rule it out yet
+
+	if(!bFirst && bInitialDiffFinding)
 	{
-		bInitialDiffFinding=0;
+		//make ONE big adjustment to eat right through the jitter, as soon as we know where the least delayed packets are:
+		//DTIM bounds that have closed in, or a run of diffs that agree. if that's taking a while we jump anyway and let the slow
+		//acquisition below sort it out, but not before giving the bounds a chance on a path that buffers or might.
+
+		bool bConfident=ulPeriod?bTight:acquireSteady>=ACQUIRE_PACKETS;
+
+		if(bConfident || (ulNow-ulInitialDiffFindingTimestamp)>(uint32_t) (bBuffered?ACQUIRE_MAX:ACQUIRE_TIME))
+		{
+			bInitialDiffFinding=0;
 
 #ifdef PTP_SYNCMGR_DEBUG
-		csprintf("SyncMgr Initial diff adjustment: %d\n",peak_diff);
+			csprintf("SyncMgr Initial diff adjustment: %d%s\n",peak_diff,bConfident?" (locked)":"");
 #endif
 
-		ulOffset+=peak_diff;
+			MoveOffset(peak_diff);
 
-		for(int i=0;i<DIFFHIST_SIZE;i++)
-		{
-			if(diffHistory[i]!=-32768)
+			peakMicros-=peak_diff*1000;		//what's left of it is the servo's
+			peak_diff=0;
+			peakRawDiffUs=peakMicros-meanPathDelayUs;
+
+			if(bConfident)	//nothing left for the slow acquisition to do
 			{
-				diffHistory[i]-=peak_diff;
+				bFastInitial=false;
+				bLockStatus=true;
+				ulAdjustmentTimestamp=ulNow;	//hand over to the frequency servo
+				Publish();
 			}
 		}
-
-		peak_diff=0;
-
-
 	}
 
 
@@ -284,68 +658,124 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 	if(!bWasDiffFinding)
 	{
 
+		if(bTight && abs(peak_diff)>1 && (bFastInitial || !bLockStatus))
+		{
+			//we know where we are to within a few ms, no need to crawl (or slew) there. and before the lock check below, which
+			//would take anything within 10ms of where the bounds say we should be.
 
-		if(abs(peak_diff)>=3) interval=2000;
-		if(abs(peak_diff)>=10) interval=1000;
+			ulAdjustmentTimestamp=ulNow;
+			MoveOffset(peak_diff);
 
-		if(bFastInitial)	//if we're far out, adjust more quickly
-		{
-			if(abs(peak_diff)>=20) interval=250;
-			if(abs(peak_diff)>=40) interval=125;
+			peakMicros-=peak_diff*1000;		//what's left of it is the servo's
+			peak_diff=0;
+			peakRawDiffUs=peakMicros-meanPathDelayUs;
 		}
 
+		uint16_t minPackets=5;
+		if(bWarm && (!ulPeriod || bTight)) minPackets=1;	//a warm start needs no convincing, unless DTIM buffering could still be fooling us
 
-
-		if(acceptedPackets>=5)
+		if(acceptedPackets>=minPackets)
 		{
 
 			if(bFastInitial)	//..until we achieve initial "lock"
 			{
-				if(abs(peak_diff)<10) bFastInitial=false;
+				if(abs(peak_diff)<10)
+				{
+					bFastInitial=false;
+					ulAdjustmentTimestamp=ulNow;	//hand over to the frequency servo
+				}
 			}
 
 			if(!bLockStatus)
 			{
-				if(abs(peak_diff)<10) bLockStatus=true;
+				if(abs(peak_diff)<10 && (!bBuffered || bTight)) bLockStatus=true;	//with DTIM buffering, not until the bounds say so
 			}
 			else
 			{
-				if(abs(peak_diff)>20) bLockStatus=false;
+				if(abs(peak_diff)>20 && !bSlewing) bLockStatus=false;	//slewing after a failover, we know exactly where the master is
 			}
 		}
 
-		if((ulNow-ulAdjustmentTimestamp)>=(uint32_t) interval)
+		if(bFastInitial)
 		{
-			ulAdjustmentTimestamp=ulNow;
+			//Initial acquisition.
+
+			//We'll be nudging one millisecond at a time, so the easiest way to control the amount is to choose the interval.
+			//If we're within +/- one millisecond we'll do nothing
+			//More than that, we'll use progressively larger intervals
 
-			//nudge one millisecond at a time
+			int interval=5000;
 
-			if(peak_diff>1)
+			if(abs(peak_diff)>=3) interval=2000;
+			if(abs(peak_diff)>=10) interval=1000;
+			if(abs(peak_diff)>=20) interval=250;	//if we're far out, adjust more quickly
+			if(abs(peak_diff)>=40) interval=125;
+
+			if((ulNow-ulAdjustmentTimestamp)>=(uint32_t) interval)
 			{
-				ulOffset++;
-	#ifdef PTP_SYNCMGR_DEBUG
-				adjust[0]='+';	//advance
-	#endif
+				ulAdjustmentTimestamp=ulNow;
+
+				//nudge one millisecond at a time
+
+				if(peak_diff>1)
+				{
+					MoveOffset(1);
+		#ifdef PTP_SYNCMGR_DEBUG
+					adjust[0]='+';	//advance
+		#endif
+				}
+				else if(peak_diff<-1)
+				{
+					MoveOffset(-1);
+		#ifdef PTP_SYNCMGR_DEBUG
+					adjust[0]='-';	//retard
+		#endif
+				}
 			}
-			else if(peak_diff<-1)
+		}
+		else if((ulNow-ulAdjustmentTimestamp)>=SERVO_PERIOD)
+		{
+			//Tracking. From here on the frequency servo keeps us on time.
+
+			if(bSlewing && abs(peakMicros)<=1000) bSlewing=false;
+
+			if(bSlewing)
+			{
+				//after a failover. proportional only, as fast as the servo is allowed, and leave the integral alone. the crystal didn't change.
+
+				SetFrequency(lFreqIntegral+(int32_t) (((int64_t) peakMicros*SERVO_KP)/1000));
+			}
+			else if(abs(peak_diff)>SERVO_STEP)	//a less delayed packet than any we'd seen during acquisition, most likely
 			{
-				ulOffset--;
-	#ifdef PTP_SYNCMGR_DEBUG
-				adjust[0]='-';	//retard
-	#endif
+				MoveOffset(peak_diff);
 			}
+			else
+			{
+				Discipline(peakMicros,ulNow-ulAdjustmentTimestamp);
+			}
+			ulAdjustmentTimestamp=ulNow;
 		}
 
-		ulConfidentOffset=ulOffset;
+		Publish();
 
-		ulConfidentOffset64=ulOffset64;
+	}
 
-		bEpochValid=bEpochValidInternal;
 
-	}
+	if(bLockStatus)
+	{
+		if(bAcquiring)
+		{
+			bAcquiring=false;
+			usLocks++;
+			ulTimeToLock=ulNow-ulAcquireStart;
+		}
 
+		offsetShort.Insert(peakMicros);
+		offsetLong.Insert(peakMicros);
+	}
 
 	ulLastAcceptedPacket=ulNow;
+	bHoldover=false;		//back in touch
 
 	if(acceptedPackets<0xFFFF)
 	{
@@ -371,35 +801,346 @@ void ESP1588_Sync::FeedSync(PTP_PACKET & pkt, int port)
 
 }
 
-uint64_t ESP1588_Sync::GetEpochMillis64()
+void ESP1588_Sync::DelayReqSent(uint16_t seqId, uint32_t ulSendTimestamp, uint16_t usSendMicros)
 {
-	return millis()+ulConfidentOffset+ulConfidentOffset64;
+	usDelayReqSeqId=seqId;
+	ulDelayReqTimestamp=ulSendTimestamp;
+	usDelayReqMicros=usSendMicros;
+	bDelayReqPending=true;
 }
 
-uint32_t IRAM_ATTR ESP1588_Sync::GetMillis()
+void ESP1588_Sync::FeedDelayResp(PTP_DELAY_RESP_PACKET & pkt)
+{
+	/*
+	 * Delay request-response (end to end) works as follows.
+	 * The master sends a sync at t1 which we receive at t2. We send a delay request at t3, which the master receives at t4
+	 * and reports back in the delay response.
+	 *
+	 * (t2-t1) is the master->us delay plus our clock error, (t4-t3) is the us->master delay minus our clock error,
+	 * so the average of the two is the mean path delay with our clock error cancelled out.
+	 *
+	 * Over WiFi the master->us direction suffers from DTIM buffering, so just like the offset itself we use the fastest packets
+	 * we've seen in each direction rather than the latest ones. For t2-t1 that's simply -peakRawDiffUs.
+	 */
+
+	if(!bDelayReqPending || pkt.header.sequenceId!=usDelayReqSeqId) return;
+
+	bDelayReqPending=false;
+
+	if(bFirst || bInitialDiffFinding) return;	//our offset isn't meaningful yet
+
+	uint32_t t4=pkt.delayResp.receiveTimestamp.GetMillis();
+	int32_t t4Micros=(int32_t) pkt.delayResp.receiveTimestamp.GetMicros();
+
+	t4-=pkt.header.GetCorrectionMillis();	//residence time of our delay request in transparent clocks
+	t4Micros-=pkt.header.GetCorrectionMicros();
+
+	//t3 on our timeline, rate term and all, the same way the sync diffs are measured
+
+	ESP1588_ClockSnapshot snap;
+	GetClockSnapshot(snap);
+
+	uint64_t t3=snap.MillisQ32Micros(ulDelayReqTimestamp,usDelayReqMicros);
+
+	int32_t up=t4-(uint32_t) (t3>>32);
+
+	if(up<-200 || up>200) return;	//too far out
+
+	up=up*1000+t4Micros-(int32_t) (((t3 & 0xFFFFFFFF)*1000)>>32);		//microseconds
+
+	delayHistory[delayHistoryIdx]=up;
+
+	delayHistoryIdx++;
+	delayHistoryIdx%=DELAYHIST_SIZE;
+
+	int32_t up_min=INT32_MAX;
+
+	for(int i=0;i<DELAYHIST_SIZE;i++)
+	{
+		if(up_min>delayHistory[i]) up_min=delayHistory[i];
+	}
+
+	int32_t delay=(up_min-peakRawDiffUs+1)/2;
+
+	if(delay<0) delay=0;	//asymmetry or noise. a negative delay makes no sense.
+
+	meanPathDelayUs=delay;
+
+#ifdef PTP_SYNCMGR_DEBUG
+	csprintf("SyncMgr delay response: up=%d down=%d meanPathDelay=%d us\n",up,-peakRawDiffUs,meanPathDelayUs);
+#endif
+
+}
+
+void ESP1588_Sync::PdelayReqSent(uint16_t seqId, uint32_t ulSendTimestamp, uint16_t usSendMicros)
+{
+	usPdelaySeqId=seqId;
+	ulPdelayReqTimestamp=ulSendTimestamp;
+	usPdelayReqMicros=usSendMicros;
+	bPdelayPending=true;
+}
+
+void ESP1588_Sync::FeedPdelayResp(PTP_PDELAY_RESP_PACKET & pkt, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros)
+{
+	/*
+	 * Peer delay (peer to peer) measures the delay of just our own link, to the transparent clock switch next to us.
+	 * We send a Pdelay_Req at t1, the peer receives it at t2 and answers at t3, we receive the answer at t4.
+	 *
+	 * link delay = ((t4-t1) - (t3-t2)) / 2
+	 *
+	 * t1 and t4 are ours, (t3-t2) is the peer's turnaround time. A one-step peer puts the turnaround in the correctionField
+	 * of the Pdelay_Resp. A two-step peer sends t2 in the Pdelay_Resp and t3 in the Pdelay_Resp_Follow_Up, and may put
+	 * corrections in either.
+	 *
+	 * The transparent clocks add their own link delays and residence times to the correctionField of each sync they forward,
+	 * so our link delay is all that's missing to get the full master->us delay.
+	 *
+	 * All of it in microseconds. The peer's timestamps are only ever subtracted from one another, so they can wrap.
+	 */
+
+	if(!bPdelayPending || pkt.header.sequenceId!=usPdelaySeqId) return;
+
+	ulPdelayRespTimestamp=ulReceiveTimestamp;
+	usPdelayRespMicros=usReceiveMicros;
+	bPdelayTwoStep=(pkt.header.flagField[0] & 2)!=0;
+
+	int32_t correction=pkt.header.GetCorrectionMillis()*1000+pkt.header.GetCorrectionMicros();
+
+	if(!bPdelayTwoStep)
+	{
+		lPdelayTurnaround=correction;
+		bPdelayPending=false;
+		FeedLinkDelay((int32_t) (ulPdelayRespTimestamp-ulPdelayReqTimestamp)*1000+usPdelayRespMicros-usPdelayReqMicros-lPdelayTurnaround);
+	}
+	else
+	{
+		uint32_t t2=pkt.pdelayResp.timestamp.GetMillis()*1000+pkt.pdelayResp.timestamp.GetMicros();
+
+		lPdelayTurnaround=correction-t2;	//t3 to follow
+	}
+}
+
+void ESP1588_Sync::FeedPdelayRespFollowUp(PTP_PDELAY_RESP_PACKET & pkt)
+{
+	if(!bPdelayPending || !bPdelayTwoStep || pkt.header.sequenceId!=usPdelaySeqId) return;
+
+	bPdelayPending=false;
+
+	uint32_t t3=pkt.pdelayResp.timestamp.GetMillis()*1000+pkt.pdelayResp.timestamp.GetMicros();
+
+	lPdelayTurnaround+=t3+pkt.header.GetCorrectionMillis()*1000+pkt.header.GetCorrectionMicros();
+
+	FeedLinkDelay((int32_t) (ulPdelayRespTimestamp-ulPdelayReqTimestamp)*1000+usPdelayRespMicros-usPdelayReqMicros-lPdelayTurnaround);
+}
+
+void ESP1588_Sync::FeedLinkDelay(int32_t roundtrip)
+{
+	if(roundtrip<0 || roundtrip>400000) return;	//too far out
+
+	delayHistory[delayHistoryIdx]=roundtrip;
+
+	delayHistoryIdx++;
+	delayHistoryIdx%=DELAYHIST_SIZE;
+
+	int32_t roundtrip_min=INT32_MAX;
+
+	for(int i=0;i<DELAYHIST_SIZE;i++)
+	{
+		if(roundtrip_min>delayHistory[i]) roundtrip_min=delayHistory[i];
+	}
+
+	meanPathDelayUs=(roundtrip_min+1)/2;
+
+#ifdef PTP_SYNCMGR_DEBUG
+	csprintf("SyncMgr peer delay: roundtrip=%d us meanPathDelay=%d us\n",roundtrip,meanPathDelayUs);
+#endif
+
+}
+
+void ESP1588_Sync::Publish()
 {
-	uint32_t ret=millis()+ulConfidentOffset;
+	ESP1588_ClockSnapshot cur;
+	GetClockSnapshot(cur);
+
+	uint32_t ulNow=ESP1588_Millis();
+
+	ESP1588_ClockSnapshot n;
 
-	int32_t diff=ret-ulLastMillisReturn;
+	n.ulOffset=ulOffset;
+	n.ulFreqBase=ulFreqBase;
+	n.ulFreqFrac=ulFreqFrac;
+	n.lRateQ32=lRateQ32;
+	n.ulOffset64=ulOffset64;
+	n.bEpochValid=bEpochValidInternal;
 
-	if(diff<0 && diff>-1000)	//if we're jumping back between 1 and 1000 milliseconds, just return the same value and wait for reality to catch up.
+	//the floor is what GetMillis() has been returning: if it's still holding for the timeline to catch up, keep holding.
+
+	uint32_t ulTimeline=cur.Millis(ulNow);
+	int32_t behind=ulTimeline-cur.ulFloor;
+	n.ulFloor=(behind<0 && behind>-1000)?cur.ulFloor:ulTimeline;
+
+	//smooth clock: carry on from exactly where the current one is now, and catch up with the new timeline from here.
+	//whatever changed (a servo step, a new master, the first lock) becomes the distance left to go.
+
+	n.ulSlewBase=ulNow;
+	n.ulSlewRateQ32=ulSlewRateQ32;
+	n.lSlewResidual=0;
+
+	if(ulSlewRateQ32)
 	{
-		return ulLastMillisReturn;
+		int64_t residual=(int64_t) (n.MillisQ32(ulNow)-cur.SmoothMillisQ32(ulNow));
+
+		if(ulSlewStepLimitMs && (residual>((int64_t) ulSlewStepLimitMs<<32) || residual<-((int64_t) ulSlewStepLimitMs<<32)))
+		{
+			residual=0;
+		}
+
+		n.lSlewResidual=residual;
 	}
 
-	ulLastMillisReturn=ret;
+	volatile ESP1588_ClockSnapshot & next=snap[snapIdx^1];
+
+	uint32_t generation=cur.generation+1;
+
+	next.generation=generation;		//odd, under construction
+	__sync_synchronize();
+
+	next.ulOffset=n.ulOffset;
+	next.ulFreqBase=n.ulFreqBase;
+	next.ulFreqFrac=n.ulFreqFrac;
+	next.lRateQ32=n.lRateQ32;
+	next.ulOffset64=n.ulOffset64;
+	next.ulFloor=n.ulFloor;
+	next.ulSlewBase=n.ulSlewBase;
+	next.lSlewResidual=n.lSlewResidual;
+	next.ulSlewRateQ32=n.ulSlewRateQ32;
+	next.bEpochValid=n.bEpochValid;
+
+	__sync_synchronize();
+	next.generation=generation+1;
+	__sync_synchronize();
+
+	snapIdx^=1;
+}
+
+void IRAM_ATTR ESP1588_Sync::GetClockSnapshot(ESP1588_ClockSnapshot & out)
+{
+	//Normally one pass. Only a reader on the other ESP32 core, or one that was itself interrupted long enough for
+	//two Publish() calls, will see the generation change and go around again.
+
+	while(true)
+	{
+		volatile ESP1588_ClockSnapshot & s=snap[snapIdx];
+
+		uint32_t generation=s.generation;
+		__sync_synchronize();
+
+		out.ulOffset=s.ulOffset;
+		out.ulFreqBase=s.ulFreqBase;
+		out.ulFreqFrac=s.ulFreqFrac;
+		out.lRateQ32=s.lRateQ32;
+		out.ulOffset64=s.ulOffset64;
+		out.ulFloor=s.ulFloor;
+		out.ulSlewBase=s.ulSlewBase;
+		out.lSlewResidual=s.lSlewResidual;
+		out.ulSlewRateQ32=s.ulSlewRateQ32;
+		out.bEpochValid=s.bEpochValid;
+
+		__sync_synchronize();
+
+		if(!(generation & 1) && s.generation==generation)
+		{
+			out.generation=generation;
+			return;
+		}
+	}
+}
+
+uint64_t IRAM_ATTR ESP1588_Sync::GetEpochMillis64()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	return s.Millis(ESP1588_Millis())+s.ulOffset64;
+}
+
+uint64_t IRAM_ATTR ESP1588_Sync::GetEpochMicros64()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	uint16_t usMicros;
+	uint32_t ulLocal=ESP1588_MillisMicros(usMicros);
+
+	return s.EpochMicros(ulLocal,usMicros);
+}
+
+uint64_t IRAM_ATTR ESP1588_Sync::GetEpochNanos64()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	uint16_t usMicros;
+	uint32_t ulLocal=ESP1588_MillisMicros(usMicros);
+
+	return s.EpochNanos(ulLocal,usMicros);
+}
+
+uint32_t IRAM_ATTR ESP1588_Sync::GetMillis()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	uint32_t ulLocal=ESP1588_Millis();
+
+	if(s.ulSlewRateQ32) return s.SmoothMillis(ulLocal);	//never goes back by construction, see Publish()
+
+	uint32_t ret=s.Millis(ulLocal);
+
+	int32_t diff=ret-s.ulFloor;
+
+	if(diff<0 && diff>-1000)	//if we've jumped back between 1 and 1000 milliseconds, just return the same value and wait for reality to catch up.
+	{
+		return s.ulFloor;
+	}
 
 	return ret;
 }
 
+uint32_t IRAM_ATTR ESP1588_Sync::GetRawMillis()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	return s.Millis(ESP1588_Millis());
+}
+
+int32_t ESP1588_Sync::GetSlewRemainingMs()
+{
+	ESP1588_ClockSnapshot s;
+	GetClockSnapshot(s);
+
+	int64_t res=s.SlewResidual(ESP1588_Millis());
+
+	return (int32_t) (res<0?-(-res>>32):res>>32);
+}
+
+void ESP1588_Sync::SetSmoothClock(uint32_t maxSlewPpm, uint32_t ulStepLimitMs)
+{
+	if(maxSlewPpm>500000) maxSlewPpm=500000;	//half again as fast, or half as fast. any slower and it could stop
+
+	ulSlewRateQ32=(uint32_t) (((uint64_t) maxSlewPpm<<32)/1000000);
+	ulSlewStepLimitMs=ulStepLimitMs;
+}
+
 bool ESP1588_Sync::GetLockStatus()
 {
 	return bLockStatus;
 }
 
-bool ESP1588_Sync::GetEpochValid()
+bool IRAM_ATTR ESP1588_Sync::GetEpochValid()
 {
-	return bEpochValid;
+	return snap[snapIdx].bEpochValid;
 }
 
 int16_t ESP1588_Sync::GetLastDiffMs()
@@ -407,23 +1148,108 @@ int16_t ESP1588_Sync::GetLastDiffMs()
 	return lastDiffMs;
 }
 
+int16_t ESP1588_Sync::GetMeanPathDelayMs()
+{
+	return (int16_t) MicrosToMillis(meanPathDelayUs);
+}
+
+int32_t ESP1588_Sync::GetFrequencyPpb()
+{
+	return lFreq;
+}
+
 
 void ESP1588_Sync::Housekeeping()
 {
-	if(bLockStatus)
+	uint32_t ulNow=ESP1588_Millis();
+
+	if(bLockStatus && (int32_t) (ulNow-ulLastAcceptedPacket)>HOLDOVER_TIMEOUT)
 	{
-		if(millis()-ulLastAcceptedPacket>5000)
+		if(!bHoldover)
+		{
+			//Lost the master. Rather than free-running on the raw crystal, carry on at the average of what we've learned about it,
+			//without whatever phase correction was in progress, and stay locked as long as we can't have drifted too far.
+
+			bHoldover=true;
+
+			Advance(ulNow);
+			SetFrequency(usFreqSamples?lFreqAverage/256:lFreqIntegral);
+			Publish();
+
+#ifdef PTP_SYNCMGR_DEBUG
+			csprintf("SyncMgr holdover at %d ppb, averaged over %u\n",lFreq,usFreqSamples);
+#endif
+		}
+
+		if(GetHoldoverErrorMs()>usHoldoverLimitMs)
 		{
 			bLockStatus=false;
+			bHoldover=false;
 		}
 	}
 
 
 #ifdef PTP_SYNCMGR_DEBUG
-	if(millis()-ulLastAcceptedPacket>5000)
+	if(ulNow-ulLastAcceptedPacket>HOLDOVER_TIMEOUT)
 	{
 		csprintf("SyncMgr is not receiving packets.\n");
 	}
 #endif
 
 }
+
+uint32_t ESP1588_Sync::GetHoldoverAgeMs()
+{
+	if(!bHoldover) return 0;
+
+	return ESP1588_Millis()-ulLastAcceptedPacket;
+}
+
+uint32_t ESP1588_Sync::GetHoldoverErrorMs()
+{
+	//the phase wanders by up to HOLDOVER_PHASE while locked. that's how well we knew where we were when the packets stopped,
+	//and that over the span of the average is how well we know the frequency we've been running at since.
+
+	if(!bHoldover) return 0;
+
+	uint32_t ppb=(usFreqSamples?HOLDOVER_PHASE*(1000000000/SERVO_PERIOD)/usFreqSamples:SERVO_MAX_FREQ)+HOLDOVER_MIN_PPB;
+
+	return HOLDOVER_PHASE+(uint32_t) (((uint64_t) GetHoldoverAgeMs()*ppb)/1000000000);
+}
+
+void ESP1588_Sync::GetStats(ESP1588_Stats & out)
+{
+	out.syncAccepted=ulSyncAccepted;
+	out.syncRejected=ulSyncRejected;
+
+	out.bLocked=GetLockStatus();
+	out.bHoldover=bHoldover;
+	out.bEpochValid=GetEpochValid();
+	out.locks=usLocks;
+	out.timeToLock=ulTimeToLock;
+
+	out.lastDiffMs=GetLastDiffMs();
+	out.meanPathDelayMs=GetMeanPathDelayMs();
+	out.frequencyPpb=GetFrequencyPpb();
+	out.holdoverErrorMs=GetHoldoverErrorMs();
+	out.dtim=GetDtim();
+	out.dtimBoundsMs=GetDtimBoundsMs();
+
+	out.offsetShort=offsetShort.Get();
+	out.offsetLong=offsetLong.Get();
+}
+
+void ESP1588_Sync::CompleteStatsWindow(bool bLong)
+{
+	(bLong?offsetLong:offsetShort).Complete();
+}
+
+void ESP1588_Sync::ResetStats()
+{
+	ulSyncAccepted=0;
+	ulSyncRejected=0;
+	usLocks=0;
+	ulTimeToLock=0;
+	offsetShort.Reset();
+	offsetLong.Reset();
+}
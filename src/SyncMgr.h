@@ -21,17 +21,125 @@
 #pragma once
 
 #include "PTP.h"
+#include "PeakFilter.h"
+#include "DtimEstimator.h"
+#include "Stats.h"
+
+//Everything needed to turn local time into PTP time, published as a unit by the sync manager.
+//Plain data, so it can be copied out and used from any context.
+
+struct ESP1588_ClockSnapshot
+{
+	uint32_t ulOffset;			//PTP millis = local millis + ulOffset + rate term
+	uint32_t ulFreqBase;		//local millis the rate term counts from
+	uint32_t ulFreqFrac;		//fraction of a millisecond already accumulated at ulFreqBase, of 2^32
+	int32_t lRateQ32;			//frequency correction as a fraction of 2^32
+	uint64_t ulOffset64;		//upper part of the 64-bit epoch millis
+	uint32_t ulFloor;			//timeline value when this was published, GetMillis() doesn't go back below it
+	uint32_t ulSlewBase;		//smooth clock: local millis lSlewResidual was measured at
+	int64_t lSlewResidual;		//..how far it was behind PTP time then, in milliseconds of 2^32
+	uint32_t ulSlewRateQ32;		//..and how fast it catches up, per local millisecond, of 2^32. 0 if it's off
+	bool bEpochValid;
+	uint32_t generation;		//odd while being written
+
+	uint32_t IRAM_ATTR Millis(uint32_t ulLocal) const
+	{
+		int64_t acc=(int64_t) (int32_t) (ulLocal-ulFreqBase)*lRateQ32 + ulFreqFrac;
+
+		return ulLocal+ulOffset+(int32_t) (acc>>32);
+	}
+
+	uint64_t IRAM_ATTR MillisQ32(uint32_t ulLocal) const		//Millis() in 32.32 fixed point
+	{
+		int64_t acc=(int64_t) (int32_t) (ulLocal-ulFreqBase)*lRateQ32 + ulFreqFrac;
+
+		return ((uint64_t) (ulLocal+ulOffset)<<32)+acc;
+	}
+
+	uint64_t IRAM_ATTR MillisQ32Micros(uint32_t ulLocal, uint16_t usMicros) const	//MillisQ32() usMicros later, see ESP1588_MillisMicros()
+	{
+		uint32_t fraction=(uint32_t) (((uint64_t) usMicros*1099511628ULL)>>8);	//of 2^32, times 2^40/1000
+
+		return MillisQ32(ulLocal)+fraction+(((int64_t) fraction*lRateQ32)>>32);
+	}
+
+	uint64_t IRAM_ATTR EpochMicros(uint32_t ulLocal, uint16_t usMicros) const
+	{
+		uint64_t q=MillisQ32Micros(ulLocal,usMicros);
+
+		return ((uint32_t) (q>>32)+ulOffset64)*1000+(((q & 0xFFFFFFFF)*1000)>>32);
+	}
+
+	uint64_t IRAM_ATTR EpochNanos(uint32_t ulLocal, uint16_t usMicros) const
+	{
+		uint64_t q=MillisQ32Micros(ulLocal,usMicros);
+
+		return ((uint32_t) (q>>32)+ulOffset64)*1000000+(((q & 0xFFFFFFFF)*1000000)>>32);
+	}
+
+	int64_t IRAM_ATTR SlewResidual(uint32_t ulLocal) const		//how far the smooth clock is behind Millis(), of 2^32
+	{
+		int64_t res=lSlewResidual;
+		if(!res) return 0;
+
+		uint64_t closed=(uint64_t) (ulLocal-ulSlewBase)*ulSlewRateQ32;
+
+		if(res>0) return closed>=(uint64_t) res?0:res-(int64_t) closed;
+		return closed>=(uint64_t) -res?0:res+(int64_t) closed;
+	}
+
+	uint64_t IRAM_ATTR SmoothMillisQ32(uint32_t ulLocal) const
+	{
+		return MillisQ32(ulLocal)-SlewResidual(ulLocal);
+	}
+
+	uint32_t IRAM_ATTR SmoothMillis(uint32_t ulLocal) const	//GetMillis() when the smooth clock is on
+	{
+		return (uint32_t) (SmoothMillisQ32(ulLocal)>>32);
+	}
+};
+
+//What a warm start needs to know, see ESP1588::SetStatePersistence().
+
+struct ESP1588_SyncState
+{
+	int32_t lFreq;				//ppb, the long term frequency correction
+	uint16_t usFreqSamples;		//servo updates that went into it
+	int16_t meanPathDelay;		//ms
+	uint8_t dtim;				//ESP1588_DTIM_UNKNOWN if we hadn't found out
+	uint64_t ulEpochMillis;		//PTP time when saved
+	bool bEpochValid;
+};
 
 class ESP1588_Sync
 {
 private:
 	friend class ESP1588;
+	friend class ESP1588_FastClock;
+	friend class ESP1588_Tests;		//extras/host/tests.cpp
 
 	ESP1588_Sync();
 
 	void Reset();
+	void ResetStandby(const ESP1588_Sync & primary);
+
+	bool IsConverged();
 
-	void FeedSync(PTP_PACKET & pkt, int port);
+	void GetState(ESP1588_SyncState & out);
+	void Seed(const ESP1588_SyncState & state, uint32_t ulAge);
+	void TakeOver(ESP1588_Sync & standby);
+
+	//timestamps are ESP1588_Millis() and the microseconds into that millisecond, see ESP1588_MillisMicros()
+
+	void FeedSync(PTP_PACKET & pkt, int port, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros=0);
+
+	void DelayReqSent(uint16_t seqId, uint32_t ulSendTimestamp, uint16_t usSendMicros=0);
+	void FeedDelayResp(PTP_DELAY_RESP_PACKET & pkt);
+
+	void PdelayReqSent(uint16_t seqId, uint32_t ulSendTimestamp, uint16_t usSendMicros=0);
+	void FeedPdelayResp(PTP_PDELAY_RESP_PACKET & pkt, uint32_t ulReceiveTimestamp, uint16_t usReceiveMicros=0);
+	void FeedPdelayRespFollowUp(PTP_PDELAY_RESP_PACKET & pkt);
+	void FeedLinkDelay(int32_t roundtrip);		//microseconds
 
 	bool GetLockStatus();
 	bool GetEpochValid();
@@ -39,11 +147,35 @@ private:
 	void Housekeeping();
 
 	int16_t GetLastDiffMs();
+	int16_t GetMeanPathDelayMs();
+	int32_t GetFrequencyPpb();
+
+	bool GetHoldover() { return bHoldover; }
+	uint32_t GetHoldoverAgeMs();
+	uint32_t GetHoldoverErrorMs();
+	uint8_t GetDtim() { return dtim.GetDtim(); }
+	int16_t GetDtimBoundsMs() { return dtimBounds; }
+
+	void GetStats(ESP1588_Stats & out);		//our part of it
+	void CompleteStatsWindow(bool bLong);
+	void ResetStats();
 
 	uint32_t GetMillis();
+	uint32_t GetRawMillis();
+	int32_t GetSlewRemainingMs();
 	uint64_t GetEpochMillis64();
+	uint64_t GetEpochMicros64();
+	uint64_t GetEpochNanos64();
+
+	void SetSmoothClock(uint32_t maxSlewPpm, uint32_t ulStepLimitMs);
 
-	uint32_t ulLastMillisReturn=0;
+	void GetClockSnapshot(ESP1588_ClockSnapshot & out);
+	void Publish();
+
+	void MoveOffset(int32_t delta);
+	void Advance(uint32_t ulNow);
+	void SetFrequency(int32_t ppb);
+	void Discipline(int32_t error, uint32_t dt);	//error in microseconds, dt in milliseconds
 
 	bool bLockStatus=false;
 
@@ -51,23 +183,56 @@ private:
 
 	bool bFastInitial=false;
 
+	bool bWarm=false;			//seeded from a saved state, skip the slow parts of acquisition
+
+	bool bSlewing=false;		//taken over from the standby with a phase difference, slewing it away instead of stepping
+
 	uint32_t ulOffset=0;
 
 	uint64_t ulOffset64=0;
 
 
-	uint32_t ulConfidentOffset=0;
+	//What GetMillis() and friends use, double buffered: Publish() writes the inactive copy and then flips snapIdx,
+	//so a reader (even an ISR that interrupted Publish()) always finds a complete copy without locks or disabling interrupts.
+
+	volatile ESP1588_ClockSnapshot snap[2];
+	volatile uint8_t snapIdx=0;
+
+	//smooth clock, see ESP1588::SetSmoothClock(). the snapshots carry it, Publish() hands over whatever is left to catch up.
+
+	uint32_t ulSlewRateQ32=0;		//per local millisecond, of 2^32. 0 if off
+	uint32_t ulSlewStepLimitMs=0;	//step differences bigger than this instead, 0 never
+
 
-	uint64_t ulConfidentOffset64=0;
+	//frequency servo. our timeline runs at (1 + lFreq/1e9) times the local clock.
 
+	int32_t lFreq=0;				//ppb, positive if our crystal is slow
+	int32_t lFreqIntegral=0;		//ppb, the integral term alone, i.e. the learned crystal error
+	int32_t lRateQ32=0;				//lFreq as a fraction of 2^32
+	uint32_t ulFreqBase=0;			//local time the frequency correction was last folded into ulOffset
+	uint32_t ulFreqFrac=0;			//fraction of a millisecond left over from that, of 2^32
+
+	//holdover. when the master goes quiet we carry on at the learned frequency until we could be too far off to call it locked.
+
+	int32_t lFreqAverage=0;			//ppb * 256, long term average of lFreq
+	uint16_t usFreqSamples=0;		//servo updates in the average so far
+	bool bHoldover=false;
+	uint16_t usHoldoverLimitMs=20;	//error bound beyond which holdover gives up the lock
 
-	bool bEpochValid=false;
 
 
 	int16_t lastDiffMs=0;
 
-	int16_t diffHistory[64];
-	uint16_t diffHistoryIdx=0;
+	ESP1588_PeakFilter diffPeak;			//lower bound of the true diff: the least delayed packet. microseconds, like the rest of the diffs
+
+	//DTIM burst delivery
+
+	ESP1588_DtimEstimator dtim;
+	ESP1588_PeakFilter burstCeiling;		//upper bound of the true diff from the freshest packet of each burst, negated
+	bool bBurstPending=false;
+	uint32_t ulBurstArrival=0;
+	int32_t burstLastDiffUs=0;
+	int16_t dtimBounds=-1;					//ms between the two bounds at the last sync, -1 unless they agreed
 
 	uint32_t ulAdjustmentTimestamp=0;
 
@@ -80,13 +245,54 @@ private:
 	bool bTwoStep=false;
 
 	uint32_t ulTwoStepReceiveTimestamp=0;
+	uint16_t usTwoStepReceiveMicros=0;
 	uint16_t usTwoStepSeqId=0;
+	int32_t lTwoStepCorrection=0;
+	int16_t twoStepCorrectionMicros=0;
 
 	bool bInitialDiffFinding=false;
 	uint32_t ulInitialDiffFindingTimestamp=0;
+	int16_t acquireMin=0;			//the latest run of diffs that agree, see ACQUIRE_SPREAD
+	int16_t acquireMax=0;
+	uint8_t acquireSteady=0;		//..and how long it is
 
 	bool bEpochValidInternal=false;
 
+	//delay request-response (E2E) and peer delay (P2P)
+
+	int32_t peakRawDiffUs=0;	//peak diff without path delay compensation, i.e. minus the fastest master->us delay
+
+	bool bDelayReqPending=false;
+	uint16_t usDelayReqSeqId=0;
+	uint32_t ulDelayReqTimestamp=0;
+	uint16_t usDelayReqMicros=0;
+
+	int32_t delayHistory[8];	//microseconds. E2E: us->master delay of recent exchanges. P2P: link delay of recent exchanges
+	uint8_t delayHistoryIdx=0;
+
+	bool bPdelayPending=false;
+	bool bPdelayTwoStep=false;
+	uint16_t usPdelaySeqId=0;
+	uint32_t ulPdelayReqTimestamp=0;		//t1
+	uint16_t usPdelayReqMicros=0;
+	uint32_t ulPdelayRespTimestamp=0;		//t4
+	uint16_t usPdelayRespMicros=0;
+	int32_t lPdelayTurnaround=0;			//(t3-t2) as far as we know it yet, microseconds
+
+	int32_t meanPathDelayUs=0;
+
+	//statistics, see ESP1588_Stats. they outlive Reset()
+
+	uint32_t ulSyncAccepted=0;
+	uint32_t ulSyncRejected=0;
+	uint16_t usLocks=0;
+	bool bAcquiring=false;			//unlocked and hearing from the master
+	uint32_t ulAcquireStart=0;		//..since
+	uint32_t ulTimeToLock=0;		//of the latest acquisition that got there
+
+	ESP1588_OffsetWindow offsetShort;
+	ESP1588_OffsetWindow offsetLong;
+
 
 };
 
@@ -18,8 +18,6 @@
 	along with ESP1588.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <Arduino.h>
-#include <WiFiUDP.h>
 #include "Tracker.h"
 
 #ifdef PTP_TRACKER_DEBUG
@@ -47,6 +45,7 @@ void ESP1588_Tracker::Take(ESP1588_Tracker & candidate)
 {
 	id=candidate.id;
 	msgAnnounce=candidate.msgAnnounce;
+	key=candidate.key;
 	logSyncInterval=candidate.logSyncInterval;
 	logAnnounceInterval=candidate.logAnnounceInterval;
 	syncCount=candidate.syncCount;
@@ -55,6 +54,10 @@ void ESP1588_Tracker::Take(ESP1588_Tracker & candidate)
 	maintenanceCounterSync=candidate.maintenanceCounterSync;
 	maintenanceCounterAnnounce=candidate.maintenanceCounterAnnounce;
 	bHealthy=candidate.bHealthy;
+	usAnnounceRx=candidate.usAnnounceRx;
+	usSyncRx=candidate.usSyncRx;
+	usAnnounceWindow=candidate.usAnnounceWindow;
+	usSyncWindow=candidate.usSyncWindow;
 
 	candidate.Reset();
 }
@@ -63,6 +66,7 @@ void ESP1588_Tracker::Reset()
 {
 	memset(&id,0,sizeof(id));
 	memset(&msgAnnounce,0xFF,sizeof(msgAnnounce));
+	key=PTP_BMCA_KEY::Worst();
 
 	logSyncInterval=0x7F;
 	logAnnounceInterval=0x7F;
@@ -73,6 +77,10 @@ void ESP1588_Tracker::Reset()
 	maintenanceCounterAnnounce=0;
 	bHealthy=false;
 	bTwoStep=false;
+	usAnnounceRx=0;
+	usSyncRx=0;
+	usAnnounceWindow=0;
+	usSyncWindow=0;
 
 }
 
@@ -89,16 +97,28 @@ void ESP1588_Tracker::Start(PTP_ANNOUNCE_PACKET & pkt)
 	FeedAnnounce(pkt);
 }
 
+void ESP1588_Tracker::Expect(const PTP_PORTID & master)
+{
+	//the master we were locked to before a reboot. its syncs are let through before its first announce arrives,
+	//which the BMCA still gets to judge as usual.
+
+	Reset();
+	id=master;
+}
+
 void ESP1588_Tracker::FeedAnnounce(PTP_ANNOUNCE_PACKET & pkt)
 {
 	logAnnounceInterval=pkt.header.logMessageInterval;
 	msgAnnounce=pkt.announce;
+	key=PTP_BMCA_KEY::From(pkt.announce);
 
 	if(announceCount<5)
 	{
 		announceCount++;
 	}
 
+	if(usAnnounceRx<0xFFFF) usAnnounceRx++;
+
 	CheckHealth();
 
 }
@@ -113,6 +133,7 @@ void ESP1588_Tracker::FeedSync(PTP_PACKET & pkt, int port)
 	case 319:
 		bTwoStep=(pkt.header.flagField[0] & 2)!=0;
 		if(syncCount<10) syncCount++;
+		if(usSyncRx<0xFFFF) usSyncRx++;
 		break;
 	case 320:
 		if(syncCount2<10) syncCount2++;
@@ -196,6 +217,27 @@ void ESP1588_Tracker::Housekeeping()
 }
 
 
+void ESP1588_Tracker::CompleteWindow()
+{
+	usAnnounceWindow=usAnnounceRx;
+	usSyncWindow=usSyncRx;
+	usAnnounceRx=0;
+	usSyncRx=0;
+}
+
+void ESP1588_Tracker::GetStats(ESP1588_TrackerStats & out)
+{
+	out.id=id;
+	out.bHealthy=Healthy();
+	out.bTwoStep=bTwoStep;
+	out.priority1=HasValidSource()?msgAnnounce.grandmasterPriority1:0xFF;
+	out.logAnnounceInterval=logAnnounceInterval;
+	out.logSyncInterval=logSyncInterval;
+	out.announces=usAnnounceWindow;
+	out.syncs=usSyncWindow;
+}
+
+
 #ifdef PTP_TRACKER_DEBUG
 void ESP1588_Tracker::debug_id()
 {
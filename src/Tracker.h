@@ -21,6 +21,7 @@
 #pragma once
 
 #include "PTP.h"
+#include "Stats.h"
 
 int BMCA_compare(const PTP_ANNOUNCE_MESSAGE & a,const PTP_ANNOUNCE_MESSAGE & b);
 
@@ -43,6 +44,8 @@ public:
 	int8_t GetLogAnnounceInternal() { return logAnnounceInterval; }
 	int8_t GetLogSyncInternal() { return logSyncInterval; }
 
+	void GetStats(ESP1588_TrackerStats & out);
+
 
 private:
 	friend class ESP1588;
@@ -58,15 +61,18 @@ private:
 
 	PTP_PORTID id;
 	PTP_ANNOUNCE_MESSAGE msgAnnounce;
+	PTP_BMCA_KEY key;			//of msgAnnounce
 
 	void Reset();
 
 	void Start(PTP_ANNOUNCE_PACKET & pkt);
+	void Expect(const PTP_PORTID & master);
 
 	void FeedAnnounce(PTP_ANNOUNCE_PACKET & pkt);
 	void FeedSync(PTP_PACKET & pkt, int port);
 
 	void Housekeeping();
+	void CompleteWindow();		//every ESP1588_STATS_SHORT_WINDOW
 
 
 	int8_t logSyncInterval;
@@ -85,6 +91,11 @@ private:
 
 	bool bHealthy;
 
+	uint16_t usAnnounceRx;			//in the current stats window
+	uint16_t usSyncRx;
+	uint16_t usAnnounceWindow;		//in the last complete one
+	uint16_t usSyncWindow;
+
 	bool bTwoStep=false;
 
 	void CheckHealth();